@@ -42,7 +42,49 @@ void block_read(struct block *block, block_sector_t sector, void *buffer) {
   ASSERT(block != NULL);
   check_sector(block, sector);
   block->ops->read(block->aux, sector, buffer);
-  block->read_cnt++;
+  __atomic_add_fetch(&block->read_cnt, 1, __ATOMIC_RELAXED);
+}
+
+/* Reads the CNT sectors starting at SECTOR from BLOCK into BUFFER,
+   which must have room for CNT * BLOCK_SECTOR_SIZE bytes.  Drivers
+   that can, transfer the whole run in one request. */
+void block_read_run(struct block *block, block_sector_t sector, size_t cnt,
+                    void *buffer) {
+  ASSERT(block != NULL);
+  if (cnt == 0)
+    return;
+  check_sector(block, sector);
+  check_sector(block, sector + cnt - 1);
+  if (block->ops->read_run != NULL)
+    block->ops->read_run(block->aux, sector, cnt, buffer);
+  else {
+    size_t i;
+    for (i = 0; i < cnt; i++)
+      block->ops->read(block->aux, sector + i,
+                       (uint8_t *)buffer + i * BLOCK_SECTOR_SIZE);
+  }
+  __atomic_add_fetch(&block->read_cnt, cnt, __ATOMIC_RELAXED);
+}
+
+/* Returns the first sector at or after SECTOR of BLOCK that may
+   hold nonzero data, and stores in *DATA_END the end of the run of
+   such sectors that starts there.  Sectors outside those runs are
+   known to read as zeros.  Returns the size of BLOCK if there is no
+   data left.  Without driver support, the whole rest of the device
+   is one run. */
+block_sector_t block_seek_data(struct block *block, block_sector_t sector,
+                               block_sector_t *data_end) {
+  ASSERT(block != NULL);
+  *data_end = block->size;
+  if (sector >= block->size)
+    return block->size;
+  if (block->ops->seek_data == NULL)
+    return sector;
+
+  sector = block->ops->seek_data(block->aux, sector, data_end);
+  if (*data_end > block->size || *data_end <= sector)
+    *data_end = block->size;
+  return sector < block->size ? sector : block->size;
 }
 
 /* Write sector SECTOR to BLOCK from BUFFER, which must contain
@@ -52,7 +94,7 @@ void block_write(struct block *block, block_sector_t sector,
                  const void *buffer) {
   check_sector(block, sector);
   block->ops->write(block->aux, sector, buffer);
-  block->write_cnt++;
+  __atomic_add_fetch(&block->write_cnt, 1, __ATOMIC_RELAXED);
 }
 
 /* Returns the number of sectors in BLOCK. */
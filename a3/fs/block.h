@@ -28,6 +28,9 @@ void block_set_hd(struct block *);
 /* Block device operations. */
 block_sector_t block_size(struct block *);
 void block_read(struct block *, block_sector_t, void *);
+void block_read_run(struct block *, block_sector_t, size_t cnt, void *);
+block_sector_t block_seek_data(struct block *, block_sector_t,
+                               block_sector_t *data_end);
 void block_write(struct block *, block_sector_t, const void *);
 const char *block_name(struct block *);
 
@@ -36,6 +39,12 @@ const char *block_name(struct block *);
 struct block_operations {
   void (*read)(void *aux, block_sector_t, void *buffer);
   void (*write)(void *aux, block_sector_t, const void *buffer);
+  /* Optional: reads a run of sectors in one request. */
+  void (*read_run)(void *aux, block_sector_t, size_t cnt, void *buffer);
+  /* Optional: finds the next sectors that may hold data; see
+     block_seek_data(). */
+  block_sector_t (*seek_data)(void *aux, block_sector_t,
+                              block_sector_t *data_end);
 };
 
 struct block *block_register(const char *name, const char *fname,
@@ -1,6 +1,10 @@
 #include "cache.h"
+#include "checksum.h"
 #include "debug.h"
+#include "dedup.h"
 #include "filesys.h"
+#include "journal.h"
+#include <pthread.h>
 #include <string.h>
 
 #define BUFFER_CACHE_SIZE 64
@@ -18,6 +22,10 @@ struct buffer_cache_entry_t {
 /* Buffer cache entries. */
 static struct buffer_cache_entry_t cache[BUFFER_CACHE_SIZE];
 
+/* Guards the entries and the clock hand, so that several threads
+   (e.g. parallel find_file) can read through the cache at once. */
+static pthread_mutex_t cache_lock = PTHREAD_MUTEX_INITIALIZER;
+
 void buffer_cache_init(void) {
   // initialize entries
   size_t i;
@@ -32,18 +40,38 @@ static void buffer_cache_flush(struct buffer_cache_entry_t *entry) {
   ASSERT(entry != NULL && entry->occupied == true);
 
   if (entry->dirty) {
+    checksum_update(entry->disk_sector, entry->buffer);
     block_write(fs_device, entry->disk_sector, entry->buffer);
     entry->dirty = false;
   }
 }
 
-void buffer_cache_close(void) {
+/* Writes every dirty entry back to disk, commits the journal, and
+   writes back the checksums.  Used as a write barrier: everything
+   written through the cache before the call is on disk when it
+   returns. */
+void buffer_cache_sync(void) {
   size_t i;
+  journal_commit();
+  pthread_mutex_lock(&cache_lock);
   for (i = 0; i < BUFFER_CACHE_SIZE; ++i) {
     if (cache[i].occupied == false)
       continue;
     buffer_cache_flush(&(cache[i]));
   }
+  pthread_mutex_unlock(&cache_lock);
+  checksum_flush();
+}
+
+void buffer_cache_close(void) { buffer_cache_sync(); }
+
+/* Reads SECTOR as it stands: from the running journal transaction if
+   that has changed it, else from disk, verifying its checksum. */
+static void buffer_cache_fill(block_sector_t sector, void *target) {
+  if (!journal_lookup(sector, target)) {
+    block_read(fs_device, sector, target);
+    checksum_verify(sector, target);
+  }
 }
 
 /**
@@ -63,6 +91,17 @@ static struct buffer_cache_entry_t *buffer_cache_lookup(block_sector_t sector) {
   return NULL; // cache miss
 }
 
+/* Writes SECTOR back to disk now if it is dirty in the cache.  A
+   sector the journal holds is not dirty: it reaches its home when
+   the transaction commits. */
+void buffer_cache_write_back(block_sector_t sector) {
+  pthread_mutex_lock(&cache_lock);
+  struct buffer_cache_entry_t *slot = buffer_cache_lookup(sector);
+  if (slot != NULL)
+    buffer_cache_flush(slot);
+  pthread_mutex_unlock(&cache_lock);
+}
+
 /**
  * Obtain a free cache entry slot.
  * If there is an unoccupied slot already, return it.
@@ -99,6 +138,7 @@ static struct buffer_cache_entry_t *buffer_cache_evict(void) {
 }
 
 void buffer_cache_read(block_sector_t sector, void *target) {
+  pthread_mutex_lock(&cache_lock);
   struct buffer_cache_entry_t *slot = buffer_cache_lookup(sector);
   if (slot == NULL) {
     // cache miss: need eviction.
@@ -109,15 +149,17 @@ void buffer_cache_read(block_sector_t sector, void *target) {
     slot->occupied = true;
     slot->disk_sector = sector;
     slot->dirty = false;
-    block_read(fs_device, sector, slot->buffer);
+    buffer_cache_fill(sector, slot->buffer);
   }
 
   // copy the buffer data into memory.
   slot->access = true;
   memcpy(target, slot->buffer, BLOCK_SECTOR_SIZE);
+  pthread_mutex_unlock(&cache_lock);
 }
 
 void buffer_cache_write(block_sector_t sector, const void *source) {
+  pthread_mutex_lock(&cache_lock);
   struct buffer_cache_entry_t *slot = buffer_cache_lookup(sector);
   if (slot == NULL) {
     // cache miss: need eviction.
@@ -128,11 +170,75 @@ void buffer_cache_write(block_sector_t sector, const void *source) {
     slot->occupied = true;
     slot->disk_sector = sector;
     slot->dirty = false;
-    block_read(fs_device, sector, slot->buffer);
+    buffer_cache_fill(sector, slot->buffer);
   }
 
   // copy the data form memory into the buffer cache.
   slot->access = true;
   slot->dirty = true;
   memcpy(slot->buffer, source, BLOCK_SECTOR_SIZE);
+  journal_revoke(sector);
+  pthread_mutex_unlock(&cache_lock);
+}
+
+/**
+ * Like buffer_cache_write(), for a sector of metadata.  With the
+ * journal on, the new contents go to the running transaction, and the
+ * cached copy stays clean: the journal commit writes it home.
+ */
+void buffer_cache_write_meta(block_sector_t sector, const void *source) {
+  // written in place from now on, so it must not be shared as data
+  dedup_exclude(sector);
+  pthread_mutex_lock(&cache_lock);
+  struct buffer_cache_entry_t *slot = buffer_cache_lookup(sector);
+  if (slot == NULL) {
+    // cache miss: need eviction, but no fill, as all of it is replaced
+    slot = buffer_cache_evict();
+    ASSERT(slot != NULL && slot->occupied == false);
+
+    slot->occupied = true;
+    slot->disk_sector = sector;
+    slot->dirty = false;
+  }
+
+  slot->access = true;
+  memcpy(slot->buffer, source, BLOCK_SECTOR_SIZE);
+  slot->dirty = !journal_log(sector, source);
+  pthread_mutex_unlock(&cache_lock);
+}
+
+/**
+ * Like buffer_cache_read(), but a miss is read straight into `target`
+ * without taking a cache slot, so that streaming through a large file
+ * does not evict the working set.  A cached (possibly dirty) copy is
+ * still preferred over the disk.  The disk read happens outside the
+ * cache lock, so concurrent readers overlap their I/O.
+ */
+void buffer_cache_read_nofill(block_sector_t sector, void *target) {
+  pthread_mutex_lock(&cache_lock);
+  struct buffer_cache_entry_t *slot = buffer_cache_lookup(sector);
+  if (slot != NULL)
+    memcpy(target, slot->buffer, BLOCK_SECTOR_SIZE);
+  pthread_mutex_unlock(&cache_lock);
+  if (slot == NULL)
+    buffer_cache_fill(sector, target);
+}
+
+/**
+ * Writes `source` straight to disk without taking a cache slot.  A
+ * cached copy of the sector is updated as well, and left clean, so
+ * that a later eviction cannot overwrite the new data.  The data is
+ * on disk when this returns.
+ */
+void buffer_cache_write_nofill(block_sector_t sector, const void *source) {
+  pthread_mutex_lock(&cache_lock);
+  struct buffer_cache_entry_t *slot = buffer_cache_lookup(sector);
+  if (slot != NULL) {
+    memcpy(slot->buffer, source, BLOCK_SECTOR_SIZE);
+    slot->dirty = false;
+  }
+  journal_revoke(sector);
+  checksum_update(sector, source);
+  block_write(fs_device, sector, source);
+  pthread_mutex_unlock(&cache_lock);
 }
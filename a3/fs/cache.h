@@ -7,6 +7,8 @@
 
 void buffer_cache_init(void);
 void buffer_cache_close(void);
+void buffer_cache_sync(void);
+void buffer_cache_write_back(block_sector_t sector);
 
 /**
  * Read SECTOR_SIZE bytes of data starting from the disk sector
@@ -14,10 +16,29 @@ void buffer_cache_close(void);
  */
 void buffer_cache_read(block_sector_t sector, void *target);
 
+/**
+ * Same as buffer_cache_read(), but does not bring the sector into the
+ * cache on a miss.  For large sequential transfers.
+ */
+void buffer_cache_read_nofill(block_sector_t sector, void *target);
+
 /**
  * Writes SECTOR_SIZE bytes of data into the disk sector
  * specified by 'sector', from `source` (user memory address).
  */
 void buffer_cache_write(block_sector_t sector, const void *source);
 
+/**
+ * Same as buffer_cache_write(), for metadata: inodes, indirect
+ * blocks, and directory and system file contents.  These go through
+ * the journal when it is on.
+ */
+void buffer_cache_write_meta(block_sector_t sector, const void *source);
+
+/**
+ * Same as buffer_cache_write(), but writes through to the disk
+ * without bringing the sector into the cache.
+ */
+void buffer_cache_write_nofill(block_sector_t sector, const void *source);
+
 #endif /* fs/cache.h */
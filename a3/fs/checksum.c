@@ -0,0 +1,412 @@
+#include "checksum.h"
+#include "bitmap.h"
+#include "cache.h"
+#include "debug.h"
+#include "filesys.h"
+#include "free-map.h"
+#include "round.h"
+#include "super.h"
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#if defined(__x86_64__) && defined(__GNUC__)
+#include <nmmintrin.h>
+#define CRC32C_SSE42 1
+#endif
+
+/* Identifies the header of the checksum area. */
+#define CHECKSUM_MAGIC 0x4d55534b
+
+/* Checksums per sector of the area. */
+#define CHECKSUMS_PER_SECTOR (BLOCK_SECTOR_SIZE / sizeof(uint32_t))
+
+/* Sectors read at a time when the whole disk is checksummed. */
+#define CHECKSUM_RUN_SECTORS 128
+
+/* Header of the checksum area, in its first sector.  The table of
+   checksums follows it. */
+struct checksum_header {
+  uint32_t magic; /* CHECKSUM_MAGIC. */
+  uint32_t clean; /* Nonzero if the table on disk is current. */
+  uint32_t size;  /* Sectors the table covers. */
+  uint8_t unused[BLOCK_SECTOR_SIZE - 3 * sizeof(uint32_t)];
+};
+
+/* Checksum state.  LOCK guards it all; it is taken with the cache
+   lock or the journal lock held, and calls nothing that takes
+   either. */
+static struct {
+  pthread_mutex_t lock;
+  block_sector_t start;  /* First sector of the area, or 0 if off. */
+  block_sector_t size;   /* Sectors covered by TABLE. */
+  size_t table_sectors;  /* Sectors of the area that hold TABLE. */
+  uint32_t *table;       /* Checksum of each sector. */
+  struct bitmap *dirty;  /* Sectors of TABLE changed since written. */
+  bool clean;            /* Whether the header on disk says clean. */
+  struct checksum_stats stats;
+} c = {.lock = PTHREAD_MUTEX_INITIALIZER};
+
+/* CRC32C (Castagnoli), reflected. */
+#define CRC32C_POLY 0x82f63b78
+
+static pthread_once_t crc32c_once = PTHREAD_ONCE_INIT;
+static uint32_t crc32c_table[256];
+static bool crc32c_hw;
+static uint32_t zero_checksum; /* Of a sector of zeros. */
+
+static uint32_t crc32c_sw(uint32_t crc, const uint8_t *p, size_t n) {
+  while (n-- > 0)
+    crc = crc32c_table[(crc ^ *p++) & 0xff] ^ (crc >> 8);
+  return crc;
+}
+
+#ifdef CRC32C_SSE42
+__attribute__((target("sse4.2"))) static uint32_t
+crc32c_sse42(uint32_t crc, const uint8_t *p, size_t n) {
+  uint64_t crc64 = crc;
+  uint64_t word;
+
+  for (; n >= sizeof word; n -= sizeof word, p += sizeof word) {
+    memcpy(&word, p, sizeof word);
+    crc64 = _mm_crc32_u64(crc64, word);
+  }
+  crc = crc64;
+  while (n-- > 0)
+    crc = _mm_crc32_u8(crc, *p++);
+  return crc;
+}
+#endif
+
+static uint32_t crc32c_any(uint32_t crc, const uint8_t *p, size_t n) {
+#ifdef CRC32C_SSE42
+  if (crc32c_hw)
+    return crc32c_sse42(crc, p, n);
+#endif
+  return crc32c_sw(crc, p, n);
+}
+
+static void crc32c_setup(void) {
+  static const uint8_t zeros[BLOCK_SECTOR_SIZE];
+  uint32_t i, k, crc;
+
+  for (i = 0; i < 256; i++) {
+    crc = i;
+    for (k = 0; k < 8; k++)
+      crc = crc & 1 ? (crc >> 1) ^ CRC32C_POLY : crc >> 1;
+    crc32c_table[i] = crc;
+  }
+#ifdef CRC32C_SSE42
+  __builtin_cpu_init();
+  crc32c_hw = __builtin_cpu_supports("sse4.2");
+#endif
+  zero_checksum = ~crc32c_any(~0u, zeros, sizeof zeros);
+}
+
+/* Uses the SSE4.2 crc32 instruction if the CPU has it, else a
+   table. */
+uint32_t crc32c(uint32_t crc, const void *data, size_t n) {
+  pthread_once(&crc32c_once, crc32c_setup);
+  return ~crc32c_any(~crc, data, n);
+}
+
+/* Returns how checksums are computed, for status output. */
+const char *crc32c_impl(void) {
+  pthread_once(&crc32c_once, crc32c_setup);
+  return crc32c_hw ? "sse4.2" : "table";
+}
+
+/* Returns whether SECTOR is part of the checksum area, which is not
+   checksummed itself.  Must be called with LOCK held. */
+static bool checksum_in_area(block_sector_t sector) {
+  return sector >= c.start && sector <= c.start + c.table_sectors;
+}
+
+/* Stores the checksum of every sector of the device, as it is on
+   disk, in TABLE.  Holes are not read. */
+static bool checksum_compute(uint32_t *table, block_sector_t size) {
+  uint8_t *run = malloc(CHECKSUM_RUN_SECTORS * BLOCK_SECTOR_SIZE);
+  block_sector_t s = 0, i;
+
+  if (run == NULL)
+    return false;
+  pthread_once(&crc32c_once, crc32c_setup);
+  for (i = 0; i < size; i++)
+    table[i] = zero_checksum;
+  while (s < size) {
+    block_sector_t end;
+
+    s = block_seek_data(fs_device, s, &end);
+    for (; s < end; s += CHECKSUM_RUN_SECTORS) {
+      size_t cnt = end - s < CHECKSUM_RUN_SECTORS ? end - s
+                                                  : CHECKSUM_RUN_SECTORS;
+      block_read_run(fs_device, s, cnt, run);
+      for (i = 0; i < cnt; i++)
+        table[s + i] = crc32c(0, run + i * BLOCK_SECTOR_SIZE,
+                              BLOCK_SECTOR_SIZE);
+    }
+    s = end;
+  }
+  free(run);
+  return true;
+}
+
+/* Writes the header of the area starting at START. */
+static void checksum_write_header(block_sector_t start, block_sector_t size,
+                                  bool clean) {
+  struct checksum_header h;
+
+  memset(&h, 0, sizeof h);
+  h.magic = CHECKSUM_MAGIC;
+  h.clean = clean;
+  h.size = size;
+  block_write(fs_device, start, &h);
+}
+
+/* Writes the changed sectors of the table, then marks the table on
+   disk current.  Must be called with LOCK held. */
+static void checksum_flush_locked(void) {
+  size_t i;
+
+  if (c.start == 0 || c.clean)
+    return;
+  for (i = 0; i < c.table_sectors; i++)
+    if (bitmap_test(c.dirty, i)) {
+      block_write(fs_device, c.start + 1 + i,
+                  c.table + i * CHECKSUMS_PER_SECTOR);
+      bitmap_reset(c.dirty, i);
+    }
+  checksum_write_header(c.start, c.size, true);
+  c.clean = true;
+}
+
+/* Allocates a table for a device of SIZE sectors: whole sectors of
+   it, so that they can be written as they are. */
+static bool checksum_alloc(block_sector_t size) {
+  c.size = size;
+  c.table_sectors = DIV_ROUND_UP(size, CHECKSUMS_PER_SECTOR);
+  c.table = calloc(c.table_sectors, BLOCK_SECTOR_SIZE);
+  c.dirty = bitmap_create(c.table_sectors);
+  return c.table != NULL && c.dirty != NULL;
+}
+
+static void checksum_free(void) {
+  free(c.table);
+  if (c.dirty != NULL)
+    bitmap_destroy(c.dirty);
+  c.table = NULL;
+  c.dirty = NULL;
+}
+
+/* Loads the checksums of the mounted file system, if it has them.
+   If the table on disk is not current, it is recomputed. */
+void checksum_init(void) {
+  struct super_block *sb = super_get();
+  struct checksum_header h;
+  block_sector_t start;
+
+  ASSERT(sizeof h == BLOCK_SECTOR_SIZE);
+
+  pthread_mutex_lock(&c.lock);
+  c.start = 0;
+  checksum_free();
+  memset(&c.stats, 0, sizeof c.stats);
+  start = super_location() != 0 ? sb->checksum_sector : 0;
+  if (start == 0) {
+    pthread_mutex_unlock(&c.lock);
+    return;
+  }
+
+  block_read(fs_device, start, &h);
+  if (h.magic != CHECKSUM_MAGIC || h.size != block_size(fs_device) ||
+      !checksum_alloc(h.size)) {
+    checksum_free();
+    pthread_mutex_unlock(&c.lock);
+    printf("Checksums: the checksum area is damaged; checksums are off\n");
+    return;
+  }
+  block_read_run(fs_device, start + 1, c.table_sectors, c.table);
+  c.start = start;
+  c.clean = h.clean;
+  if (!c.clean) {
+    printf("Checksums: recomputing after an unclean shutdown\n");
+    checksum_compute(c.table, c.size);
+    bitmap_set_all(c.dirty, true);
+    checksum_flush_locked();
+  }
+  pthread_mutex_unlock(&c.lock);
+}
+
+bool checksum_enabled(void) { return c.start != 0; }
+
+/* Creates the checksum area and checksums the whole disk.  Returns
+   false if the image cannot hold a superblock or the disk is full. */
+bool checksum_enable(void) {
+  struct super_block *sb = super_get();
+  block_sector_t size = block_size(fs_device);
+  block_sector_t start;
+  size_t area;
+
+  if (c.start != 0)
+    return true;
+  area = 1 + DIV_ROUND_UP(size, CHECKSUMS_PER_SECTOR);
+  if (!super_supported() || !free_map_allocate(area, &start))
+    return false;
+  // the table is computed from the disk, so it must be current
+  buffer_cache_sync();
+
+  pthread_mutex_lock(&c.lock);
+  if (!checksum_alloc(size) || !checksum_compute(c.table, size)) {
+    checksum_free();
+    pthread_mutex_unlock(&c.lock);
+    free_map_release(start, area);
+    return false;
+  }
+  c.start = start;
+  c.clean = false;
+  bitmap_set_all(c.dirty, true);
+  checksum_flush_locked();
+  pthread_mutex_unlock(&c.lock);
+
+  sb->checksum_sector = start;
+  if (!super_write()) {
+    sb->checksum_sector = 0;
+    checksum_disable();
+    free_map_release(start, area);
+    return false;
+  }
+  buffer_cache_sync();
+  return true;
+}
+
+/* Deletes the checksum area. */
+void checksum_disable(void) {
+  struct super_block *sb = super_get();
+  block_sector_t start = c.start;
+  size_t area = 1 + c.table_sectors;
+
+  if (start == 0)
+    return;
+  pthread_mutex_lock(&c.lock);
+  c.start = 0;
+  checksum_free();
+  pthread_mutex_unlock(&c.lock);
+
+  if (sb->checksum_sector == start) {
+    sb->checksum_sector = 0;
+    super_write();
+    free_map_release(start, area);
+    buffer_cache_sync();
+  }
+}
+
+void checksum_stats(struct checksum_stats *st) {
+  pthread_mutex_lock(&c.lock);
+  *st = c.stats;
+  st->start = c.start;
+  st->sectors = c.start != 0 ? 1 + c.table_sectors : 0;
+  pthread_mutex_unlock(&c.lock);
+}
+
+/* Writes the table back if it changed.  Called at each cache sync,
+   after the sectors it describes are on disk. */
+void checksum_flush(void) {
+  pthread_mutex_lock(&c.lock);
+  checksum_flush_locked();
+  pthread_mutex_unlock(&c.lock);
+}
+
+/* Records DATA as the new contents of SECTOR.  Must be called
+   before DATA is written home. */
+void checksum_update(block_sector_t sector, const void *data) {
+  pthread_mutex_lock(&c.lock);
+  if (c.start != 0 && sector < c.size && !checksum_in_area(sector)) {
+    // once the header says unclean, a crash cannot leave the table
+    // on disk trusted but stale
+    if (c.clean) {
+      checksum_write_header(c.start, c.size, false);
+      c.clean = false;
+    }
+    c.table[sector] = crc32c(0, data, BLOCK_SECTOR_SIZE);
+    bitmap_mark(c.dirty, sector / CHECKSUMS_PER_SECTOR);
+    c.stats.updated++;
+  }
+  pthread_mutex_unlock(&c.lock);
+}
+
+/* Checks DATA, just read from disk, against the checksum of SECTOR.
+   Returns false, and reports the sector, if they do not match. */
+bool checksum_verify(block_sector_t sector, const void *data) {
+  bool ok = true;
+
+  pthread_mutex_lock(&c.lock);
+  if (c.start != 0 && sector < c.size && !checksum_in_area(sector)) {
+    ok = c.table[sector] == crc32c(0, data, BLOCK_SECTOR_SIZE);
+    c.stats.verified++;
+    if (!ok)
+      c.stats.mismatches++;
+  }
+  pthread_mutex_unlock(&c.lock);
+  if (!ok)
+    printf("Warning: checksum mismatch in sector %u\n", sector);
+  return ok;
+}
+
+/* Records a failed sector in R. */
+static void checksum_scrub_bad(struct checksum_scrub *r,
+                               block_sector_t sector) {
+  if (r->bad < sizeof r->first / sizeof *r->first)
+    r->first[r->bad] = sector;
+  r->bad++;
+}
+
+/* Verifies every sector of the disk, in runs read straight from the
+   device; holes are checked against the checksum of zeros without
+   being read.  Stores the result in R.  Returns false if checksums
+   are off. */
+bool checksum_scrub(struct checksum_scrub *r) {
+  uint8_t *run = malloc(CHECKSUM_RUN_SECTORS * BLOCK_SECTOR_SIZE);
+  block_sector_t s = 0, size, i;
+
+  memset(r, 0, sizeof *r);
+  if (run == NULL || c.start == 0) {
+    free(run);
+    return false;
+  }
+  buffer_cache_sync();
+  size = c.size;
+  while (s < size) {
+    block_sector_t end = size;
+    block_sector_t data = block_seek_data(fs_device, s, &end);
+
+    pthread_mutex_lock(&c.lock);
+    for (; s < data; s++)
+      if (!checksum_in_area(s)) {
+        r->scanned++;
+        if (c.table[s] != zero_checksum)
+          checksum_scrub_bad(r, s);
+      }
+    pthread_mutex_unlock(&c.lock);
+
+    for (; s < end; s += CHECKSUM_RUN_SECTORS) {
+      size_t cnt = end - s < CHECKSUM_RUN_SECTORS ? end - s
+                                                  : CHECKSUM_RUN_SECTORS;
+      block_read_run(fs_device, s, cnt, run);
+      pthread_mutex_lock(&c.lock);
+      for (i = 0; i < cnt; i++) {
+        if (checksum_in_area(s + i))
+          continue;
+        r->scanned++;
+        r->read++;
+        if (c.table[s + i] !=
+            crc32c(0, run + i * BLOCK_SECTOR_SIZE, BLOCK_SECTOR_SIZE))
+          checksum_scrub_bad(r, s + i);
+      }
+      pthread_mutex_unlock(&c.lock);
+    }
+    s = end;
+  }
+  free(run);
+  return true;
+}
@@ -0,0 +1,56 @@
+#ifndef FILESYS_CHECKSUM_H
+#define FILESYS_CHECKSUM_H
+
+#include "block.h"
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+/* Optional per-sector checksums.
+
+   With checksums on, the checksum area holds the CRC32C of every
+   sector of the device.  The buffer cache verifies a sector against
+   it whenever it reads one from disk, and updates it whenever it
+   writes one home, so corruption of the image behind the file
+   system's back shows up on the next read, or at the latest on the
+   next scrub.
+
+   The table is kept in memory and written back at each cache sync.
+   The area's header records whether the table on disk is current;
+   after a crash it is not, and it is recomputed from the disk at
+   mount. */
+
+/* Returns the CRC32C of N bytes at DATA, continuing from CRC (0 to
+   start). */
+uint32_t crc32c(uint32_t crc, const void *data, size_t n);
+const char *crc32c_impl(void);
+
+/* Checksum activity since the file system was mounted. */
+struct checksum_stats {
+  block_sector_t start; /* First sector of the area, or 0 if off. */
+  size_t sectors;       /* Sectors in the area. */
+  size_t verified;      /* Sectors read from disk and verified. */
+  size_t updated;       /* Sectors written home. */
+  size_t mismatches;    /* Reads that failed verification. */
+};
+
+/* Result of a scrub. */
+struct checksum_scrub {
+  size_t scanned;          /* Sectors verified. */
+  size_t read;             /* Of those, read from disk (not holes). */
+  size_t bad;              /* Sectors that failed. */
+  block_sector_t first[8]; /* The first of those. */
+};
+
+void checksum_init(void);
+bool checksum_enabled(void);
+bool checksum_enable(void);
+void checksum_disable(void);
+void checksum_stats(struct checksum_stats *);
+void checksum_flush(void);
+
+void checksum_update(block_sector_t, const void *);
+bool checksum_verify(block_sector_t, const void *);
+bool checksum_scrub(struct checksum_scrub *);
+
+#endif /* fs/checksum.h */
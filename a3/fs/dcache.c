@@ -0,0 +1,107 @@
+#include "dcache.h"
+#include "debug.h"
+#include "directory.h"
+#include <pthread.h>
+#include <stdint.h>
+#include <string.h>
+
+#define DCACHE_SIZE 512
+
+struct dcache_entry_t {
+  bool occupied; // true only if this entry is valid cache entry
+  bool negative; // true if NAME is known to be absent from PARENT
+
+  block_sector_t parent;       // inode sector of the containing directory
+  block_sector_t inode_sector; // inode sector of NAME, unless negative
+  char name[NAME_MAX + 1];
+};
+
+/* Dentry cache entries, direct mapped by hash of (parent, name).
+   DCACHE_LOCK guards them: lookups run on the shell thread, the
+   background compactor and the worker threads of some commands. */
+static struct dcache_entry_t dcache[DCACHE_SIZE];
+static pthread_mutex_t dcache_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/* Returns the slot for (PARENT, NAME). */
+static struct dcache_entry_t *dcache_slot(block_sector_t parent,
+                                          const char *name) {
+  // FNV-1a over the parent sector, then the name
+  uint32_t h = 2166136261u;
+  size_t i;
+  for (i = 0; i < sizeof parent; i++) {
+    h ^= (parent >> (8 * i)) & 0xff;
+    h *= 16777619u;
+  }
+  for (; *name != '\0'; name++) {
+    h ^= (uint8_t)*name;
+    h *= 16777619u;
+  }
+  return &dcache[h % DCACHE_SIZE];
+}
+
+void dcache_init(void) {
+  size_t i;
+  pthread_mutex_lock(&dcache_lock);
+  for (i = 0; i < DCACHE_SIZE; ++i)
+    dcache[i].occupied = false;
+  pthread_mutex_unlock(&dcache_lock);
+}
+
+/* Looks up NAME in directory PARENT.  On DCACHE_HIT, stores the
+   inode sector of NAME into *SECTORP. */
+enum dcache_result dcache_lookup(block_sector_t parent, const char *name,
+                                 block_sector_t *sectorp) {
+  struct dcache_entry_t *slot = dcache_slot(parent, name);
+  enum dcache_result result = DCACHE_MISS;
+
+  pthread_mutex_lock(&dcache_lock);
+  if (slot->occupied && slot->parent == parent && !strcmp(slot->name, name)) {
+    result = slot->negative ? DCACHE_NEGATIVE : DCACHE_HIT;
+    if (result == DCACHE_HIT)
+      *sectorp = slot->inode_sector;
+  }
+  pthread_mutex_unlock(&dcache_lock);
+  return result;
+}
+
+/* Records that NAME in PARENT has its inode at SECTOR.
+   Replaces whatever shared the slot. */
+void dcache_insert(block_sector_t parent, const char *name,
+                   block_sector_t sector) {
+  struct dcache_entry_t *slot = dcache_slot(parent, name);
+
+  if (strlen(name) > NAME_MAX)
+    return;
+  pthread_mutex_lock(&dcache_lock);
+  slot->occupied = true;
+  slot->negative = false;
+  slot->parent = parent;
+  slot->inode_sector = sector;
+  strncpy(slot->name, name, sizeof slot->name);
+  pthread_mutex_unlock(&dcache_lock);
+}
+
+/* Records that PARENT has no entry named NAME. */
+void dcache_insert_negative(block_sector_t parent, const char *name) {
+  struct dcache_entry_t *slot = dcache_slot(parent, name);
+
+  if (strlen(name) > NAME_MAX)
+    return;
+  pthread_mutex_lock(&dcache_lock);
+  slot->occupied = true;
+  slot->negative = true;
+  slot->parent = parent;
+  strncpy(slot->name, name, sizeof slot->name);
+  pthread_mutex_unlock(&dcache_lock);
+}
+
+/* Drops every entry of directory PARENT, e.g. because the
+   directory was removed and its sector may be reused. */
+void dcache_invalidate_dir(block_sector_t parent) {
+  size_t i;
+  pthread_mutex_lock(&dcache_lock);
+  for (i = 0; i < DCACHE_SIZE; ++i)
+    if (dcache[i].occupied && dcache[i].parent == parent)
+      dcache[i].occupied = false;
+  pthread_mutex_unlock(&dcache_lock);
+}
@@ -0,0 +1,29 @@
+#ifndef FILESYS_DCACHE_H
+#define FILESYS_DCACHE_H
+
+#include "block.h"
+#include <stdbool.h>
+
+/* Directory entry cache.
+
+   Remembers the result of name lookups as (parent directory inode
+   sector, name) -> inode sector, including lookups that found
+   nothing, so that resolving the same path again does not read
+   any directory sectors. */
+
+/* Result of dcache_lookup(). */
+enum dcache_result {
+  DCACHE_MISS,     /* Nothing cached; consult the directory. */
+  DCACHE_HIT,      /* Name exists; its inode sector was returned. */
+  DCACHE_NEGATIVE, /* Name is known not to exist. */
+};
+
+void dcache_init(void);
+enum dcache_result dcache_lookup(block_sector_t parent, const char *name,
+                                 block_sector_t *sectorp);
+void dcache_insert(block_sector_t parent, const char *name,
+                   block_sector_t sector);
+void dcache_insert_negative(block_sector_t parent, const char *name);
+void dcache_invalidate_dir(block_sector_t parent);
+
+#endif /* fs/dcache.h */
@@ -0,0 +1,211 @@
+#include "dedup.h"
+#include "bitmap.h"
+#include "cache.h"
+#include "checksum.h"
+#include "debug.h"
+#include "directory.h"
+#include "filesys.h"
+#include "free-map.h"
+#include "super.h"
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define DEDUP_BUCKETS 1024
+
+/* The hash table.  Each bucket is a chain of sectors linked through
+   NEXT, ending with 0 (never a data sector); HASHES holds the hash of
+   each sector in a chain and INDEXED tells which ones are.  All are
+   NULL while dedup is off.  META marks the sectors written as
+   metadata since, which are never shared. */
+static block_sector_t *buckets;
+static block_sector_t *next;
+static uint32_t *hashes;
+static struct bitmap *indexed;
+static struct bitmap *meta;
+static size_t indexed_cnt;
+static size_t hits;
+
+static uint32_t dedup_hash(const void *data) {
+  return crc32c(0, data, BLOCK_SECTOR_SIZE);
+}
+
+/* Removes SECTOR from the hash table, if it is there. */
+static void dedup_unindex(block_sector_t sector) {
+  block_sector_t *p;
+
+  if (!bitmap_test(indexed, sector))
+    return;
+  for (p = &buckets[hashes[sector] % DEDUP_BUCKETS]; *p != sector;
+       p = &next[*p])
+    ASSERT(*p != 0);
+  *p = next[sector];
+  bitmap_reset(indexed, sector);
+  indexed_cnt--;
+}
+
+/* Adds the data sectors of plain file ENT to the hash table.
+   Directories are left out: their sectors are written in place, so
+   sharing one would let a directory change overwrite the file's
+   data. */
+static void dedup_scan_file(const char *path UNUSED,
+                            struct dir_entry_plus *ent, void *aux UNUSED) {
+  uint8_t data[BLOCK_SECTOR_SIZE];
+  size_t k;
+
+  for (k = 0; !ent->is_dir && ent->blocks != NULL && k < ent->block_cnt;
+       k++) {
+    block_sector_t sector = ent->blocks[k];
+    if (!bitmap_test(indexed, sector)) {
+      buffer_cache_read(sector, data);
+      dedup_add(sector, data);
+    }
+  }
+}
+
+/* Adds the data sectors of every plain file in the directory tree
+   to the hash table. */
+static void dedup_scan(void) {
+  struct dir *root = dir_open_root();
+
+  if (root == NULL)
+    return;
+  dir_walk(root, true, dedup_scan_file, NULL);
+  dir_close(root);
+}
+
+/* Allocates an empty hash table and fills it from the disk.  Returns
+   false if memory runs out. */
+static bool dedup_build(void) {
+  size_t sectors = block_size(fs_device);
+
+  dedup_done();
+  buckets = calloc(DEDUP_BUCKETS, sizeof *buckets);
+  next = calloc(sectors, sizeof *next);
+  hashes = calloc(sectors, sizeof *hashes);
+  indexed = bitmap_create(sectors);
+  meta = bitmap_create(sectors);
+  if (buckets == NULL || next == NULL || hashes == NULL || indexed == NULL ||
+      meta == NULL) {
+    dedup_done();
+    return false;
+  }
+  dedup_scan();
+  return true;
+}
+
+/* Starts dedup on the mounted file system if its superblock says
+   so. */
+void dedup_init(void) {
+  if (super_location() != 0 && (super_get()->flags & SUPER_DEDUP))
+    dedup_build();
+}
+
+/* Frees the hash table. */
+void dedup_done(void) {
+  free(buckets);
+  free(next);
+  free(hashes);
+  bitmap_destroy(indexed);
+  bitmap_destroy(meta);
+  buckets = next = NULL;
+  hashes = NULL;
+  indexed = meta = NULL;
+  indexed_cnt = 0;
+}
+
+bool dedup_enabled(void) { return buckets != NULL; }
+
+/* Turns dedup on for data written from now on.  Returns false if the
+   image cannot record it or memory runs out. */
+bool dedup_enable(void) {
+  struct super_block *sb = super_get();
+
+  if (dedup_enabled())
+    return true;
+  if (!super_supported() || !dedup_build())
+    return false;
+  sb->flags |= SUPER_DEDUP;
+  if (!super_write()) {
+    sb->flags &= ~SUPER_DEDUP;
+    dedup_done();
+    return false;
+  }
+  return true;
+}
+
+/* Turns dedup off.  Sectors already shared stay shared until they
+   are written. */
+void dedup_disable(void) {
+  struct super_block *sb = super_get();
+
+  if (!dedup_enabled())
+    return;
+  dedup_done();
+  sb->flags &= ~SUPER_DEDUP;
+  super_write();
+}
+
+void dedup_stats(struct dedup_stats *stats) {
+  stats->enabled = dedup_enabled();
+  stats->indexed = indexed_cnt;
+  stats->hits = hits;
+  free_map_shared(&stats->shared, &stats->saved);
+}
+
+/* Returns a data sector in use that holds the same BLOCK_SECTOR_SIZE
+   bytes as DATA, or 0 if there is none (or dedup is off).  A sector
+   that holds metadata is never returned. */
+block_sector_t dedup_find(const void *data) {
+  uint8_t other[BLOCK_SECTOR_SIZE];
+  uint32_t hash;
+  block_sector_t s;
+
+  if (!dedup_enabled())
+    return 0;
+  hash = dedup_hash(data);
+  for (s = buckets[hash % DEDUP_BUCKETS]; s != 0; s = next[s]) {
+    if (hashes[s] != hash || bitmap_test(meta, s))
+      continue;
+    // equal hashes are only a hint: compare the bytes
+    buffer_cache_read(s, other);
+    if (memcmp(other, data, BLOCK_SECTOR_SIZE) == 0) {
+      hits++;
+      return s;
+    }
+  }
+  return 0;
+}
+
+/* Records that SECTOR, a data sector in use, now holds DATA. */
+void dedup_add(block_sector_t sector, const void *data) {
+  block_sector_t *head;
+
+  if (!dedup_enabled() || bitmap_test(meta, sector))
+    return;
+  dedup_unindex(sector);
+  hashes[sector] = dedup_hash(data);
+  head = &buckets[hashes[sector] % DEDUP_BUCKETS];
+  next[sector] = *head;
+  *head = sector;
+  bitmap_mark(indexed, sector);
+  indexed_cnt++;
+}
+
+/* Records that SECTOR holds metadata, which is written in place:
+   it leaves the hash table and is not shared until it is freed. */
+void dedup_exclude(block_sector_t sector) {
+  if (!dedup_enabled())
+    return;
+  dedup_unindex(sector);
+  bitmap_mark(meta, sector);
+}
+
+/* Removes SECTOR from the hash table, if it is there, and forgets
+   that it held metadata.  Called when the sector is freed. */
+void dedup_forget(block_sector_t sector) {
+  if (!dedup_enabled())
+    return;
+  dedup_unindex(sector);
+  bitmap_reset(meta, sector);
+}
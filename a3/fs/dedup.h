@@ -0,0 +1,42 @@
+#ifndef FILESYS_DEDUP_H
+#define FILESYS_DEDUP_H
+
+#include "block.h"
+#include <stdbool.h>
+#include <stddef.h>
+
+/* Optional deduplication of data sectors.
+
+   With dedup on, each data sector written to a regular file is
+   hashed, and if some other sector already holds the same bytes the
+   file is pointed at that sector instead, adding a reference to it
+   in the free map.  A write to a sector that is shared this way goes
+   to a fresh copy, so the other files never see it.  Metadata, which
+   is written in place, is never shared.
+
+   The hash table lives only in memory: it is rebuilt from the data
+   of every file in the directory tree at mount.  Whether dedup is
+   on is recorded in the superblock. */
+
+/* Dedup activity since the file system was mounted. */
+struct dedup_stats {
+  bool enabled;   /* Is dedup on? */
+  size_t indexed; /* Sectors in the hash table. */
+  size_t hits;    /* Writes that shared a sector instead. */
+  size_t shared;  /* Sectors with more than one reference. */
+  size_t saved;   /* Sectors those extra references save. */
+};
+
+void dedup_init(void);
+void dedup_done(void);
+bool dedup_enabled(void);
+bool dedup_enable(void);
+void dedup_disable(void);
+void dedup_stats(struct dedup_stats *);
+
+block_sector_t dedup_find(const void *data);
+void dedup_add(block_sector_t, const void *data);
+void dedup_exclude(block_sector_t);
+void dedup_forget(block_sector_t);
+
+#endif /* fs/dedup.h */
@@ -0,0 +1,443 @@
+#include "defrag.h"
+#include "bitmap.h"
+#include "block.h"
+#include "debug.h"
+#include "directory.h"
+#include "filesys.h"
+#include "free-map.h"
+#include "inode.h"
+#include "journal.h"
+#include <errno.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+/* A fragmented file, and where the plan puts it. */
+struct defrag_file {
+  block_sector_t inode_sector;
+  offset_t length;         /* Length when planned. */
+  block_sector_t *blocks;  /* Data sectors when planned. */
+  size_t block_cnt;
+  block_sector_t target;   /* First sector of its new run... */
+  bool planned;            /* ...if the plan found one. */
+};
+
+/* Returns the number of extents (runs of consecutive sectors) in the
+   CNT sectors of BLOCKS. */
+static size_t defrag_extents(const block_sector_t *blocks, size_t cnt) {
+  size_t extents = cnt > 0, i;
+  for (i = 1; i < cnt; i++)
+    if (blocks[i] != blocks[i - 1] + 1)
+      extents++;
+  return extents;
+}
+
+/* What defrag_scan() gathers while walking the tree. */
+struct defrag_scan_state {
+  struct defrag_stats *stats;
+  size_t *extents;
+  struct defrag_file **files;
+  size_t *file_cnt;
+  size_t cap;
+  bool ok;
+};
+
+/* Counts the extents of file EP and, if wanted, appends it to the
+   fragmented files. */
+static void defrag_scan_file(const char *path UNUSED,
+                             struct dir_entry_plus *ep, void *aux) {
+  struct defrag_scan_state *s = aux;
+  struct defrag_file *f;
+  size_t e;
+
+  if (ep->is_dir || ep->blocks == NULL || ep->block_cnt == 0)
+    return;
+  e = defrag_extents(ep->blocks, ep->block_cnt);
+  *s->extents += e;
+  if (s->files == NULL)
+    return;
+
+  s->stats->files++;
+  if (e < 2)
+    return;
+  s->stats->fragmented++;
+  if (*s->file_cnt == s->cap) {
+    struct defrag_file *grown;
+    s->cap = s->cap * 2 + 16;
+    grown = realloc(*s->files, s->cap * sizeof **s->files);
+    if (grown == NULL) {
+      s->ok = false;
+      return;
+    }
+    *s->files = grown;
+  }
+  f = &(*s->files)[(*s->file_cnt)++];
+  memset(f, 0, sizeof *f);
+  f->inode_sector = ep->inode_sector;
+  f->length = ep->length;
+  f->blocks = ep->blocks;
+  f->block_cnt = ep->block_cnt;
+  ep->blocks = NULL; // now owned by F
+}
+
+/* Counts the regular files of the directory tree and their extents.
+   If FILES is not null, the fragmented files are appended to it. */
+static bool defrag_scan(struct defrag_stats *stats, size_t *extents,
+                        struct defrag_file **files, size_t *file_cnt) {
+  struct defrag_scan_state s = {stats, extents, files, file_cnt, 0, true};
+  struct dir *root = dir_open_root();
+
+  if (root == NULL)
+    return false;
+  *extents = 0;
+  if (!dir_walk(root, true, defrag_scan_file, &s))
+    s.ok = false;
+  dir_close(root);
+  return s.ok;
+}
+
+static int defrag_by_size(const void *a_, const void *b_) {
+  const struct defrag_file *a = a_, *b = b_;
+  return (a->block_cnt > b->block_cnt) - (a->block_cnt < b->block_cnt);
+}
+
+/* Plans where to move FILES, against a copy of the free map.
+
+   Smaller files go first, each into the first free run that holds
+   it; its old sectors then count as free for the files after it.
+   Files that fit nowhere are retried after each pass that moved
+   something, since the space vacated by earlier moves can open up a
+   run for them.  Executing the moves in the order planned (see
+   PLAN) therefore always finds the target run free. */
+static size_t defrag_plan(struct defrag_file *files, size_t file_cnt,
+                          struct defrag_file **plan) {
+  size_t size = bitmap_size(free_map), planned = 0, i;
+  struct bitmap *sim = bitmap_create(size);
+  bool progress = true;
+
+  if (sim == NULL)
+    return 0;
+  for (i = 0; i < size; i++)
+    bitmap_set(sim, i, bitmap_test(free_map, i));
+
+  qsort(files, file_cnt, sizeof *files, defrag_by_size);
+  while (progress) {
+    progress = false;
+    for (i = 0; i < file_cnt; i++) {
+      struct defrag_file *f = &files[i];
+      size_t start, k;
+
+      if (f->planned)
+        continue;
+      start = bitmap_scan(sim, 0, f->block_cnt, false);
+      if (start == BITMAP_ERROR)
+        continue;
+      bitmap_set_multiple(sim, start, f->block_cnt, true);
+      // moving a shared sector only drops a reference to it
+      for (k = 0; k < f->block_cnt; k++)
+        if (free_map_refs(f->blocks[k]) == 1)
+          bitmap_reset(sim, f->blocks[k]);
+      f->target = start;
+      f->planned = true;
+      plan[planned++] = f;
+      progress = true;
+    }
+  }
+  bitmap_destroy(sim);
+  return planned;
+}
+
+/* Moves one planned file into its target run.  Returns false if the
+   file or the run changed since the plan was made. */
+static bool defrag_move(const struct defrag_file *f) {
+  struct inode *inode = inode_open(f->inode_sector);
+  block_sector_t *targets = NULL;
+  bool ok = false;
+  size_t i;
+
+  if (inode == NULL)
+    return false;
+  if (inode_is_removed(inode) || inode_length(inode) != f->length)
+    goto done;
+  targets = malloc(f->block_cnt * sizeof *targets);
+  if (targets == NULL || !free_map_allocate_at(f->target, f->block_cnt))
+    goto done;
+  for (i = 0; i < f->block_cnt; i++)
+    targets[i] = f->target + i;
+  ok = inode_relocate(inode, 0, f->block_cnt, targets);
+  if (!ok)
+    free_map_release(f->target, f->block_cnt);
+  else
+    journal_commit(); // so that later moves may use the sectors it freed
+
+done:
+  free(targets);
+  inode_close(inode);
+  return ok;
+}
+
+/* Defragments the regular files of the directory tree, moving each
+   fragmented one into a single free run where the plan finds room
+   for it, and fills in STATS.  Returns false if the directory could
+   not be read or memory ran out. */
+bool defrag_run(struct defrag_stats *stats) {
+  struct defrag_file *files = NULL, **plan = NULL;
+  size_t file_cnt = 0, planned, i;
+  bool ok;
+
+  memset(stats, 0, sizeof *stats);
+  ok = defrag_scan(stats, &stats->extents_before, &files, &file_cnt);
+  if (ok && file_cnt > 0) {
+    plan = malloc(file_cnt * sizeof *plan);
+    ok = plan != NULL;
+  }
+  if (ok) {
+    planned = defrag_plan(files, file_cnt, plan);
+    for (i = 0; i < planned; i++)
+      if (defrag_move(plan[i])) {
+        stats->moved++;
+        stats->bytes_moved += (long long)plan[i]->block_cnt * BLOCK_SECTOR_SIZE;
+      }
+    ok = defrag_scan(stats, &stats->extents_after, NULL, NULL);
+  }
+
+  for (i = 0; i < file_cnt; i++)
+    free(files[i].blocks);
+  free(files);
+  free(plan);
+  return ok;
+}
+
+/* Background compaction.
+
+   A worker thread moves the most fragmented file that fits in a
+   free run into that run, DEFRAG_BG_CHUNK sectors per step.  Each
+   step holds the file system lock, so a shell command waits for at
+   most one step, and leaves the file consistent: its first sectors
+   are in the new run, the rest where they were.  Between steps the
+   worker sleeps as long as a token bucket of RATE sectors per second
+   requires.  The whole target run is allocated when the file is
+   picked, and the part not yet used is released if the file goes
+   away before it is done.
+
+   FLAGS_LOCK guards the control fields; the progress fields are only
+   touched with the file system lock held. */
+static struct {
+  pthread_t thread;
+  pthread_mutex_t flags_lock;
+  pthread_cond_t wakeup;
+  bool running, paused, stop;
+  unsigned rate;
+
+  size_t files_done;
+  long long sectors_moved;
+  block_sector_t inode_sector; /* File being moved, or 0. */
+  block_sector_t target;       /* Its new run... */
+  size_t block_cnt;            /* ...of this many sectors... */
+  size_t next;                 /* ...of which this many are in place. */
+} bg = {.flags_lock = PTHREAD_MUTEX_INITIALIZER,
+        .wakeup = PTHREAD_COND_INITIALIZER};
+
+/* Picks the file with the most extents that fits in a free run and
+   allocates the run for it.  Returns false if there is none. */
+static bool defrag_bg_pick(void) {
+  struct defrag_file *files = NULL;
+  struct defrag_stats stats = {0};
+  size_t file_cnt = 0, extents, best_extents = 1, i;
+  struct defrag_file *best = NULL;
+  block_sector_t start = 0;
+
+  defrag_scan(&stats, &extents, &files, &file_cnt);
+  for (i = 0; i < file_cnt; i++) {
+    size_t e = defrag_extents(files[i].blocks, files[i].block_cnt);
+    if (e > best_extents &&
+        bitmap_scan(free_map, 0, files[i].block_cnt, false) != BITMAP_ERROR) {
+      best = &files[i];
+      best_extents = e;
+    }
+  }
+  if (best != NULL && free_map_allocate(best->block_cnt, &start)) {
+    bg.inode_sector = best->inode_sector;
+    bg.target = start;
+    bg.block_cnt = best->block_cnt;
+    bg.next = 0;
+  }
+
+  for (i = 0; i < file_cnt; i++)
+    free(files[i].blocks);
+  free(files);
+  return bg.inode_sector != 0;
+}
+
+/* Ends the current move, releasing the part of the run not used. */
+static void defrag_bg_finish(void) {
+  if (bg.next < bg.block_cnt)
+    free_map_release(bg.target + bg.next, bg.block_cnt - bg.next);
+  else
+    bg.files_done++;
+  bg.inode_sector = 0;
+}
+
+/* Moves up to BUDGET sectors of the current file.  Returns the
+   number moved. */
+static size_t defrag_bg_step(size_t budget) {
+  struct inode *inode = inode_open(bg.inode_sector);
+  size_t n = bg.block_cnt - bg.next, i;
+  block_sector_t targets[DEFRAG_BG_CHUNK];
+
+  if (n > budget)
+    n = budget;
+  if (n > DEFRAG_BG_CHUNK)
+    n = DEFRAG_BG_CHUNK;
+  for (i = 0; i < n; i++)
+    targets[i] = bg.target + bg.next + i;
+
+  // a removed file is freed by its last close; it no longer needs moving
+  if (inode == NULL || inode_is_removed(inode) ||
+      !inode_relocate(inode, bg.next, n, targets)) {
+    inode_close(inode);
+    defrag_bg_finish();
+    return 0;
+  }
+  inode_close(inode);
+
+  bg.next += n;
+  bg.sectors_moved += n;
+  if (bg.next == bg.block_cnt)
+    defrag_bg_finish();
+  return n;
+}
+
+/* Seconds elapsed since *T, which is advanced to now. */
+static double defrag_bg_tick(struct timespec *t) {
+  struct timespec now;
+  double secs;
+
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  secs = (now.tv_sec - t->tv_sec) + (now.tv_nsec - t->tv_nsec) / 1e9;
+  *t = now;
+  return secs;
+}
+
+/* Waits, with FLAGS_LOCK held, until SECS seconds pass or a command
+   arrives. */
+static void defrag_bg_sleep(double secs) {
+  struct timespec until;
+
+  clock_gettime(CLOCK_REALTIME, &until);
+  until.tv_sec += (time_t)secs;
+  until.tv_nsec += (long)((secs - (time_t)secs) * 1e9);
+  if (until.tv_nsec >= 1000000000L) {
+    until.tv_sec++;
+    until.tv_nsec -= 1000000000L;
+  }
+  pthread_cond_timedwait(&bg.wakeup, &bg.flags_lock, &until);
+}
+
+static void *defrag_bg_worker(void *aux UNUSED) {
+  struct timespec last;
+  double tokens = 0;
+
+  clock_gettime(CLOCK_MONOTONIC, &last);
+  pthread_mutex_lock(&bg.flags_lock);
+  while (!bg.stop) {
+    if (bg.paused) {
+      pthread_cond_wait(&bg.wakeup, &bg.flags_lock);
+      defrag_bg_tick(&last);
+      continue;
+    }
+
+    // refill the bucket, never beyond one step's worth
+    tokens += defrag_bg_tick(&last) * bg.rate;
+    if (tokens > DEFRAG_BG_CHUNK)
+      tokens = DEFRAG_BG_CHUNK;
+    if (tokens < 1) {
+      defrag_bg_sleep((1 - tokens) / bg.rate);
+      continue;
+    }
+    pthread_mutex_unlock(&bg.flags_lock);
+
+    filesys_lock();
+    bool busy = bg.inode_sector != 0 || defrag_bg_pick();
+    if (busy)
+      tokens -= defrag_bg_step((size_t)tokens);
+    filesys_unlock();
+
+    pthread_mutex_lock(&bg.flags_lock);
+    if (!busy)
+      defrag_bg_sleep(1); // nothing to do: look again later
+  }
+  pthread_mutex_unlock(&bg.flags_lock);
+  return NULL;
+}
+
+/* Starts background compaction at RATE sectors per second.  Returns
+   false if it could not be started. */
+bool defrag_bg_start(unsigned rate) {
+  if (bg.running) {
+    defrag_bg_set_rate(rate);
+    defrag_bg_resume();
+    return true;
+  }
+  bg.rate = rate > 0 ? rate : DEFRAG_BG_DEFAULT_RATE;
+  bg.paused = bg.stop = false;
+  bg.running = pthread_create(&bg.thread, NULL, defrag_bg_worker, NULL) == 0;
+  return bg.running;
+}
+
+void defrag_bg_set_rate(unsigned rate) {
+  pthread_mutex_lock(&bg.flags_lock);
+  if (rate > 0)
+    bg.rate = rate;
+  pthread_cond_signal(&bg.wakeup);
+  pthread_mutex_unlock(&bg.flags_lock);
+}
+
+void defrag_bg_pause(void) {
+  pthread_mutex_lock(&bg.flags_lock);
+  bg.paused = true;
+  pthread_mutex_unlock(&bg.flags_lock);
+}
+
+void defrag_bg_resume(void) {
+  pthread_mutex_lock(&bg.flags_lock);
+  bg.paused = false;
+  pthread_cond_signal(&bg.wakeup);
+  pthread_mutex_unlock(&bg.flags_lock);
+}
+
+/* Stops background compaction, leaving a file being moved partly
+   moved, which is a consistent state.  Must be called with the file
+   system lock held; it is dropped while waiting for the worker. */
+void defrag_bg_stop(void) {
+  if (!bg.running)
+    return;
+  pthread_mutex_lock(&bg.flags_lock);
+  bg.stop = true;
+  pthread_cond_signal(&bg.wakeup);
+  pthread_mutex_unlock(&bg.flags_lock);
+
+  filesys_unlock();
+  pthread_join(bg.thread, NULL);
+  filesys_lock();
+  bg.running = false;
+  if (bg.inode_sector != 0)
+    defrag_bg_finish();
+}
+
+/* Reports the progress of background compaction.  Must be called with
+   the file system lock held. */
+void defrag_bg_status(struct defrag_bg_status *st) {
+  pthread_mutex_lock(&bg.flags_lock);
+  st->running = bg.running;
+  st->paused = bg.paused;
+  st->rate = bg.rate;
+  pthread_mutex_unlock(&bg.flags_lock);
+  st->files_done = bg.files_done;
+  st->sectors_moved = bg.sectors_moved;
+  st->current = bg.inode_sector;
+  st->current_done = bg.next;
+  st->current_cnt = bg.block_cnt;
+  st->target = bg.target;
+}
@@ -0,0 +1,46 @@
+#ifndef FILESYS_DEFRAG_H
+#define FILESYS_DEFRAG_H
+
+#include "block.h"
+#include "off_t.h"
+#include <stdbool.h>
+#include <stddef.h>
+
+/* Outcome of a defragmentation pass. */
+struct defrag_stats {
+  size_t files;          /* Regular files examined. */
+  size_t fragmented;     /* Files in more than one extent. */
+  size_t moved;          /* Files relocated. */
+  size_t extents_before; /* Extents over all files, before... */
+  size_t extents_after;  /* ...and after the pass. */
+  long long bytes_moved; /* Data copied. */
+};
+
+bool defrag_run(struct defrag_stats *);
+
+/* Background compaction moves at most this many sectors per step,
+   and by default this many per second. */
+#define DEFRAG_BG_CHUNK 16
+#define DEFRAG_BG_DEFAULT_RATE 256
+
+/* Progress of background compaction. */
+struct defrag_bg_status {
+  bool running;             /* Worker started and not stopped. */
+  bool paused;
+  unsigned rate;            /* Budget, in sectors per second. */
+  size_t files_done;        /* Files compacted so far. */
+  long long sectors_moved;  /* Sectors moved so far. */
+  block_sector_t current;   /* Inode of the file being moved, or 0... */
+  size_t current_done;      /* ...and how many of its */
+  size_t current_cnt;       /* sectors are already in place... */
+  block_sector_t target;    /* ...in the run allocated from here. */
+};
+
+bool defrag_bg_start(unsigned rate);
+void defrag_bg_set_rate(unsigned rate);
+void defrag_bg_pause(void);
+void defrag_bg_resume(void);
+void defrag_bg_stop(void);
+void defrag_bg_status(struct defrag_bg_status *);
+
+#endif /* fs/defrag.h */
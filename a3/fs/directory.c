@@ -1,8 +1,10 @@
 #include "directory.h"
+#include "dcache.h"
 #include "debug.h"
 #include "filesys.h"
 #include "inode.h"
 #include "list.h"
+#include "round.h"
 #include <stddef.h>
 #include <stdio.h>
 #include <stdlib.h>
@@ -48,28 +50,33 @@ void split_path_filename(const char *path, char *directory, char *filename) {
 }
 
 /* Creates a directory with space for ENTRY_CNT entries in the
-   given SECTOR.  Returns true if successful, false on failure. */
+   given SECTOR.  Returns true if successful, false on failure.
+   The directory is laid out as a hash table of one-sector buckets,
+   so that lookups need not scan every entry. */
 bool dir_create(block_sector_t sector, size_t entry_cnt) {
-  bool success = true;
-  success = inode_create(sector, entry_cnt * sizeof(struct dir_entry),
-                         /*is_dir*/ true);
-  if (!success)
+  struct dir_header h;
+  // one extra slot for the header, which occupies entry 0 of bucket 0
+  uint32_t bucket_cnt = DIV_ROUND_UP(entry_cnt + 1, DIR_BUCKET_SLOTS);
+
+  ASSERT(sizeof(struct dir_header) == sizeof(struct dir_entry));
+  ASSERT(sizeof(struct dir_bucket) == BLOCK_SECTOR_SIZE);
+
+  if (!inode_create(sector, bucket_cnt * BLOCK_SECTOR_SIZE, /*is_dir*/ true))
     return false;
 
   // The first (offset 0) dir entry is for parent directory; do self-referencing
   // Actual parent directory will be set on execution of dir_add()
-  struct dir *dir = dir_open(inode_open(sector));
-  ASSERT(dir != NULL);
-  struct dir_entry e;
+  struct inode *inode = inode_open(sector);
+  if (inode == NULL)
+    return false;
 
-  memset(&e, 0, sizeof(struct dir_entry));
-  e.inode_sector = sector;
-  e.in_use = true;
+  memset(&h, 0, sizeof h);
+  h.parent = sector;
+  h.magic = DIR_HASH_MAGIC;
+  h.bucket_cnt = bucket_cnt;
 
-  if (inode_write_at(dir->inode, &e, sizeof e, 0) != sizeof e) {
-    success = false;
-  }
-  dir_close(dir);
+  bool success = inode_write_at(inode, &h, sizeof h, 0) == sizeof h;
+  inode_close(inode);
 
   return success;
 }
@@ -79,9 +86,13 @@ bool dir_create(block_sector_t sector, size_t entry_cnt) {
 struct dir *dir_open(struct inode *inode) {
   struct dir *dir = calloc(1, sizeof *dir);
   if (inode != NULL && dir != NULL) {
+    struct dir_header h;
+
     dir->inode = inode;
     dir->pos = sizeof(struct dir_entry); // 0-pos is for parent directory
-	dir->open_cnt = 1;
+    if (inode_read_at(inode, &h, sizeof h, 0) == sizeof h &&
+        h.magic == DIR_HASH_MAGIC)
+      dir->bucket_cnt = h.bucket_cnt;
     return dir;
   } else {
     inode_close(inode);
@@ -93,14 +104,7 @@ struct dir *dir_open(struct inode *inode) {
 /* Opens the root directory and returns a directory for it.
    Return true if successful, false on failure. */
 struct dir *dir_open_root(void) {
-	if (cwd == NULL)
-	{
-		cwd = dir_open(inode_open(ROOT_DIR_SECTOR));
-		return cwd;
-	} else {
-		cwd->open_cnt += 1;
-		return cwd;
-	}
+  return dir_open(inode_open(ROOT_DIR_SECTOR));
 }
 
 /* Opens the directory for given path. */
@@ -121,6 +125,8 @@ struct dir *dir_open_path(const char *path) {
       curr = dir_reopen(cwd);
     }
   }
+  if (curr == NULL)
+    return NULL;
 
   // tokenize, and traverse the tree
   char *token, *p;
@@ -132,6 +138,12 @@ struct dir *dir_open_path(const char *path) {
       return NULL; // such directory not exist
     }
 
+    // every component must be a directory
+    if (!inode_is_directory(inode)) {
+      inode_close(inode);
+      dir_close(curr);
+      return NULL;
+    }
     struct dir *next = dir_open(inode);
     if (next == NULL) {
       dir_close(curr);
@@ -158,10 +170,9 @@ struct dir *dir_reopen(struct dir *dir) {
 
 /* Destroys DIR and frees associated resources. */
 void dir_close(struct dir *dir) {
-  if (dir != NULL && --dir->open_cnt == 0) {
+  if (dir != NULL) {
     inode_close(dir->inode);
     free(dir);
-	cwd = NULL;
   }
 }
 
@@ -171,6 +182,85 @@ struct inode *dir_get_inode(struct dir *dir) {
   return dir->inode;
 }
 
+/* Returns the byte offset just past the hash buckets of DIR.
+   Entries of a linear directory, and entries that overflowed every
+   bucket of a hashed one, are stored from here on. */
+static offset_t dir_table_end(const struct dir *dir) {
+  return dir->bucket_cnt * BLOCK_SECTOR_SIZE;
+}
+
+/* Returns the offset of the slot following the one at OFS.
+   Hash buckets end with a few bytes of bookkeeping, which are
+   skipped so that an entry never straddles two sectors. */
+static offset_t dir_next_ofs(const struct dir *dir, offset_t ofs) {
+  ofs += sizeof(struct dir_entry);
+  if (ofs < dir_table_end(dir) &&
+      ofs % BLOCK_SECTOR_SIZE >
+          (offset_t)((DIR_BUCKET_SLOTS - 1) * sizeof(struct dir_entry)))
+    ofs = ROUND_UP(ofs, BLOCK_SECTOR_SIZE);
+  return ofs;
+}
+
+/* Returns the home bucket of NAME in hashed directory DIR. */
+static uint32_t dir_hash(const struct dir *dir, const char *name) {
+  // FNV-1a
+  uint32_t h = 2166136261u;
+  for (; *name != '\0'; name++) {
+    h ^= (uint8_t)*name;
+    h *= 16777619u;
+  }
+  return h % dir->bucket_cnt;
+}
+
+/* Returns the bucket of DIR that holds the slot at OFS, or the
+   bucket count if the slot is in the linear part. */
+static uint32_t dir_slot_bucket(const struct dir *dir, offset_t ofs) {
+  return ofs < dir_table_end(dir) ? ofs / BLOCK_SECTOR_SIZE : dir->bucket_cnt;
+}
+
+/* Adds DELTA to the overflow counters of buckets FIRST...LAST-1.
+   On failure, the counters already changed are put back. */
+static bool dir_adjust_overflow(struct dir *dir, uint32_t first,
+                                uint32_t last, int delta) {
+  uint32_t b;
+  for (b = first; b < last; b++) {
+    offset_t ofs =
+        b * BLOCK_SECTOR_SIZE + offsetof(struct dir_bucket, overflow);
+    uint32_t overflow;
+    if (inode_read_at(dir->inode, &overflow, sizeof overflow, ofs) !=
+        sizeof overflow)
+      goto fail;
+    overflow += delta;
+    if (inode_write_at(dir->inode, &overflow, sizeof overflow, ofs) !=
+        sizeof overflow)
+      goto fail;
+  }
+  return true;
+
+fail:
+  dir_adjust_overflow(dir, first, b, -delta);
+  return false;
+}
+
+/* Scans the linear part of DIR, starting at byte offset OFS, for
+   an entry named NAME. */
+static bool lookup_linear(const struct dir *dir, const char *name,
+                          offset_t ofs, struct dir_entry *ep,
+                          offset_t *ofsp) {
+  struct dir_entry e;
+
+  for (; inode_read_at(dir->inode, &e, sizeof e, ofs) == sizeof e;
+       ofs += sizeof e)
+    if (e.in_use && !strcmp(name, e.name)) {
+      if (ep != NULL)
+        *ep = e;
+      if (ofsp != NULL)
+        *ofsp = ofs;
+      return true;
+    }
+  return false;
+}
+
 /* Searches DIR for a file with the given NAME.
    If successful, returns true, sets *EP to the directory entry
    if EP is non-null, and sets *OFSP to the byte offset of the
@@ -178,23 +268,122 @@ struct inode *dir_get_inode(struct dir *dir) {
    otherwise, returns false and ignores EP and OFSP. */
 static bool lookup(const struct dir *dir, const char *name,
                    struct dir_entry *ep, offset_t *ofsp) {
-  struct dir_entry e;
-  size_t ofs;
+  struct dir_bucket bucket;
+  uint32_t b;
+  size_t i;
 
   ASSERT(dir != NULL);
   ASSERT(name != NULL);
 
-  for (ofs = sizeof e; /* 0-pos is for parent directory */
-       inode_read_at(dir->inode, &e, sizeof e, ofs) == sizeof e;
-       ofs += sizeof e)
-    if (e.in_use && !strcmp(name, e.name)) {
-      if (ep != NULL)
-        *ep = e;
-      if (ofsp != NULL)
-        *ofsp = ofs;
-      return true;
+  if (dir->bucket_cnt == 0) // linear format; 0-pos is for parent directory
+    return lookup_linear(dir, name, sizeof(struct dir_entry), ep, ofsp);
+
+  for (b = dir_hash(dir, name); b < dir->bucket_cnt; b++) {
+    if (inode_read_at(dir->inode, &bucket, sizeof bucket,
+                      b * BLOCK_SECTOR_SIZE) != sizeof bucket)
+      return false;
+    for (i = (b == 0 ? 1 : 0); i < DIR_BUCKET_SLOTS; i++) {
+      struct dir_entry *e = &bucket.entries[i];
+      if (e->in_use && !strcmp(name, e->name)) {
+        if (ep != NULL)
+          *ep = *e;
+        if (ofsp != NULL)
+          *ofsp = b * BLOCK_SECTOR_SIZE + i * sizeof *e;
+        return true;
+      }
     }
-  return false;
+    if (bucket.overflow == 0)
+      return false;
+  }
+  return lookup_linear(dir, name, dir_table_end(dir), ep, ofsp);
+}
+
+/* Returns the offset in the linear part of DIR below which no slot
+   is free.  Hashed directories keep this hint in their header so
+   that it survives the directory being closed; linear ones keep it
+   on the in-memory inode. */
+static offset_t dir_get_free_ofs(const struct dir *dir) {
+  if (dir->bucket_cnt > 0) {
+    uint32_t free_ofs;
+    if (inode_read_at(dir->inode, &free_ofs, sizeof free_ofs,
+                      offsetof(struct dir_header, free_ofs)) !=
+            sizeof free_ofs ||
+        free_ofs < (uint32_t)dir_table_end(dir))
+      return dir_table_end(dir);
+    return free_ofs;
+  }
+  return dir->inode->dir_free_ofs;
+}
+
+/* Updates the free slot hint of DIR to OFS. */
+static void dir_set_free_ofs(struct dir *dir, offset_t ofs) {
+  if (dir->bucket_cnt > 0) {
+    uint32_t free_ofs = ofs;
+    inode_write_at(dir->inode, &free_ofs, sizeof free_ofs,
+                   offsetof(struct dir_header, free_ofs));
+  } else
+    dir->inode->dir_free_ofs = ofs;
+}
+
+/* Reads the superblock sector recorded in the header of DIR into
+   *SECTORP.  Returns false if DIR is a linear directory, which has
+   no room for it. */
+bool dir_get_super(struct dir *dir, block_sector_t *sectorp) {
+  return dir->bucket_cnt > 0 &&
+         inode_read_at(dir->inode, sectorp, sizeof *sectorp,
+                       offsetof(struct dir_header, super_sector)) ==
+             sizeof *sectorp;
+}
+
+/* Records SECTOR as the superblock in the header of DIR.  Returns
+   false if DIR is a linear directory. */
+bool dir_set_super(struct dir *dir, block_sector_t sector) {
+  return dir->bucket_cnt > 0 &&
+         inode_write_at(dir->inode, &sector, sizeof sector,
+                        offsetof(struct dir_header, super_sector)) ==
+             sizeof sector;
+}
+
+/* Finds a free slot for NAME in DIR and stores its offset in *OFSP.
+   If there are no free slots, *OFSP is set to the current
+   end-of-file.  In a hashed directory, the caller bumps the
+   overflow counters of the buckets probed on the way once the entry
+   is written.  The caller also advances the free slot hint, so a
+   failed write leaves it pointing at the slot. */
+static bool dir_find_slot(struct dir *dir, const char *name, offset_t *ofsp) {
+  struct dir_entry e;
+  offset_t ofs;
+
+  if (dir->bucket_cnt > 0) {
+    struct dir_bucket bucket;
+    uint32_t home = dir_hash(dir, name), b;
+    size_t i;
+
+    for (b = home; b < dir->bucket_cnt; b++) {
+      if (inode_read_at(dir->inode, &bucket, sizeof bucket,
+                        b * BLOCK_SECTOR_SIZE) != sizeof bucket)
+        return false;
+      for (i = (b == 0 ? 1 : 0); i < DIR_BUCKET_SLOTS; i++)
+        if (!bucket.entries[i].in_use) {
+          *ofsp = b * BLOCK_SECTOR_SIZE + i * sizeof e;
+          return true;
+        }
+    }
+  }
+
+  /* Start from the free slot hint rather than rescanning slots
+     that are known to be in use.
+     inode_read_at() will only return a short read at end of file.
+     Otherwise, we'd need to verify that we didn't get a short
+     read due to something intermittent such as low memory. */
+  for (ofs = dir_get_free_ofs(dir);
+       inode_read_at(dir->inode, &e, sizeof e, ofs) == sizeof e;
+       ofs += sizeof e) {
+    if (!e.in_use)
+      break;
+  }
+  *ofsp = ofs;
+  return true;
 }
 
 /* Returns whether the DIR is empty. */
@@ -204,7 +393,7 @@ bool dir_is_empty(const struct dir *dir) {
 
   for (ofs = sizeof e; /* 0-pos is for parent directory */
        inode_read_at(dir->inode, &e, sizeof e, ofs) == sizeof e;
-       ofs += sizeof e) {
+       ofs = dir_next_ofs(dir, ofs)) {
     if (e.in_use)
       return false;
   }
@@ -228,11 +417,30 @@ bool dir_lookup(const struct dir *dir, const char *name, struct inode **inode) {
     // parent directory : the information is stored at the first (0-pos) entry.
     inode_read_at(dir->inode, &e, sizeof e, 0);
     *inode = inode_open(e.inode_sector);
-  } else if (lookup(dir, name, &e, NULL)) {
-    // normal lookup. lookuped entry is stored into e
-    *inode = inode_open(e.inode_sector);
-  } else
-    *inode = NULL;
+  } else {
+    // normal lookup, answered from the dentry cache when possible
+    block_sector_t parent = inode_get_inumber(dir->inode);
+    block_sector_t sector;
+
+    switch (dcache_lookup(parent, name, &sector)) {
+    case DCACHE_HIT:
+      *inode = inode_open(sector);
+      break;
+    case DCACHE_NEGATIVE:
+      *inode = NULL;
+      break;
+    case DCACHE_MISS:
+      if (lookup(dir, name, &e, NULL)) {
+        // lookuped entry is stored into e
+        dcache_insert(parent, name, e.inode_sector);
+        *inode = inode_open(e.inode_sector);
+      } else {
+        dcache_insert_negative(parent, name);
+        *inode = NULL;
+      }
+      break;
+    }
+  }
 
   return *inode != NULL;
 }
@@ -265,10 +473,15 @@ bool dir_add(struct dir *dir, const char *name, block_sector_t inode_sector,
 
   // update the child directory [inode_sector] has a parent directory [dir]
   if (is_dir) {
-    /* e is a parent-directory-entry here */
+    /* e is a parent-directory-entry here; read it first so that the
+       rest of a hashed directory's header is preserved. */
     struct dir *child_dir = dir_open(inode_open(inode_sector));
     if (child_dir == NULL)
       goto done;
+    if (inode_read_at(child_dir->inode, &e, sizeof e, 0) != sizeof e) {
+      dir_close(child_dir);
+      goto done;
+    }
     e.inode_sector = inode_get_inumber(dir_get_inode(dir));
     if (inode_write_at(child_dir->inode, &e, sizeof e, 0) != sizeof e) {
       dir_close(child_dir);
@@ -276,24 +489,28 @@ bool dir_add(struct dir *dir, const char *name, block_sector_t inode_sector,
     }
     dir_close(child_dir);
   }
-  /* Set OFS to offset of free slot.
-     If there are no free slots, then it will be set to the
-     current end-of-file.
-
-     inode_read_at() will only return a short read at end of file.
-     Otherwise, we'd need to verify that we didn't get a short
-     read due to something intermittent such as low memory. */
-  for (ofs = 0; inode_read_at(dir->inode, &e, sizeof e, ofs) == sizeof e;
-       ofs += sizeof e) {
-    if (!e.in_use)
-      break;
-  }
+  /* Set OFS to offset of free slot. */
+  if (!dir_find_slot(dir, name, &ofs))
+    goto done;
 
   /* Write slot. */
+  memset(&e, 0, sizeof e);
   e.in_use = true;
   strncpy(e.name, name, sizeof e.name);
   e.inode_sector = inode_sector;
-  success = inode_write_at(dir->inode, &e, sizeof e, ofs) == sizeof e;
+  if (inode_write_at(dir->inode, &e, sizeof e, ofs) != sizeof e)
+    goto done;
+  if (dir->bucket_cnt > 0 &&
+      !dir_adjust_overflow(dir, dir_hash(dir, name), dir_slot_bucket(dir, ofs),
+                           1)) {
+    e.in_use = false;
+    inode_write_at(dir->inode, &e, sizeof e, ofs);
+    goto done;
+  }
+  if (ofs >= dir_table_end(dir))
+    dir_set_free_ofs(dir, ofs + sizeof e);
+  success = true;
+  dcache_insert(inode_get_inumber(dir->inode), name, inode_sector);
 
 done:
   return success;
@@ -324,7 +541,7 @@ bool dir_remove(struct dir *dir, const char *name) {
   /* Prevent removing non-empty directory. */
   if (inode_is_directory(inode)) {
     // target : the directory to be removed. (dir : the base directory)
-    struct dir *target = dir_open(inode);
+    struct dir *target = dir_open(inode_reopen(inode));
     bool is_empty = dir_is_empty(target);
     dir_close(target);
     if (!is_empty)
@@ -336,6 +553,17 @@ bool dir_remove(struct dir *dir, const char *name) {
   if (inode_write_at(dir->inode, &e, sizeof e, ofs) != sizeof e) {
     goto done;
   }
+  if (ofs >= dir_table_end(dir) && ofs < dir_get_free_ofs(dir))
+    dir_set_free_ofs(dir, ofs);
+  if (dir->bucket_cnt > 0) {
+    // undo the overflow counts taken when the entry was placed
+    dir_adjust_overflow(dir, dir_hash(dir, name), dir_slot_bucket(dir, ofs),
+                        -1);
+  }
+  dcache_insert_negative(inode_get_inumber(dir->inode), name);
+  if (inode_is_directory(inode))
+    dcache_invalidate_dir(inode_get_inumber(inode));
+
   /* Remove inode. */
   inode_remove(inode);
   success = true;
@@ -352,7 +580,7 @@ bool dir_readdir(struct dir *dir, char name[NAME_MAX + 1]) {
   struct dir_entry e;
 
   while (inode_read_at(dir->inode, &e, sizeof e, dir->pos) == sizeof e) {
-    dir->pos += sizeof e;
+    dir->pos = dir_next_ofs(dir, dir->pos);
     if (e.in_use) {
       strncpy(name, e.name, NAME_MAX + 1);
       return true;
@@ -365,11 +593,155 @@ block_sector_t dir_readdir_inode(struct dir *dir, char name[NAME_MAX + 1]) {
   struct dir_entry e;
 
   while (inode_read_at(dir->inode, &e, sizeof e, dir->pos) == sizeof e) {
-    dir->pos += sizeof e;
+    dir->pos = dir_next_ofs(dir, dir->pos);
     if (e.in_use) {
       strncpy(name, e.name, NAME_MAX + 1);
       return e.inode_sector;
     }
   }
   return -1;
-}
\ No newline at end of file
+}
+/* Number of bytes of directory read at a time by dir_readdir_plus(). */
+#define DIR_PLUS_CHUNK (8 * BLOCK_SECTOR_SIZE)
+
+/* Reads up to MAX of the next in-use entries of DIR into ENTS,
+   together with the length and type of each inode, and returns how
+   many were read; 0 means the end of the directory was reached.
+   If WANT_BLOCKS is true, the data sectors of each file that is not
+   compressed are also returned and must be freed with
+   dir_readdir_plus_release().
+
+   The directory is read several sectors at a time and each inode is
+   read straight from the buffer cache, without a name lookup or an
+   inode_open(), so listing a directory costs one pass over it. */
+size_t dir_readdir_plus(struct dir *dir, struct dir_entry_plus *ents,
+                        size_t max, bool want_blocks) {
+  uint8_t *chunk = malloc(DIR_PLUS_CHUNK);
+  size_t cnt = 0;
+
+  if (chunk == NULL)
+    return 0;
+
+  while (cnt < max) {
+    // read sector-aligned, so every sector is copied in a single piece
+    offset_t base = ROUND_DOWN(dir->pos, BLOCK_SECTOR_SIZE);
+    offset_t n = inode_read_at(dir->inode, chunk, DIR_PLUS_CHUNK, base);
+    if (dir->pos + (offset_t)sizeof(struct dir_entry) > base + n)
+      break;
+
+    while (cnt < max &&
+           dir->pos + (offset_t)sizeof(struct dir_entry) <= base + n) {
+      struct dir_entry *e = (struct dir_entry *)(chunk + (dir->pos - base));
+      dir->pos = dir_next_ofs(dir, dir->pos);
+      if (!e->in_use)
+        continue;
+
+      struct dir_entry_plus *ep = &ents[cnt++];
+      struct inode_disk disk_inode;
+
+      inode_read_disk(e->inode_sector, &disk_inode);
+      strncpy(ep->name, e->name, NAME_MAX + 1);
+      ep->inode_sector = e->inode_sector;
+      ep->length = disk_inode.length;
+      ep->is_dir = disk_inode.is_dir;
+      ep->compressed = disk_inode.flags & INODE_COMPRESSED;
+      ep->blocks = NULL;
+      ep->block_cnt = 0;
+      if (want_blocks && !ep->compressed) {
+        ep->blocks = inode_disk_data_sectors(&disk_inode);
+        if (ep->blocks != NULL)
+          ep->block_cnt = bytes_to_sectors(disk_inode.length);
+      }
+    }
+  }
+
+  free(chunk);
+  return cnt;
+}
+
+/* Frees the block lists of CNT entries returned by dir_readdir_plus(). */
+void dir_readdir_plus_release(struct dir_entry_plus *ents, size_t cnt) {
+  size_t i;
+  for (i = 0; i < cnt; i++) {
+    free(ents[i].blocks);
+    ents[i].blocks = NULL;
+    ents[i].block_cnt = 0;
+  }
+}
+
+/* A directory waiting to be read by dir_walk(). */
+struct dir_walk_item {
+  block_sector_t sector;
+  char *path; /* From the top directory, "" for the top itself. */
+};
+
+/* Returns PARENT and NAME joined by a slash, or NAME if PARENT is
+   empty, in a new string; NULL if memory runs out. */
+static char *dir_walk_join(const char *parent, const char *name) {
+  char *path = malloc(strlen(parent) + strlen(name) + 2);
+  if (path != NULL)
+    sprintf(path, *parent != '\0' ? "%s/%s" : "%s%s", parent, name);
+  return path;
+}
+
+/* Calls FN on every entry of the tree below directory TOP, breadth
+   first, each directory in its own order, with the entry's path
+   from TOP, which is only valid during the call.  WANT_BLOCKS is
+   as for dir_readdir_plus(); FN may take over an entry's blocks by
+   setting them to NULL.  Returns false if
+   memory runs out, which leaves part of the tree unvisited. */
+bool dir_walk(struct dir *top, bool want_blocks, dir_walk_func *fn,
+              void *aux) {
+  struct dir_walk_item *queue = NULL;
+  struct dir_entry_plus ents[DIR_PLUS_BATCH];
+  size_t head = 0, tail = 0, cap = 8, n, i;
+  bool ok = true;
+
+  queue = malloc(cap * sizeof *queue);
+  if (queue == NULL)
+    return false;
+  queue[tail].sector = inode_get_inumber(top->inode);
+  queue[tail++].path = strdup("");
+  while (head < tail) {
+    struct dir_walk_item item = queue[head++];
+    struct dir *dir = NULL;
+
+    if (ok && item.path != NULL)
+      dir = dir_open(inode_open(item.sector));
+    else
+      ok = false;
+    while (ok && dir != NULL &&
+           (n = dir_readdir_plus(dir, ents, DIR_PLUS_BATCH, want_blocks)) > 0) {
+      for (i = 0; i < n; i++) {
+        char *path = dir_walk_join(item.path, ents[i].name);
+        if (path == NULL) {
+          ok = false;
+          break;
+        }
+        fn(path, &ents[i], aux);
+        if (!ents[i].is_dir) {
+          free(path);
+          continue;
+        }
+        if (tail == cap) {
+          struct dir_walk_item *grown =
+              realloc(queue, cap * 2 * sizeof *queue);
+          if (grown == NULL) {
+            free(path);
+            ok = false;
+            break;
+          }
+          queue = grown;
+          cap *= 2;
+        }
+        queue[tail].sector = ents[i].inode_sector;
+        queue[tail++].path = path;
+      }
+      dir_readdir_plus_release(ents, n);
+    }
+    dir_close(dir);
+    free(item.path);
+  }
+  free(queue);
+  return ok;
+}
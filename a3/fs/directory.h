@@ -5,17 +5,21 @@
 #include "off_t.h"
 #include <stdbool.h>
 #include <stddef.h>
+#include <stdint.h>
 
 /* Maximum length of a file name component. */
 #define NAME_MAX 30
 
 struct inode;
 
+/* Identifies a directory stored in hashed (bucketed) format. */
+#define DIR_HASH_MAGIC 0x48524944
+
 /* A directory. */
 struct dir {
-  struct inode *inode; /* Backing store. */
-  offset_t pos;        /* Current position. */
-  int open_cnt;           /* Number of openers. */
+  struct inode *inode;  /* Backing store. */
+  offset_t pos;         /* Current position. */
+  uint32_t bucket_cnt;  /* Hash buckets, or 0 for a linear directory. */
 };
 
 /* A single directory entry. */
@@ -25,6 +29,53 @@ struct dir_entry {
   bool in_use;                 /* In use or free? */
 };
 
+/* Header of a hashed directory, stored in the first (0-pos) entry.
+   The parent sector overlays dir_entry's inode_sector, so ".."
+   resolves the same way in both formats.  A linear directory has
+   a zeroed name there, which never matches DIR_HASH_MAGIC. */
+struct dir_header {
+  block_sector_t parent; /* Sector of the parent directory. */
+  uint32_t magic;        /* DIR_HASH_MAGIC. */
+  uint32_t bucket_cnt;   /* Number of hash buckets. */
+  uint32_t free_ofs;     /* No free slot after the buckets below this. */
+  block_sector_t super_sector; /* Superblock (root only), or 0. */
+  uint8_t unused[sizeof(struct dir_entry) - 5 * sizeof(uint32_t)];
+};
+
+/* Entries per hash bucket.  A bucket is exactly one sector, so a
+   lookup that hits its home bucket reads a single sector. */
+#define DIR_BUCKET_SLOTS (BLOCK_SECTOR_SIZE / sizeof(struct dir_entry))
+
+/* On-disk hash bucket.
+   Entries whose home bucket is full are placed in the next bucket
+   with a free slot; OVERFLOW counts the entries hashed at or
+   before this bucket that live beyond it, so a lookup only probes
+   further while it is nonzero.  Entries that find no bucket at all
+   are appended linearly after the last bucket. */
+struct dir_bucket {
+  struct dir_entry entries[DIR_BUCKET_SLOTS];
+  uint32_t overflow;
+  uint8_t unused[BLOCK_SECTOR_SIZE -
+                 DIR_BUCKET_SLOTS * sizeof(struct dir_entry) -
+                 sizeof(uint32_t)];
+};
+
+/* A convenient number of entries to fetch per dir_readdir_plus() call. */
+#define DIR_PLUS_BATCH 32
+
+/* A directory entry together with metadata of the inode it names,
+   as returned by dir_readdir_plus(). */
+struct dir_entry_plus {
+  char name[NAME_MAX + 1];     /* Null terminated file name. */
+  block_sector_t inode_sector; /* Sector number of the inode. */
+  offset_t length;             /* File size in bytes. */
+  bool is_dir;                 /* Is the entry a directory? */
+  bool compressed;             /* Is its data compressed? */
+  block_sector_t *blocks;      /* Data sectors in file order, or NULL. */
+  size_t block_cnt;            /* Number of elements in BLOCKS. */
+};
+
+/* Current directory for relative paths, or NULL for the root. */
 extern struct dir *cwd;
 
 /* Directory and Path manipulation utilities. */
@@ -46,5 +97,15 @@ bool dir_add(struct dir *, const char *name, block_sector_t, bool is_dir);
 bool dir_remove(struct dir *, const char *name);
 bool dir_readdir(struct dir *, char name[NAME_MAX + 1]);
 block_sector_t dir_readdir_inode(struct dir *, char name[NAME_MAX + 1]);
+size_t dir_readdir_plus(struct dir *, struct dir_entry_plus *, size_t max,
+                        bool want_blocks);
+void dir_readdir_plus_release(struct dir_entry_plus *, size_t cnt);
+bool dir_get_super(struct dir *, block_sector_t *);
+bool dir_set_super(struct dir *, block_sector_t);
+
+/* Walking a tree. */
+typedef void dir_walk_func(const char *path, struct dir_entry_plus *,
+                           void *aux);
+bool dir_walk(struct dir *, bool want_blocks, dir_walk_func *, void *aux);
 
 #endif /* fs/directory.h */
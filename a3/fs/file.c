@@ -4,66 +4,117 @@
 #include "list.h"
 #include "string.h"
 #include <stdbool.h>
+#include <stdint.h>
 #include <stdlib.h>
 
-struct list file_table;
+/* Open file table: a hash table keyed by file name. */
+#define FILE_TABLE_BUCKETS 64
+
+static struct list file_table[FILE_TABLE_BUCKETS];
+
 struct file_table_entry {
   char *fname;           /* file descriptor. */
   struct file *f;        /* pointer to open file. */
-  struct list_elem elem; /* used by the process to store its open files. */
+  struct list_elem elem; /* element in a file_table bucket. */
 };
 
-void init_file_table() { llist_init(&file_table); }
+/* Returns the bucket of file_table that FNAME hashes to. */
+static struct list *file_table_bucket(const char *fname) {
+  // FNV-1a
+  uint32_t h = 2166136261u;
+  for (; *fname != '\0'; fname++) {
+    h ^= (uint8_t)*fname;
+    h *= 16777619u;
+  }
+  return &file_table[h % FILE_TABLE_BUCKETS];
+}
 
-void free_file_table() {
-  while (!list_empty(&file_table)) {
-    struct list_elem *e = list_pop_front(&file_table);
+/* Returns the table entry for FNAME, or NULL if it is not open. */
+static struct file_table_entry *file_table_lookup(const char *fname) {
+  struct list *bucket = file_table_bucket(fname);
+  struct list_elem *e;
+  for (e = list_begin(bucket); e != list_end(bucket); e = list_next(e)) {
     struct file_table_entry *entry =
         list_entry(e, struct file_table_entry, elem);
-    free(entry->fname);
-    file_close(entry->f);
-    list_remove(&entry->elem);
-    free(entry);
+    if (strcmp(entry->fname, fname) == 0)
+      return entry;
   }
+  return NULL;
 }
 
-void add_to_file_table(struct file *file, char *fname) {
-  if (get_file_by_fname(fname) != NULL)
-    return;
+/* Closes the file of ENTRY and releases ENTRY. */
+static void file_table_release(struct file_table_entry *entry) {
+  list_remove(&entry->elem);
+  free(entry->fname);
+  file_close(entry->f);
+  free(entry);
+}
+
+void init_file_table() {
+  size_t i;
+  for (i = 0; i < FILE_TABLE_BUCKETS; i++)
+    llist_init(&file_table[i]);
+}
+
+/* Closes every open file whose name KEEP rejects, or every open
+   file if KEEP is null. */
+static void file_table_release_unless(bool (*keep)(const char *)) {
+  size_t i;
+  for (i = 0; i < FILE_TABLE_BUCKETS; i++) {
+    struct list_elem *e = list_begin(&file_table[i]);
+    while (e != list_end(&file_table[i])) {
+      struct file_table_entry *entry =
+          list_entry(e, struct file_table_entry, elem);
+      e = list_next(e);
+      if (keep == NULL || !keep(entry->fname))
+        file_table_release(entry);
+    }
+  }
+}
+
+void free_file_table() { file_table_release_unless(NULL); }
+
+/* Adds FILE to the table under FNAME.  Returns true if successful,
+   false if FNAME is already open or memory allocation fails; the
+   caller still owns FILE on failure. */
+bool add_to_file_table(struct file *file, char *fname) {
+  struct file_table_entry *entry;
 
-  struct file_table_entry *entry = malloc(sizeof(struct file_table_entry));
+  if (file_table_lookup(fname) != NULL)
+    return false;
+  entry = malloc(sizeof(struct file_table_entry));
+  if (entry == NULL)
+    return false;
   entry->fname = strdup(fname);
+  if (entry->fname == NULL) {
+    free(entry);
+    return false;
+  }
   entry->f = file;
-  list_push_back(&file_table, &entry->elem);
+  list_push_back(file_table_bucket(fname), &entry->elem);
+  return true;
 }
 
 bool remove_from_file_table(char *fname) {
-  struct list_elem *e = list_begin(&file_table);
-  struct file_table_entry *entry;
-  for (; e != list_end(&file_table); e = list_next(e)) {
-    entry = list_entry(e, struct file_table_entry, elem);
-    if (strcmp(entry->fname, fname) == 0) {
-      free(entry->fname);
-      file_close(entry->f);
-      list_remove(&entry->elem);
-      free(entry);
-      return true;
-    }
-  }
-  return false;
+  struct file_table_entry *entry = file_table_lookup(fname);
+  if (entry == NULL)
+    return false;
+  file_table_release(entry);
+  return true;
+}
+
+/* Closes every file opened under a relative name, whose meaning
+   changes with the current directory. */
+static bool is_absolute(const char *fname) { return fname[0] == '/'; }
+
+void remove_relative_from_file_table(void) {
+  file_table_release_unless(is_absolute);
 }
 
 /* return file object crossponding to given filename */
 struct file *get_file_by_fname(char *fname) {
-  struct list_elem *e = list_begin(&file_table);
-  struct file_table_entry *entry;
-  for (; e != list_end(&file_table); e = list_next(e)) {
-    entry = list_entry(e, struct file_table_entry, elem);
-    if (strcmp(entry->fname, fname) == 0)
-      return entry->f;
-  }
-
-  return NULL;
+  struct file_table_entry *entry = file_table_lookup(fname);
+  return entry != NULL ? entry->f : NULL;
 }
 
 /* Opens a file for the given INODE, of which it takes ownership,
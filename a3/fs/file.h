@@ -14,9 +14,10 @@ struct file {
 };
 
 void init_file_table();
-void add_to_file_table(struct file *, char *);
+bool add_to_file_table(struct file *, char *);
 struct file *get_file_by_fname(char *fname);
 bool remove_from_file_table(char *fname);
+void remove_relative_from_file_table(void);
 void free_file_table();
 
 /* Opening and closing files. */
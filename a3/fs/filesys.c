@@ -1,23 +1,40 @@
 #include "filesys.h"
 #include "cache.h"
+#include "checksum.h"
+#include "dcache.h"
 #include "debug.h"
+#include "dedup.h"
+#include "defrag.h"
 #include "directory.h"
 #include "file.h"
 #include "free-map.h"
+#include "index.h"
 #include "inode.h"
+#include "journal.h"
+#include "super.h"
+#include <pthread.h>
 #include <stdio.h>
 #include <string.h>
 
 #define MAX_FILES_IN_DIRECTORY 1000
+#define SUBDIR_ENTRIES 64 /* Default room of a new subdirectory. */
 
 /* Partition that contains the file system. */
 struct block *fs_device;
 
+/* Held by the shell while it runs a command and by background
+   work (see defrag.c) while it touches the file system, so the two
+   never interleave within an operation.  Each time it is held is one
+   journal transaction. */
+static pthread_mutex_t fs_lock = PTHREAD_MUTEX_INITIALIZER;
+
 static void do_format(void);
 
 /* Initializes the file system module.
    If FORMAT is true, reformats the file system. */
 void filesys_init(bool format) {
+  size_t replayed;
+
   fs_device = block_get_hd();
   if (fs_device == NULL)
     PANIC("No file system device found, can't initialize file system.");
@@ -25,11 +42,27 @@ void filesys_init(bool format) {
   inode_init();
   free_map_init();
   buffer_cache_init();
+  dcache_init();
 
   if (format)
     do_format();
 
+  // the checksums and the journal are found through the superblock;
+  // the journal is replayed before anything else reads the metadata it
+  // may change, and the checksums are loaded first so that replay
+  // keeps them current
+  super_init();
+  checksum_init();
+  replayed = journal_init();
+  if (replayed > 0) {
+    printf("Journal: replayed %zu sectors\n", replayed);
+    inode_drop_closed();
+    super_init();
+    checksum_init();
+  }
   free_map_open();
+  index_init();
+  dedup_init();
 
   printf("Num free sectors: %d\n", num_free_sectors());
 
@@ -37,16 +70,35 @@ void filesys_init(bool format) {
 }
 
 /* Shuts down the file system module, writing any unwritten data
-   to disk. */
+   to disk.  Must be called with the file system lock held. */
 void filesys_done(void) {
+  defrag_bg_stop();
+  // files still open may be removed ones, freed as they close
+  free_file_table();
+  dir_close(cwd);
+  cwd = NULL;
+  dedup_done();
+  index_done();
+  journal_done();
   free_map_close();
   buffer_cache_close();
-  free_file_table();
+}
+
+/* Acquires the file system lock. */
+void filesys_lock(void) { pthread_mutex_lock(&fs_lock); }
+
+/* Ends the transaction and releases the file system lock. */
+void filesys_unlock(void) {
+  journal_end();
+  pthread_mutex_unlock(&fs_lock);
 }
 
 /* Creates a file or directory (set by `is_dir`) of
    full path `path` with the given `initial_size`.
    The path to file consists of two parts: path directory and filename.
+   A relative path starts from the current directory.  For a
+   directory, `initial_size` is the number of entries it has room for
+   before it overflows its hash buckets, or 0 for a default.
 
    Returns true if successful, false otherwise.
    Fails if a file named NAME already exists,
@@ -55,31 +107,31 @@ bool filesys_create(const char *path, offset_t initial_size, bool is_dir) {
   block_sector_t inode_sector = 0;
 
   // split path and name
-  char directory[strlen(path)];
-  char file_name[strlen(path)];
+  char directory[strlen(path) + 1];
+  char file_name[strlen(path) + 1];
   split_path_filename(path, directory, file_name);
-  struct dir *dir = dir_open_root(); // dir_open_path(directory);
+  struct dir *dir = dir_open_path(directory);
 
   bool success = false;
-  // printf("1");
-  if (dir != NULL) {
-    // printf("2");
-    if (free_map_allocate(1, &inode_sector)) {
-      // printf("3");
-      if (inode_create(inode_sector, initial_size, is_dir)) {
-        // printf("4");
-        if (dir_add(dir, file_name, inode_sector, is_dir)) {
-          // printf("5");
-          success = true;
+  if (dir != NULL && free_map_allocate(1, &inode_sector)) {
+    bool created =
+        is_dir ? dir_create(inode_sector, initial_size > 0 ? initial_size
+                                                           : SUBDIR_ENTRIES)
+               : inode_create(inode_sector, initial_size, false);
+    if (created) {
+      if (dir_add(dir, file_name, inode_sector, is_dir)) {
+        success = true;
+      } else {
+        // frees what the inode points at, and the inode itself
+        struct inode *inode = inode_open(inode_sector);
+        if (inode != NULL) {
+          inode_remove(inode);
+          inode_close(inode);
+          inode_sector = 0;
         }
       }
     }
   }
-  // printf("\n");
-  //  bool success = (dir != NULL
-  //                  && free_map_allocate (1, &inode_sector)
-  //                  && inode_create (inode_sector, initial_size)
-  //                  && dir_add (dir, name, inode_sector));
   if (!success && inode_sector != 0)
     free_map_release(inode_sector, 1);
   dir_close(dir);
@@ -87,7 +139,8 @@ bool filesys_create(const char *path, offset_t initial_size, bool is_dir) {
   return success;
 }
 
-/* Opens the file with the given NAME.
+/* Opens the file with the given NAME, relative to the current
+   directory unless it starts with '/'.
    Returns the new file if successful or a null pointer
    otherwise.
    Fails if no file named NAME exists,
@@ -100,7 +153,7 @@ struct file *filesys_open(const char *name) {
   char directory[l + 1];
   char file_name[l + 1];
   split_path_filename(name, directory, file_name);
-  struct dir *dir = dir_open_root(); // dir_open_path(directory);
+  struct dir *dir = dir_open_path(directory);
   struct inode *inode = NULL;
 
   // removed directory handling
@@ -109,25 +162,68 @@ struct file *filesys_open(const char *name) {
 
   if (strlen(file_name) > 0) {
     dir_lookup(dir, file_name, &inode);
-    dir_close(dir);
   } else { // empty filename : just return the directory
-    inode = dir_get_inode(dir);
+    inode = inode_reopen(dir_get_inode(dir));
   }
+  dir_close(dir);
 
   // removed file handling
-  if (inode == NULL || inode_is_removed(inode))
+  if (inode == NULL || inode_is_removed(inode)) {
+    inode_close(inode);
     return NULL;
+  }
 
   return file_open(inode);
 }
 
+/* Creates the file DST with the contents of the file SRC, sharing
+   SRC's data sectors until one of the two is written (see
+   inode_clone()), so that no data is copied.
+   Returns true if successful, false otherwise.
+   Fails if SRC does not exist or is a directory, if DST exists, or
+   if the disk is full. */
+bool filesys_clone(const char *src, const char *dst) {
+  char directory[strlen(dst) + 1];
+  char file_name[strlen(dst) + 1];
+  block_sector_t inode_sector = 0;
+  struct file *file = filesys_open(src);
+  struct dir *dir;
+  bool success = false;
+
+  if (file == NULL)
+    return false;
+  split_path_filename(dst, directory, file_name);
+  dir = dir_open_path(directory);
+  if (dir != NULL && !inode_is_directory(file_get_inode(file)) &&
+      free_map_allocate(1, &inode_sector) &&
+      inode_clone(file_get_inode(file), inode_sector)) {
+    if (dir_add(dir, file_name, inode_sector, false)) {
+      success = true;
+    } else {
+      // drops the references the clone took
+      struct inode *inode = inode_open(inode_sector);
+      if (inode != NULL) {
+        inode_remove(inode);
+        inode_close(inode);
+        inode_sector = 0;
+      }
+    }
+  }
+  if (!success && inode_sector != 0)
+    free_map_release(inode_sector, 1);
+  dir_close(dir);
+  file_close(file);
+
+  return success;
+}
+
 /* Deletes the file named NAME.
    Returns true if successful, false on failure.
    Fails if no file named NAME exists,
    or if an internal memory allocation fails. */
 bool filesys_remove(const char *name) {
-  char directory[strlen(name)];
-  char file_name[strlen(name)];
+  char directory[strlen(name) + 1];
+  char file_name[strlen(name) + 1];
   split_path_filename(name, directory, file_name);
   struct dir *dir = dir_open_path(directory);
 
@@ -137,7 +233,8 @@ bool filesys_remove(const char *name) {
   return success;
 }
 
-/* Change CWD for the current thread. */
+/* Change CWD for the current thread.  Files open under relative
+   names are closed, since those names now mean other files. */
 bool filesys_chdir(const char *name) {
   struct dir *dir = dir_open_path(name);
 
@@ -148,6 +245,7 @@ bool filesys_chdir(const char *name) {
   // switch CWD
   dir_close(cwd);
   cwd = dir;
+  remove_relative_from_file_table();
   return true;
 }
 
@@ -13,8 +13,11 @@ extern struct block *fs_device;
 
 void filesys_init(bool format);
 void filesys_done(void);
+void filesys_lock(void);
+void filesys_unlock(void);
 bool filesys_create(const char *name, offset_t initial_size, bool is_dir);
 struct file *filesys_open(const char *name);
+bool filesys_clone(const char *src, const char *dst);
 bool filesys_remove(const char *name);
 bool filesys_chdir(const char *name);
 
@@ -4,16 +4,51 @@
 #include "file.h"
 #include "filesys.h"
 #include "inode.h"
+#include "super.h"
+#include "dedup.h"
+#include "journal.h"
+#include <pthread.h>
+#include <stdint.h>
 #include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
 
 static struct file *free_map_file; /* Free map file. */
 struct bitmap *free_map;           /* Free map, one bit per sector. */
+static int batch_depth;            /* Nesting of free_map_begin_batch(). */
+
+/* Sectors may be shared by several files (see dedup.c).  For each
+   sector, the reference count file records how many references it
+   has beyond the first, so that an ordinary sector counts 0 and
+   images without sharing need no such file.  It is created the
+   first time a sector is shared. */
+static struct inode *refs_inode; /* Reference count file, or NULL. */
+static uint16_t *refs;           /* Its contents, or NULL. */
+
+/* With the journal on, a sector freed by a transaction must not be
+   reused until the change that dropped it is committed: otherwise a
+   crash could leave the committed metadata pointing at a sector that
+   already holds something else.  Such sectors stay in PENDING, and
+   are skipped by allocation, until then.  FREED lists them in the
+   order freed; the first FREED_ENDED were freed by transactions that
+   have ended.  PENDING_LOCK guards these, as the journal commits
+   from its own thread. */
+static struct bitmap *pending;
+static block_sector_t *freed;
+static size_t freed_cnt, freed_cap, freed_ended;
+static pthread_mutex_t pending_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static void free_map_close_refs(void);
 
 /* Initializes the free map. */
 void free_map_init(void) {
   free_map = bitmap_create(block_size(fs_device) - 1);
+  if (pending != NULL)
+    bitmap_destroy(pending);
+  pending = bitmap_create(block_size(fs_device) - 1);
+  freed_cnt = freed_ended = 0;
 
-  if (free_map == NULL)
+  if (free_map == NULL || pending == NULL)
     PANIC("bitmap creation failed--file system device is too large");
   bitmap_mark(free_map, FREE_MAP_SECTOR);
   bitmap_mark(free_map, ROOT_DIR_SECTOR);
@@ -23,14 +58,46 @@ int num_free_sectors(void) {
   return bitmap_count(free_map, 0, bitmap_size(free_map), 0);
 }
 
+/* Returns the first of CNT consecutive free sectors that are not
+   pending reuse, or BITMAP_ERROR. */
+static size_t free_map_scan(size_t cnt) {
+  size_t start = 0, sector, busy;
+
+  pthread_mutex_lock(&pending_lock);
+  for (;;) {
+    sector = bitmap_scan(free_map, start, cnt, false);
+    if (sector == BITMAP_ERROR || freed_cnt == 0)
+      break;
+    busy = bitmap_scan(pending, sector, 1, true);
+    if (busy == BITMAP_ERROR || busy >= sector + cnt)
+      break;
+    start = busy + 1;
+  }
+  pthread_mutex_unlock(&pending_lock);
+  return sector;
+}
+
+/* Returns true if none of the CNT sectors at SECTOR is pending
+   reuse. */
+static bool free_map_reusable(block_sector_t sector, size_t cnt) {
+  bool none;
+
+  pthread_mutex_lock(&pending_lock);
+  none = bitmap_none(pending, sector, cnt);
+  pthread_mutex_unlock(&pending_lock);
+  return none;
+}
+
 /* Allocates CNT consecutive sectors from the free map and stores
    the first into *SECTORP.
    Returns true if successful, false if not enough consecutive
    sectors were available or if the free_map file could not be
    written. */
 bool free_map_allocate(size_t cnt, block_sector_t *sectorp) {
-  block_sector_t sector = bitmap_scan_and_flip(free_map, 0, cnt, false);
-  if (sector != BITMAP_ERROR && free_map_file != NULL &&
+  block_sector_t sector = free_map_scan(cnt);
+  if (sector != BITMAP_ERROR)
+    bitmap_set_multiple(free_map, sector, cnt, true);
+  if (sector != BITMAP_ERROR && free_map_file != NULL && batch_depth == 0 &&
       !bitmap_write(free_map, free_map_file)) {
     bitmap_set_multiple(free_map, sector, cnt, false);
     sector = BITMAP_ERROR;
@@ -40,11 +107,194 @@ bool free_map_allocate(size_t cnt, block_sector_t *sectorp) {
   return sector != BITMAP_ERROR;
 }
 
-/* Makes CNT sectors starting at SECTOR available for use. */
+/* Allocates the CNT sectors starting at SECTOR, which must all be
+   free.  Returns false if one of them is not, or is pending reuse,
+   or if the free_map file could not be written. */
+bool free_map_allocate_at(block_sector_t sector, size_t cnt) {
+  if (sector + cnt > bitmap_size(free_map) ||
+      !bitmap_none(free_map, sector, cnt) || !free_map_reusable(sector, cnt))
+    return false;
+  bitmap_set_multiple(free_map, sector, cnt, true);
+  if (free_map_file != NULL && batch_depth == 0 &&
+      !bitmap_write(free_map, free_map_file)) {
+    bitmap_set_multiple(free_map, sector, cnt, false);
+    return false;
+  }
+  return true;
+}
+
+/* Writes the reference count of SECTOR to the reference count
+   file. */
+static void free_map_write_refs(block_sector_t sector) {
+  inode_write_at(refs_inode, &refs[sector], sizeof *refs,
+                 sector * sizeof *refs);
+}
+
+/* Adds SECTOR, just freed by the running transaction, to the
+   sectors pending reuse. */
+static void free_map_defer(block_sector_t s) {
+  pthread_mutex_lock(&pending_lock);
+  if (freed_cnt == freed_cap) {
+    size_t new_cap = freed_cap == 0 ? 64 : freed_cap * 2;
+    block_sector_t *new_freed = realloc(freed, new_cap * sizeof *freed);
+    if (new_freed == NULL)
+      PANIC("out of memory for sectors pending reuse");
+    freed = new_freed;
+    freed_cap = new_cap;
+  }
+  freed[freed_cnt++] = s;
+  bitmap_mark(pending, s);
+  pthread_mutex_unlock(&pending_lock);
+}
+
+/* Drops one reference to each of the CNT sectors starting at
+   SECTOR, making those that had only one available for use, or
+   with the journal on, for use once the running transaction is
+   committed. */
 void free_map_release(block_sector_t sector, size_t cnt) {
+  size_t i;
+
   ASSERT(bitmap_all(free_map, sector, cnt));
-  bitmap_set_multiple(free_map, sector, cnt, false);
-  bitmap_write(free_map, free_map_file);
+  for (i = 0; i < cnt; i++) {
+    block_sector_t s = sector + i;
+    if (refs != NULL && refs[s] > 0) {
+      refs[s]--;
+      free_map_write_refs(s);
+    } else {
+      bitmap_reset(free_map, s);
+      dedup_forget(s);
+      if (journal_enabled())
+        free_map_defer(s);
+    }
+  }
+  if (batch_depth == 0)
+    bitmap_write(free_map, free_map_file);
+}
+
+/* Creates the reference count file, all zeros.  Returns false if
+   the image cannot hold one or the disk is full. */
+static bool free_map_create_refs(void) {
+  struct super_block *sb = super_get();
+  size_t size = bitmap_size(free_map) * sizeof *refs;
+  block_sector_t sector;
+
+  if (!super_supported() || !free_map_allocate(1, &sector))
+    return false;
+  if (!inode_create(sector, size, false)) {
+    free_map_release(sector, 1);
+    return false;
+  }
+  refs = calloc(bitmap_size(free_map), sizeof *refs);
+  refs_inode = inode_open(sector);
+  sb->refcount_sector = sector;
+  if (refs == NULL || refs_inode == NULL || !super_write()) {
+    sb->refcount_sector = 0;
+    free(refs);
+    refs = NULL;
+    if (refs_inode != NULL) {
+      inode_remove(refs_inode);
+      inode_close(refs_inode);
+      refs_inode = NULL;
+    } else
+      free_map_release(sector, 1);
+    return false;
+  }
+  return true;
+}
+
+/* Adds a reference to SECTOR, which must be in use, so that it takes
+   one more free_map_release() to free.  Returns false if the
+   reference count file cannot be created or the count is at its
+   limit. */
+bool free_map_ref(block_sector_t sector) {
+  ASSERT(bitmap_test(free_map, sector));
+  if (refs == NULL && !free_map_create_refs())
+    return false;
+  if (refs[sector] == UINT16_MAX)
+    return false;
+  refs[sector]++;
+  free_map_write_refs(sector);
+  return true;
+}
+
+/* Returns the number of references to SECTOR: 0 if it is free,
+   otherwise 1 plus the number of times it has been shared. */
+unsigned free_map_refs(block_sector_t sector) {
+  if (!bitmap_test(free_map, sector))
+    return 0;
+  return 1 + (refs != NULL ? refs[sector] : 0);
+}
+
+/* Sets the number of references to SECTOR, which must be in use, to
+   CNT (at least 1).  Used by fsck to repair the counts.  Returns
+   false if they cannot be recorded. */
+bool free_map_set_refs(block_sector_t sector, unsigned cnt) {
+  ASSERT(cnt > 0 && bitmap_test(free_map, sector));
+  if (cnt - 1 > UINT16_MAX)
+    cnt = UINT16_MAX + 1;
+  if (free_map_refs(sector) == cnt)
+    return true;
+  if (refs == NULL && !free_map_create_refs())
+    return false;
+  refs[sector] = cnt - 1;
+  free_map_write_refs(sector);
+  return true;
+}
+
+/* Reports how many sectors are shared, and how many sectors sharing
+   them saves (the references beyond the first). */
+void free_map_shared(size_t *shared, size_t *saved) {
+  size_t i;
+
+  *shared = *saved = 0;
+  for (i = 0; refs != NULL && i < bitmap_size(free_map); i++)
+    if (refs[i] > 0) {
+      (*shared)++;
+      *saved += refs[i];
+    }
+}
+
+/* Returns the sector of the reference count file's inode, or 0 if
+   there is none. */
+block_sector_t free_map_refs_sector(void) {
+  return refs_inode != NULL ? inode_get_inumber(refs_inode) : 0;
+}
+
+/* Starts a batch of allocations.  Until the matching
+   free_map_end_batch(), allocations and releases only update the
+   in-memory bitmap instead of each writing the free map file. */
+void free_map_begin_batch(void) { batch_depth++; }
+
+/* Ends a batch, writing the free map file once if this was the
+   outermost batch. */
+void free_map_end_batch(void) {
+  ASSERT(batch_depth > 0);
+  if (--batch_depth == 0 && free_map_file != NULL)
+    bitmap_write(free_map, free_map_file);
+}
+
+/* Called by the journal when a transaction ends: the sectors it
+   freed join those of the transactions ended before it. */
+void free_map_end_txn(void) {
+  pthread_mutex_lock(&pending_lock);
+  freed_ended = freed_cnt;
+  pthread_mutex_unlock(&pending_lock);
+}
+
+/* Called by the journal after a commit: makes the sectors freed by
+   the transactions that have ended, or if ALL, by any transaction so
+   far, available for reuse. */
+void free_map_committed(bool all) {
+  size_t n, i;
+
+  pthread_mutex_lock(&pending_lock);
+  n = all ? freed_cnt : freed_ended;
+  for (i = 0; i < n; i++)
+    bitmap_reset(pending, freed[i]);
+  memmove(freed, freed + n, (freed_cnt - n) * sizeof *freed);
+  freed_cnt -= n;
+  freed_ended = 0;
+  pthread_mutex_unlock(&pending_lock);
 }
 
 /* Opens the free map file and reads it from disk. */
@@ -54,10 +304,32 @@ void free_map_open(void) {
     PANIC("can't open free map");
   if (!bitmap_read(free_map, free_map_file))
     PANIC("can't read free map");
+
+  free_map_close_refs();
+  if (super_get()->refcount_sector != 0) {
+    size_t size = bitmap_size(free_map) * sizeof *refs;
+    refs_inode = inode_open(super_get()->refcount_sector);
+    refs = calloc(bitmap_size(free_map), sizeof *refs);
+    if (refs_inode == NULL || refs == NULL ||
+        inode_read_at(refs_inode, refs, size, 0) != (offset_t)size)
+      PANIC("can't read reference counts");
+  }
+}
+
+/* Forgets the reference counts of the file system that was
+   mounted. */
+static void free_map_close_refs(void) {
+  inode_close(refs_inode);
+  refs_inode = NULL;
+  free(refs);
+  refs = NULL;
 }
 
 /* Writes the free map to disk and closes the free map file. */
-void free_map_close(void) { file_close(free_map_file); }
+void free_map_close(void) {
+  free_map_close_refs();
+  file_close(free_map_file);
+}
 
 /* Creates a new free map file on disk and writes the free map to
    it. */
@@ -14,7 +14,18 @@ void free_map_open(void);
 void free_map_close(void);
 
 bool free_map_allocate(size_t, block_sector_t *);
+bool free_map_allocate_at(block_sector_t, size_t);
 void free_map_release(block_sector_t, size_t);
+void free_map_begin_batch(void);
+void free_map_end_batch(void);
+void free_map_end_txn(void);
+void free_map_committed(bool all);
+
+bool free_map_ref(block_sector_t);
+unsigned free_map_refs(block_sector_t);
+bool free_map_set_refs(block_sector_t, unsigned);
+void free_map_shared(size_t *shared, size_t *saved);
+block_sector_t free_map_refs_sector(void);
 
 int num_free_sectors(void);
 
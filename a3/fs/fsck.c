@@ -0,0 +1,457 @@
+#include "fsck.h"
+#include "bitmap.h"
+#include "cache.h"
+#include "checksum.h"
+#include "debug.h"
+#include "defrag.h"
+#include "directory.h"
+#include "filesys.h"
+#include "free-map.h"
+#include "inode.h"
+#include "journal.h"
+#include "super.h"
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+/* Most checking threads, and inodes handed to a thread at a time.
+   A batch whose inodes lie within FSCK_SPAN_SECTORS of each other is
+   read from the device in a single request. */
+#define FSCK_MAX_THREADS 8
+#define FSCK_BATCH 32
+#define FSCK_SPAN_SECTORS 128
+
+/* Most data sectors an inode can address. */
+#define FSCK_MAX_SECTORS                                                       \
+  (DIRECT_BLOCKS_COUNT + INDIRECT_BLOCKS_PER_SECTOR +                          \
+   INDIRECT_BLOCKS_PER_SECTOR * INDIRECT_BLOCKS_PER_SECTOR)
+
+/* A check in progress.
+
+   The directory walk, which is serial, collects every inode reachable
+   from the root.  Threads then walk the block maps of those inodes,
+   counting the claims on each sector in REFS with atomic adds, so that
+   no lock is taken per sector. */
+struct fsck_state {
+  block_sector_t size;     /* Sectors covered by the free map. */
+  uint32_t *refs;          /* Claims on each sector. */
+  uint8_t *meta;           /* Claimed as metadata (see fsck_claim)? */
+  struct bitmap *seen;     /* Inodes already collected. */
+  block_sector_t *inodes;  /* Inodes to check. */
+  size_t inode_cnt, inode_cap;
+  size_t next;             /* First inode of the next batch. */
+  size_t bad_inodes;       /* Updated atomically by the threads. */
+  size_t bad_pointers;
+};
+
+static inline size_t min(size_t a, size_t b) { return a < b ? a : b; }
+
+/* Records a claim on SECTOR, as metadata if META: an inode, an
+   indirect block, or the data of a directory or system file, which
+   is written in place and so must never be shared.  Returns false,
+   recording nothing, if SECTOR lies outside the data area. */
+static bool fsck_claim(struct fsck_state *st, block_sector_t sector,
+                       bool meta) {
+  if (sector <= ROOT_DIR_SECTOR || sector >= st->size) {
+    __atomic_add_fetch(&st->bad_pointers, 1, __ATOMIC_RELAXED);
+    return false;
+  }
+  __atomic_add_fetch(&st->refs[sector], 1, __ATOMIC_RELAXED);
+  if (meta)
+    __atomic_store_n(&st->meta[sector], 1, __ATOMIC_RELAXED);
+  return true;
+}
+
+/* Records a claim on data sector SECTOR, as metadata if META.
+   Unused slots of the clusters of a compressed (SPARSE) inode are
+   0. */
+static void fsck_claim_data(struct fsck_state *st, block_sector_t sector,
+                            bool sparse, bool meta) {
+  if (sector != 0 || !sparse)
+    fsck_claim(st, sector, meta);
+}
+
+/* Returns true if D is an inode whose block map can be walked. */
+static bool fsck_inode_ok(const struct inode_disk *d) {
+  return d->magic == INODE_MAGIC && d->length >= 0 &&
+         bytes_to_sectors(d->length) <= FSCK_MAX_SECTORS;
+}
+
+/* Claims the data and indirect blocks of the inode D at SECTOR. */
+static void fsck_check_inode(struct fsck_state *st, block_sector_t sector,
+                             const struct inode_disk *d) {
+  block_sector_t blocks[INDIRECT_BLOCKS_PER_SECTOR];
+  block_sector_t blocks2[INDIRECT_BLOCKS_PER_SECTOR];
+  size_t num_sectors, i, j, l;
+  bool sparse, meta;
+
+  if (!fsck_inode_ok(d)) {
+    __atomic_add_fetch(&st->bad_inodes, 1, __ATOMIC_RELAXED);
+    return;
+  }
+  num_sectors = bytes_to_sectors(d->length);
+  sparse = d->flags & INODE_COMPRESSED;
+  meta = inode_disk_journaled(sector, d);
+
+  // (1) direct blocks
+  l = min(num_sectors, DIRECT_BLOCKS_COUNT);
+  for (i = 0; i < l; i++)
+    fsck_claim_data(st, d->direct_blocks[i], sparse, meta);
+  num_sectors -= l;
+  if (num_sectors == 0)
+    return;
+
+  // (2) a single indirect block
+  l = min(num_sectors, INDIRECT_BLOCKS_PER_SECTOR);
+  if (fsck_claim(st, d->indirect_block, true)) {
+    buffer_cache_read_nofill(d->indirect_block, blocks);
+    for (i = 0; i < l; i++)
+      fsck_claim_data(st, blocks[i], sparse, meta);
+  }
+  num_sectors -= l;
+  if (num_sectors == 0)
+    return;
+
+  // (3) a single doubly indirect block
+  if (!fsck_claim(st, d->doubly_indirect_block, true))
+    return;
+  buffer_cache_read_nofill(d->doubly_indirect_block, blocks);
+  for (i = 0; num_sectors > 0; i++) {
+    l = min(num_sectors, INDIRECT_BLOCKS_PER_SECTOR);
+    if (fsck_claim(st, blocks[i], true)) {
+      buffer_cache_read_nofill(blocks[i], blocks2);
+      for (j = 0; j < l; j++)
+        fsck_claim_data(st, blocks2[j], sparse, meta);
+    }
+    num_sectors -= l;
+  }
+}
+
+/* Checks batches of inodes until there are none left. */
+static void *fsck_worker(void *st_) {
+  struct fsck_state *st = st_;
+  uint8_t *span = malloc(FSCK_SPAN_SECTORS * BLOCK_SECTOR_SIZE);
+  struct inode_disk d;
+
+  for (;;) {
+    size_t first = __atomic_fetch_add(&st->next, FSCK_BATCH,
+                                      __ATOMIC_RELAXED);
+    size_t cnt, i;
+    block_sector_t lo, hi;
+    bool whole;
+
+    if (first >= st->inode_cnt)
+      break;
+    cnt = min(FSCK_BATCH, st->inode_cnt - first);
+    lo = st->inodes[first];
+    hi = st->inodes[first + cnt - 1];
+    whole = span != NULL && hi - lo < FSCK_SPAN_SECTORS;
+    if (whole)
+      block_read_run(fs_device, lo, hi - lo + 1, span);
+    for (i = 0; i < cnt; i++) {
+      block_sector_t sector = st->inodes[first + i];
+      if (whole)
+        memcpy(&d, span + (sector - lo) * BLOCK_SECTOR_SIZE, sizeof d);
+      else
+        buffer_cache_read_nofill(sector, &d);
+      fsck_check_inode(st, sector, &d);
+    }
+  }
+  free(span);
+  return NULL;
+}
+
+/* Adds the inode at SECTOR to those to check and claims its sector.
+   Returns true if it had not been collected before; a second name
+   for the same inode only counts as a second claim. */
+static bool fsck_add_inode(struct fsck_state *st, block_sector_t sector) {
+  if (sector != FREE_MAP_SECTOR && sector != ROOT_DIR_SECTOR) {
+    if (!fsck_claim(st, sector, true))
+      return false;
+  } else {
+    st->refs[sector]++;
+    st->meta[sector] = 1;
+  }
+  if (bitmap_test(st->seen, sector))
+    return false;
+  bitmap_mark(st->seen, sector);
+
+  if (st->inode_cnt == st->inode_cap) {
+    size_t new_cap = st->inode_cap * 2 + 64;
+    block_sector_t *grown =
+        realloc(st->inodes, new_cap * sizeof *st->inodes);
+    if (grown == NULL)
+      return false;
+    st->inodes = grown;
+    st->inode_cap = new_cap;
+  }
+  st->inodes[st->inode_cnt++] = sector;
+  return true;
+}
+
+/* Collects every inode reachable from the root directory or the
+   directory of snapshots, plus the system files and open but removed
+   files.  Returns false if memory
+   runs out. */
+static bool fsck_collect(struct fsck_state *st, struct fsck_report *r) {
+  block_sector_t *queue = NULL, *orphans;
+  size_t head = 0, tail = 0, cap = 0, orphan_cnt, i;
+  struct dir_entry_plus ents[DIR_PLUS_BATCH];
+  struct checksum_stats cs;
+  struct journal_stats js;
+  bool ok = true;
+
+  // system files and sectors
+  fsck_add_inode(st, FREE_MAP_SECTOR);
+  if (super_location() != 0) {
+    fsck_claim(st, super_location(), true);
+    journal_stats(&js);
+    for (i = 0; i < js.size; i++)
+      fsck_claim(st, js.start + i, true);
+    checksum_stats(&cs);
+    for (i = 0; i < cs.sectors; i++)
+      fsck_claim(st, cs.start + i, true);
+    if (super_get()->index_sector != 0 &&
+        fsck_add_inode(st, super_get()->index_sector))
+      r->files++;
+    if (super_get()->refcount_sector != 0 &&
+        fsck_add_inode(st, super_get()->refcount_sector))
+      r->files++;
+  }
+  orphan_cnt = inode_removed_open(&orphans);
+  for (i = 0; i < orphan_cnt; i++)
+    if (fsck_add_inode(st, orphans[i]))
+      r->files++;
+  free(orphans);
+
+  // the directory tree, breadth first
+  if (!fsck_add_inode(st, ROOT_DIR_SECTOR))
+    return false;
+  r->dirs++;
+  queue = malloc(2 * sizeof *queue);
+  if (queue == NULL)
+    return false;
+  queue[tail++] = ROOT_DIR_SECTOR;
+  cap = 2;
+  // snapshots hang off the superblock, not the root
+  if (super_get()->snapshot_sector != 0 &&
+      fsck_add_inode(st, super_get()->snapshot_sector)) {
+    r->dirs++;
+    queue[tail++] = super_get()->snapshot_sector;
+  }
+  while (ok && head < tail) {
+    struct dir *dir = dir_open(inode_open(queue[head++]));
+    size_t n;
+
+    if (dir == NULL)
+      continue;
+    while (ok && (n = dir_readdir_plus(dir, ents, DIR_PLUS_BATCH, false)) > 0)
+      for (i = 0; i < n; i++) {
+        if (!fsck_add_inode(st, ents[i].inode_sector))
+          continue;
+        if (!ents[i].is_dir) {
+          r->files++;
+          continue;
+        }
+        r->dirs++;
+        if (tail == cap) {
+          block_sector_t *grown = realloc(queue, cap * 2 * sizeof *queue);
+          if (grown == NULL) {
+            ok = false;
+            break;
+          }
+          queue = grown;
+          cap *= 2;
+        }
+        queue[tail++] = ents[i].inode_sector;
+      }
+    dir_close(dir);
+  }
+  free(queue);
+  return ok;
+}
+
+static int fsck_by_sector(const void *a_, const void *b_) {
+  block_sector_t a = *(const block_sector_t *)a_;
+  block_sector_t b = *(const block_sector_t *)b_;
+  return a < b ? -1 : a > b;
+}
+
+/* Walks the block maps of all collected inodes across threads. */
+static void fsck_check_inodes(struct fsck_state *st) {
+  pthread_t threads[FSCK_MAX_THREADS];
+  bool started[FSCK_MAX_THREADS];
+  long ncpu = sysconf(_SC_NPROCESSORS_ONLN);
+  size_t nthreads = ncpu < 1 ? 1 : min(ncpu, FSCK_MAX_THREADS);
+  size_t i;
+
+  // sector order lets a batch be read as one run
+  qsort(st->inodes, st->inode_cnt, sizeof *st->inodes, fsck_by_sector);
+  for (i = 1; i < nthreads; i++)
+    started[i] = pthread_create(&threads[i], NULL, fsck_worker, st) == 0;
+  fsck_worker(st);
+  for (i = 1; i < nthreads; i++)
+    if (started[i])
+      pthread_join(threads[i], NULL);
+}
+
+/* Gives every inode but the first its own copy of each data sector
+   it shares with another without the free map counting the sharing
+   (see dedup.c).  Metadata keeps its sectors; only the data of
+   regular files is copied.  Must run after the free map has been
+   repaired. */
+static void fsck_split_shared(struct fsck_state *st, struct fsck_report *r) {
+  struct bitmap *kept = bitmap_create(st->size);
+  size_t i, j;
+
+  if (kept == NULL)
+    return;
+  for (i = 0; i < st->size; i++)
+    if (st->meta[i])
+      bitmap_mark(kept, i);
+
+  for (i = 0; i < st->inode_cnt; i++) {
+    struct inode_disk d;
+    struct inode *inode = NULL;
+    block_sector_t *sectors;
+    size_t cnt;
+
+    inode_read_disk(st->inodes[i], &d);
+    if (!fsck_inode_ok(&d) || inode_disk_journaled(st->inodes[i], &d) ||
+        (sectors = inode_disk_data_sectors(&d)) == NULL)
+      continue;
+    cnt = bytes_to_sectors(d.length);
+    for (j = 0; j < cnt; j++) {
+      block_sector_t old = sectors[j], copy;
+      if (old <= ROOT_DIR_SECTOR || old >= st->size || st->refs[old] < 2 ||
+          (!st->meta[old] && free_map_refs(old) >= st->refs[old]))
+        continue;
+      if (!bitmap_test(kept, old)) {
+        bitmap_mark(kept, old);
+        continue;
+      }
+      if (inode == NULL)
+        inode = inode_open(st->inodes[i]);
+      // the move releases OLD, which its other owners still use
+      if (inode == NULL || !free_map_allocate(1, &copy))
+        break;
+      if (!inode_relocate(inode, j, 1, &copy)) {
+        free_map_release(copy, 1);
+        break;
+      }
+      free_map_allocate_at(old, 1);
+      if (--st->refs[old] == 1)
+        r->repaired++;
+    }
+    inode_close(inode);
+    free(sectors);
+  }
+  bitmap_destroy(kept);
+}
+
+/* Checks the file system for consistency: walks every directory and
+   inode, rebuilds the free map they imply, and compares it with the
+   real one.  Sectors that are claimed twice without being recorded as
+   shared, or claimed twice at all if one claim is metadata, shared
+   more or less often than recorded, claimed but marked
+   free (unmarked), or marked used but claimed by nothing (leaked) are
+   counted in *R.  If REPAIR, the free map and reference counts are
+   corrected, and data sectors shared without a record are copied so
+   that each file has its own.  Must be
+   called with the file system lock held.  Returns false if memory
+   runs out. */
+bool fsck_run(bool repair, struct fsck_report *r) {
+  struct fsck_state st;
+  struct defrag_bg_status bg;
+  block_sector_t s;
+  bool ok;
+
+  memset(r, 0, sizeof *r);
+  memset(&st, 0, sizeof st);
+  st.size = bitmap_size(free_map);
+  st.refs = calloc(st.size, sizeof *st.refs);
+  st.meta = calloc(st.size, sizeof *st.meta);
+  st.seen = bitmap_create(st.size);
+  ok = st.refs != NULL && st.meta != NULL && st.seen != NULL;
+
+  // what the cache holds must be on the device before reading it raw
+  buffer_cache_sync();
+  if (ok)
+    ok = fsck_collect(&st, r);
+  if (ok) {
+    fsck_check_inodes(&st);
+
+    // the run background compaction is filling is in use, too
+    defrag_bg_status(&bg);
+    if (bg.current != 0)
+      for (s = bg.target + bg.current_done;
+           s < bg.target + bg.current_cnt && s < st.size; s++) {
+        st.refs[s]++;
+        st.meta[s] = 1;
+      }
+
+    r->bad_inodes = st.bad_inodes;
+    r->bad_pointers = st.bad_pointers;
+    if (repair)
+      free_map_begin_batch();
+    for (s = 0; s < st.size; s++) {
+      bool used = bitmap_test(free_map, s);
+      unsigned recorded = free_map_refs(s);
+      if (st.refs[s] > 1 && (st.meta[s] || recorded < 2))
+        r->double_allocated++;
+      else if (used && st.refs[s] > 0 && st.refs[s] != recorded) {
+        r->bad_refcounts++;
+        if (repair && free_map_set_refs(s, st.refs[s]))
+          r->repaired++;
+      }
+      if (st.refs[s] == 0 && used) {
+        r->leaked++;
+        if (repair && free_map_set_refs(s, 1)) {
+          free_map_release(s, 1);
+          r->repaired++;
+        }
+      } else if (st.refs[s] > 0 && !used) {
+        r->unmarked++;
+        if (repair && free_map_allocate_at(s, 1))
+          r->repaired++;
+      }
+    }
+    if (repair) {
+      free_map_end_batch();
+      fsck_split_shared(&st, r);
+    }
+  }
+
+  free(st.refs);
+  free(st.meta);
+  if (st.seen != NULL)
+    bitmap_destroy(st.seen);
+  free(st.inodes);
+  return ok;
+}
+
+/* Prints report R of a check that repaired if REPAIR.  Returns 0 if
+   the file system was clean, 1 if every problem was repaired and 4 if
+   problems remain, as fsck(8) does. */
+int fsck_print(const struct fsck_report *r, bool repair) {
+  size_t problems = r->bad_inodes + r->bad_pointers + r->double_allocated +
+                    r->leaked + r->unmarked + r->bad_refcounts;
+
+  printf("Checked %zu directories and %zu files\n", r->dirs, r->files);
+  printf("Bad inodes: %zu, bad block pointers: %zu\n", r->bad_inodes,
+         r->bad_pointers);
+  printf("Double-allocated sectors: %zu\n", r->double_allocated);
+  printf("Leaked sectors: %zu\n", r->leaked);
+  printf("Unmarked sectors: %zu\n", r->unmarked);
+  printf("Bad reference counts: %zu\n", r->bad_refcounts);
+  if (problems == 0) {
+    printf("File system is clean\n");
+    return 0;
+  }
+  if (repair)
+    printf("Repaired %zu of %zu problems\n", r->repaired, problems);
+  return r->repaired == problems ? 1 : 4;
+}
@@ -0,0 +1,23 @@
+#ifndef FILESYS_FSCK_H
+#define FILESYS_FSCK_H
+
+#include <stdbool.h>
+#include <stddef.h>
+
+/* Findings of a consistency check. */
+struct fsck_report {
+  size_t dirs;             /* Directories reached from the root. */
+  size_t files;            /* Other inodes reached. */
+  size_t bad_inodes;       /* Inodes with a bad magic or length. */
+  size_t bad_pointers;     /* Pointers outside the data area. */
+  size_t double_allocated; /* Sectors claimed more than once. */
+  size_t leaked;           /* Marked used but claimed by nothing. */
+  size_t unmarked;         /* Claimed but marked free. */
+  size_t bad_refcounts;    /* Shared, but not as often as recorded. */
+  size_t repaired;         /* Of the above, fixed by the repair. */
+};
+
+bool fsck_run(bool repair, struct fsck_report *);
+int fsck_print(const struct fsck_report *, bool repair);
+
+#endif /* fs/fsck.h */
@@ -11,22 +11,49 @@
 #include <stdlib.h>
 #include <string.h>
 
-/* List files in the root directory. */
-int fsutil_ls(char *argv UNUSED) {
+/* Lists the files in directory PATH, or in the current directory if
+   PATH is null.  Subdirectories are listed with a trailing '/'. */
+int fsutil_ls(char *path) {
   struct dir *dir;
-  char name[NAME_MAX + 1];
+  struct dir_entry_plus ents[DIR_PLUS_BATCH];
+  size_t i, n;
 
-  printf("Files in the root directory:\n");
-  dir = dir_open_root();
+  if (path != NULL)
+    dir = dir_open_path(path);
+  else
+    dir = cwd != NULL ? dir_reopen(cwd) : dir_open_root();
   if (dir == NULL)
     return 1;
-  while (dir_readdir(dir, name))
-    printf("%s\n", name);
+  if (inode_get_inumber(dir_get_inode(dir)) == ROOT_DIR_SECTOR)
+    printf("Files in the root directory:\n");
+  else if (path != NULL)
+    printf("Files in directory %s:\n", path);
+  else
+    printf("Files in the current directory:\n");
+  while ((n = dir_readdir_plus(dir, ents, DIR_PLUS_BATCH, false)) > 0)
+    for (i = 0; i < n; i++)
+      printf("%s%s\n", ents[i].name, ents[i].is_dir ? "/" : "");
   dir_close(dir);
   printf("End of listing.\n");
   return 0;
 }
 
+/* Creates directory PATH.  Returns 1 on success, 0 on failure. */
+int fsutil_mkdir(const char *path) {
+  if (strlen(path) == 0 || strlen(path) >= 255) {
+    printf("Error with directory name: %ld\n", strlen(path));
+    return 0;
+  }
+  return filesys_create(path, 0, true);
+}
+
+/* Makes PATH, or the root directory if PATH is null, the current
+   directory.  Returns 1 on success, 0 if there is no such
+   directory. */
+int fsutil_cd(const char *path) {
+  return filesys_chdir(path != NULL ? path : "/");
+}
+
 /* Prints the contents of file ARGV[1] to the system console as
    hex and ASCII. */
 int fsutil_cat(char *file_name) {
@@ -41,8 +68,12 @@ int fsutil_cat(char *file_name) {
       printf("Error\n");
       return -1;
     }
+    if (!add_to_file_table(file_s, file_name)) {
+      file_close(file_s);
+      printf("Error\n");
+      return -1;
+    }
     opened = true;
-    add_to_file_table(file_s, file_name);
   }
 
   offset_t cur_offset = file_s->pos;
@@ -81,39 +112,40 @@ int fsutil_create(const char *fname, unsigned isize) {
   return filesys_create(fname, isize, false); //, true);
 }
 
-int fsutil_write(char *file_name, const void *buffer, unsigned size) {
+/* Returns the open file FILE_NAME, opening it and adding it to the
+   file table first if needed.  Returns NULL if it does not exist. */
+static struct file *fsutil_get_file(char *file_name) {
   struct file *file_s = get_file_by_fname(file_name);
   if (file_s == NULL) {
     file_s = filesys_open(file_name);
-    if (file_s == NULL) {
-      return -1;
+    if (file_s == NULL)
+      return NULL;
+    if (!add_to_file_table(file_s, file_name)) {
+      file_close(file_s);
+      return NULL;
     }
-    add_to_file_table(file_s, file_name);
   }
+  return file_s;
+}
+
+int fsutil_write(char *file_name, const void *buffer, unsigned size) {
+  struct file *file_s = fsutil_get_file(file_name);
+  if (file_s == NULL)
+    return -1;
   return file_write(file_s, buffer, size);
 }
 
 int fsutil_read(char *file_name, void *buffer, unsigned size) {
-  struct file *file_s = get_file_by_fname(file_name);
-  if (file_s == NULL) {
-    file_s = filesys_open(file_name);
-    if (file_s == NULL) {
-      return -1;
-    }
-    add_to_file_table(file_s, file_name);
-  }
+  struct file *file_s = fsutil_get_file(file_name);
+  if (file_s == NULL)
+    return -1;
   return file_read(file_s, buffer, size);
 }
 
 int fsutil_size(char *file_name) {
-  struct file *file_s = get_file_by_fname(file_name);
-  if (file_s == NULL) {
-    file_s = filesys_open(file_name);
-    if (file_s == NULL) {
-      return -1;
-    }
-    add_to_file_table(file_s, file_name);
-  }
+  struct file *file_s = fsutil_get_file(file_name);
+  if (file_s == NULL)
+    return -1;
   offset_t cur_offset = file_s->pos;
   int length = file_length(file_s);
   file_seek(file_s, cur_offset);
@@ -121,14 +153,9 @@ int fsutil_size(char *file_name) {
 }
 
 int fsutil_seek(char *file_name, int offset) {
-  struct file *file_s = get_file_by_fname(file_name);
-  if (file_s == NULL) {
-    file_s = filesys_open(file_name);
-    if (file_s == NULL) {
-      return -1;
-    }
-    add_to_file_table(file_s, file_name);
-  }
+  struct file *file_s = fsutil_get_file(file_name);
+  if (file_s == NULL)
+    return -1;
   file_seek(file_s, offset);
   return 0;
 }
@@ -4,6 +4,8 @@
 int fsutil_ls(char *);
 int fsutil_cat(char *);
 int fsutil_rm(char *);
+int fsutil_mkdir(const char *path);
+int fsutil_cd(const char *path);
 
 int fsutil_create(const char *fname, unsigned isize);
 int fsutil_write(char *file_name, const void *buffer, unsigned size);
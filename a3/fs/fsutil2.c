@@ -1,429 +1,1530 @@
 #include "fsutil2.h"
 #include "bitmap.h"
 #include "cache.h"
+#include "checksum.h"
 #include "debug.h"
+#include "dedup.h"
+#include "defrag.h"
 #include "directory.h"
 #include "file.h"
 #include "filesys.h"
 #include "free-map.h"
+#include "fsck.h"
 #include "fsutil.h"
+#include "index.h"
 #include "inode.h"
+#include "journal.h"
 #include "off_t.h"
 #include "partition.h"
+#include "recover.h"
+#include "search.h"
+#include "snapshot.h"
 #include "../interpreter.h"
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <pthread.h>
 #include <stdio.h>
 #include <stdbool.h>
 #include <stdlib.h>
 #include <string.h>
 #include <stddef.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
 
 
 #define SECTOR_SIZE 512
 #define NUM_SECTORS 2048
 #define RECOVERED_DIR "./recovered_files/"
 
-// structure to hold file data temporarily
-struct file_data {
-    char *content;
-    size_t size;
+extern struct bitmap *free_map;
+
+
+
+/* Host I/O is done in chunks of this size, so copies run in constant
+   memory regardless of the file size. */
+#define COPY_CHUNK_SIZE (64 * 1024)
+#define COPY_CHUNK_CNT 2
+
+/* A bounded pipeline of COPY_CHUNK_CNT buffers between a host reader
+   thread and the thread writing into the file system, so that host
+   reads overlap with file system writes. */
+struct copy_pipe {
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    char *buf[COPY_CHUNK_CNT];
+    size_t len[COPY_CHUNK_CNT];  // valid bytes in buf, once full
+    bool full[COPY_CHUNK_CNT];   // filled by the reader, not yet consumed
+    bool error;                  // host read failed
+    int fd;                      // host file being read
 };
 
-extern struct bitmap *free_map;
+/* Reads up to COPY_CHUNK_SIZE bytes from host file FD into BUF and
+   returns how many were read; fewer means the end of the file.  Sets
+   *ERROR if a read fails. */
+static size_t copy_read_chunk(int fd, char *buf, bool *error) {
+    size_t len = 0;
+    while (len < COPY_CHUNK_SIZE) {
+        ssize_t n = read(fd, buf + len, COPY_CHUNK_SIZE - len);
+        if (n < 0)
+            *error = true;
+        if (n <= 0)
+            break;
+        len += n;
+    }
+    return len;
+}
+
+/* Reader side of a copy_pipe: fills buffers from the host file until
+   a short read marks the end of the file. */
+static void *copy_pipe_reader(void *aux) {
+    struct copy_pipe *p = aux;
+    for (int i = 0;; i = (i + 1) % COPY_CHUNK_CNT) {
+        pthread_mutex_lock(&p->lock);
+        while (p->full[i])
+            pthread_cond_wait(&p->cond, &p->lock);
+        pthread_mutex_unlock(&p->lock);
+
+        bool error = false;
+        size_t len = copy_read_chunk(p->fd, p->buf[i], &error);
+
+        pthread_mutex_lock(&p->lock);
+        p->len[i] = len;
+        p->full[i] = true;
+        p->error |= error;
+        pthread_cond_broadcast(&p->cond);
+        pthread_mutex_unlock(&p->lock);
+        if (len < COPY_CHUNK_SIZE)
+            return NULL;
+    }
+}
 
+/* Returns the seconds elapsed since START. */
+static double elapsed_seconds(const struct timespec *start) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (now.tv_sec - start->tv_sec) + (now.tv_nsec - start->tv_nsec) / 1e9;
+}
 
+/* Prints the throughput of a copy of BYTES bytes that started at START. */
+static void report_throughput(const char *what, off_t bytes,
+                              const struct timespec *start) {
+    double secs = elapsed_seconds(start);
+    double mbps = secs > 0 ? bytes / (1024.0 * 1024.0) / secs : 0;
+    printf("%s %lld bytes in %.3f s (%.2f MB/s)\n", what, (long long)bytes,
+           secs, mbps);
+}
+
+/* Returns the last component of host path PATH, under which copy_in
+   and copy_out keep the file on the image. */
+static const char *host_basename(const char *path) {
+    const char *slash = strrchr(path, '/');
+    return slash != NULL ? slash + 1 : path;
+}
 
+/* Imports host file FNAME, as its last path component in the current
+   directory of the image.  The whole extent is reserved when the
+   file is created, then the content is streamed in fixed-size chunks
+   read by a helper thread while the previous chunk is being written,
+   or by the shell thread itself if the helper cannot be started.
+   Like before, a null terminator is stored after the content.
+   Returns 0, or the error for the shell to report; on an error after
+   the file was created, the file is removed again. */
 int copy_in(char *fname) {
+    const char *name = host_basename(fname);
+    struct timespec start;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+
     // Open the source file for reading
-    FILE *source_file = fopen(fname, "rb");
-    if (source_file == NULL) {
+    int fd = open(fname, O_RDONLY);
+    if (fd < 0) {
         printf("Error: Unable to open file %s for reading\n", fname);
         return handle_error(FILE_DOES_NOT_EXIST);
     }
 
     // Get the size of the source file
-    fseek(source_file, 0, SEEK_END);
-    long file_size = ftell(source_file);
-    fseek(source_file, 0, SEEK_SET);
-
-    // Allocate memory to store the file content
-    char *file_content = (char *)malloc(file_size+1);
-    if (file_content == NULL) {
-        fclose(source_file);
+    struct stat st;
+    if (fstat(fd, &st) != 0) {
+        close(fd);
+        printf("Error: Failed to read file %s\n", fname);
+        return FILE_READ_ERROR;
+    }
+    off_t file_size = st.st_size;
+#ifdef POSIX_FADV_SEQUENTIAL
+    posix_fadvise(fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+#endif
+
+    // Create the file in the shell's hard drive, reserving all of it
+    if (fsutil_create(name, file_size + 1) != 1) {
+        close(fd);
+        printf("Error: Failed to create file %s in the shell's hard drive\n", name);
+        return FILE_CREATION_ERROR;
+    }
+    // A handle of its own, so one the user has open keeps its position
+    struct file *file = filesys_open(name);
+    if (file == NULL) {
+        close(fd);
+        filesys_remove(name);
+        printf("Error: Failed to write content to file %s in the shell's hard drive\n", name);
+        return FILE_WRITE_ERROR;
+    }
+
+    struct copy_pipe p = {.fd = fd};
+    pthread_t reader;
+    bool ok = true;
+    pthread_mutex_init(&p.lock, NULL);
+    pthread_cond_init(&p.cond, NULL);
+    for (int i = 0; i < COPY_CHUNK_CNT; i++) {
+        p.buf[i] = malloc(COPY_CHUNK_SIZE);
+        ok &= p.buf[i] != NULL;
+    }
+    if (!ok) {
+        for (int i = 0; i < COPY_CHUNK_CNT; i++)
+            free(p.buf[i]);
+        close(fd);
+        file_close(file);
+        filesys_remove(name);
         printf("Error: Memory allocation failed\n");
-        return -1;
+        return NO_MEM_SPACE;
+    }
+    bool threaded = pthread_create(&reader, NULL, copy_pipe_reader, &p) == 0;
+
+    // Without a reader thread, read and write one chunk at a time
+    off_t written = 0;
+    for (size_t len = COPY_CHUNK_SIZE; !threaded && len == COPY_CHUNK_SIZE;) {
+        len = copy_read_chunk(fd, p.buf[0], &p.error);
+        if (len > 0 && written + (off_t)len <= file_size &&
+            file_write_at(file, p.buf[0], len, written) != (offset_t)len)
+            ok = false;
+        written += len;
     }
 
-    // Read the content of the source file
-    size_t bytes_read = fread(file_content, 1, file_size, source_file);
-    fclose(source_file);
+    // Write each chunk as soon as the reader hands it over
+    for (int i = 0; threaded; i = (i + 1) % COPY_CHUNK_CNT) {
+        pthread_mutex_lock(&p.lock);
+        while (!p.full[i])
+            pthread_cond_wait(&p.cond, &p.lock);
+        pthread_mutex_unlock(&p.lock);
+
+        size_t len = p.len[i];
+        if (len > 0 && written + (off_t)len <= file_size &&
+            file_write_at(file, p.buf[i], len, written) != (offset_t)len)
+            ok = false;
+        written += len;
+
+        pthread_mutex_lock(&p.lock);
+        p.full[i] = false;
+        pthread_cond_broadcast(&p.cond);
+        pthread_mutex_unlock(&p.lock);
+        if (len < COPY_CHUNK_SIZE)
+            break;
+    }
+    if (threaded)
+        pthread_join(reader, NULL);
+    close(fd);
+    for (int i = 0; i < COPY_CHUNK_CNT; i++)
+        free(p.buf[i]);
+    pthread_cond_destroy(&p.cond);
+    pthread_mutex_destroy(&p.lock);
 
     // Check if the file was read successfully
-    if (bytes_read != file_size) {
-        free(file_content);
+    if (p.error || written != file_size) {
+        file_close(file);
+        filesys_remove(name);
         printf("Error: Failed to read file %s\n", fname);
-        return -1;
+        return FILE_READ_ERROR;
     }
 
-    // Create the file in the shell's hard drive
-    if (fsutil_create(fname, bytes_read+1) != 1) {
-        free(file_content);
-        printf("Error: Failed to create file %s in the shell's hard drive\n", fname);
-        return -1;
-    }
-		
-		file_content[bytes_read] = '\0';
-    // Write the content to the created file
-    if (fsutil_write(fname, file_content, bytes_read+1) == 0) {
-        free(file_content);
-        printf("Error: Failed to write content to file %s in the shell's hard drive\n", fname);
-        return -1;
+    // Write the terminator after the content
+    if (!ok || file_write_at(file, "", 1, file_size) != 1) {
+        file_close(file);
+        filesys_remove(name);
+        printf("Error: Failed to write content to file %s in the shell's hard drive\n", name);
+        return FILE_WRITE_ERROR;
     }
 
-    free(file_content);
+    file_close(file);
+    report_throughput("Copied in", file_size, &start);
     return 0;
 }
 
 
-int copy_out(char *fname) {
-    // Open the file from the shell's hard drive for reading
-    int fd = fsutil_seek(fname, 0);
-    if (fd == -1) {
-        printf("Error: Unable to open file %s from the shell's hard drive\n", fname);
-        return -1;
+/* Writes LEN bytes of BUF to host file descriptor FD, retrying short
+   writes.  Returns true on success. */
+static bool write_fully(int fd, const char *buf, size_t len) {
+    while (len > 0) {
+        ssize_t n = write(fd, buf, len);
+        if (n <= 0)
+            return false;
+        buf += n;
+        len -= n;
     }
+    return true;
+}
 
-    // Get the size of the file
-    int file_size = fsutil_size(fname);
-    if (file_size == -1) {
-        printf("Error: Unable to get size of file %s in the shell's hard drive\n", fname);
-        fsutil_close(fname);
-        return -1;
+/* Exports the file named by the last path component of FNAME, in
+   the current directory of the image, to host path FNAME.  The
+   file's sectors are copied a chunk at a time straight from the
+   device (or the cache, if a sector is there) into one fixed buffer
+   and written out with large writes.
+   A compressed file is read, and decompressed, through its inode.
+   Every byte is exported except the null terminator that copy_in and
+   write store at the end of a file.  Returns 0, or the error for
+   the shell to report. */
+int copy_out(char *fname) {
+    const char *name = host_basename(fname);
+    struct timespec start;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+
+    // Open the file from the shell's hard drive for reading
+    struct file *file = filesys_open(name);
+    if (file == NULL) {
+        printf("Error: Unable to open file %s from the shell's hard drive\n", name);
+        return FILE_READ_ERROR;
     }
 
-    // Allocate memory to store the file content
-    char *file_content = (char *)malloc(file_size);
-    if (file_content == NULL) {
+    // Get the size and the data sectors of the file; a compressed file
+    // is read through its inode instead
+    struct inode *inode = file_get_inode(file);
+    offset_t file_size = inode_length(inode);
+    bool compressed = inode_is_compressed(inode);
+    block_sector_t *sectors = compressed ? NULL : get_inode_data_sectors(inode);
+    char *chunk = malloc(COPY_CHUNK_SIZE);
+    if ((sectors == NULL && !compressed) || chunk == NULL) {
+        free(sectors);
+        free(chunk);
         printf("Error: Memory allocation failed\n");
-        fsutil_close(fname);
-        return -1;
+        file_close(file);
+        return NO_MEM_SPACE;
     }
 
-		
-		int read_len;
-    // Read the content of the file from the shell's hard drive
-    if ((read_len=fsutil_read(fname, file_content, file_size)) < 0) {
-        free(file_content);
-        printf("Error: Failed to read content of file %s from the shell's hard drive\n", fname);
-        fsutil_close(fname);
-        return -1;
-    }
-    
-    
     // Create the file in the current directory of the real hard drive
-    FILE *dest_file = fopen(fname, "wb");
-    if (dest_file == NULL) {
-        free(file_content);
+    int fd = open(fname, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0) {
+        free(sectors);
+        free(chunk);
         printf("Error: Unable to create file %s in the current directory\n", fname);
-        fsutil_close(fname);
-        return -1;
+        file_close(file);
+        return FILE_CREATION_ERROR;
     }
 
-    // Write the content to the created file
-    fwrite(file_content, 1, strlen(file_content), dest_file);
-    fclose(dest_file);
-    free(file_content);
+    // Copy whole chunks of sectors; only the tail of the last is partial
+    const size_t chunk_sectors = COPY_CHUNK_SIZE / BLOCK_SECTOR_SIZE;
+    size_t sector_cnt = bytes_to_sectors(file_size);
+    offset_t exported = 0;
+    bool ok = true;
+    for (size_t i = 0; ok && i < sector_cnt; i += chunk_sectors) {
+        size_t n = sector_cnt - i < chunk_sectors ? sector_cnt - i : chunk_sectors;
+        size_t len = n * BLOCK_SECTOR_SIZE;
+        if (exported + (offset_t)len > file_size)
+            len = file_size - exported;
+        if (compressed)
+            ok = inode_read_at(inode, chunk, len, exported) == (offset_t)len;
+        for (size_t k = 0; !compressed && k < n; k++)
+            buffer_cache_read_nofill(sectors[i + k], chunk + k * BLOCK_SECTOR_SIZE);
+
+        exported += len;
+        if (exported == file_size && len > 0 && chunk[len - 1] == '\0')
+            len--; // drop the terminator
+        ok = ok && write_fully(fd, chunk, len);
+    }
 
-    fsutil_close(fname);
+    if (close(fd) != 0)
+        ok = false;
+    free(sectors);
+    free(chunk);
+    file_close(file);
+    if (!ok) {
+        printf("Error: Failed to write file %s in the current directory\n", fname);
+        return FILE_WRITE_ERROR;
+    }
+    report_throughput("Copied out", file_size, &start);
     return 0;
 }
 
 
-void find_file(char *pattern) {
-    // Open the root directory
-    struct dir *root_dir = dir_open_root();
-    if (root_dir == NULL) {
-        printf("Error: Failed to open root directory\n");
+/* Host reader/writer threads used by copy_in_dir and copy_out_dir,
+   and how many files may be buffered in memory between them and the
+   file system at once. */
+#define COPY_DIR_WORKERS 4
+#define COPY_DIR_IN_FLIGHT 16
+
+/* One file of a whole-directory copy. */
+struct dir_copy_job {
+    char host_path[PATH_MAX];
+    char name[PATH_MAX];  // image path, relative to the current directory
+    block_sector_t inode_sector;
+    off_t size;
+    char *data;       // content, while in flight
+    bool ready;       // data has been read (import) or filled (export)
+    bool skipped;     // not copied, e.g. the file could not be created
+    bool error;
+};
+
+/* Jobs shared between the shell thread and the host I/O workers.
+   Jobs are started in order and at most COPY_DIR_IN_FLIGHT of them
+   hold a buffer at any time, which bounds memory use. */
+struct dir_copy_pool {
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    struct dir_copy_job *jobs;
+    size_t job_cnt;
+    size_t next;      // next job for a worker to take
+    size_t in_flight; // jobs holding a buffer
+};
+
+/* Appends every regular file below host directory PATH to *JOBS,
+   to be imported at the same place below image directory REL ("" for
+   the current directory).  The image directories are created on the
+   way. */
+static void collect_host_files(const char *path, const char *rel,
+                               struct dir_copy_job **jobs, size_t *cnt,
+                               size_t *cap) {
+    DIR *d = opendir(path);
+    if (d == NULL)
         return;
+
+    struct dirent *de;
+    while ((de = readdir(d)) != NULL) {
+        if (!strcmp(de->d_name, ".") || !strcmp(de->d_name, ".."))
+            continue;
+
+        char child[PATH_MAX], child_rel[PATH_MAX];
+        struct stat st;
+        snprintf(child, sizeof child, "%s/%s", path, de->d_name);
+        snprintf(child_rel, sizeof child_rel, *rel != '\0' ? "%s/%s" : "%s%s",
+                 rel, de->d_name);
+        if (stat(child, &st) != 0 || (!S_ISDIR(st.st_mode) && !S_ISREG(st.st_mode)))
+            continue;
+        if (strlen(de->d_name) > NAME_MAX) {
+            printf("Skipping %s: name too long\n", child);
+            continue;
+        }
+        if (S_ISDIR(st.st_mode)) {
+            // an existing directory of that name is merged into
+            struct dir *sub = NULL;
+            if (!filesys_create(child_rel, 0, true) &&
+                (sub = dir_open_path(child_rel)) == NULL) {
+                printf("Error: Failed to create directory %s in the shell's hard drive\n", child_rel);
+                continue;
+            }
+            dir_close(sub);
+            collect_host_files(child, child_rel, jobs, cnt, cap);
+            continue;
+        }
+
+        if (*cnt == *cap) {
+            size_t new_cap = *cap == 0 ? 64 : *cap * 2;
+            struct dir_copy_job *new_jobs =
+                realloc(*jobs, new_cap * sizeof **jobs);
+            if (new_jobs == NULL)
+                break;
+            *jobs = new_jobs;
+            *cap = new_cap;
+        }
+        struct dir_copy_job *job = &(*jobs)[(*cnt)++];
+        memset(job, 0, sizeof *job);
+        snprintf(job->host_path, sizeof job->host_path, "%s", child);
+        snprintf(job->name, sizeof job->name, "%s", child_rel);
+        job->size = st.st_size;
+    }
+    closedir(d);
+}
+
+/* Reads the host file of JOB into a new buffer in JOB->data. */
+static void import_job(struct dir_copy_job *job) {
+    char *data = malloc(job->size + 1);
+    int fd = data != NULL ? open(job->host_path, O_RDONLY) : -1;
+    off_t got = 0;
+    bool error = fd < 0;
+
+    while (!error && got < job->size) {
+        ssize_t n = read(fd, data + got, job->size - got);
+        if (n <= 0)
+            error = true;
+        else
+            got += n;
+    }
+    if (fd >= 0)
+        close(fd);
+    job->data = data;
+    job->error = error;
+}
+
+/* Writes JOB->data out to its host file and frees it. */
+static void export_job(struct dir_copy_job *job) {
+    if (!job->error) {
+        int fd = open(job->host_path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+        job->error = fd < 0 || !write_fully(fd, job->data, job->size);
+        if (fd >= 0 && close(fd) != 0)
+            job->error = true;
+    }
+    free(job->data);
+    job->data = NULL;
+}
+
+/* Import worker: reads the next host files into memory. */
+static void *import_worker(void *aux) {
+    struct dir_copy_pool *pool = aux;
+
+    pthread_mutex_lock(&pool->lock);
+    while (pool->next < pool->job_cnt) {
+        if (pool->in_flight >= COPY_DIR_IN_FLIGHT) {
+            pthread_cond_wait(&pool->cond, &pool->lock);
+            continue;
+        }
+        struct dir_copy_job *job = &pool->jobs[pool->next++];
+        pool->in_flight++;
+        pthread_mutex_unlock(&pool->lock);
+
+        if (!job->skipped)
+            import_job(job);
+
+        pthread_mutex_lock(&pool->lock);
+        job->ready = true;
+        pthread_cond_broadcast(&pool->cond);
     }
+    pthread_mutex_unlock(&pool->lock);
+    return NULL;
+}
 
-    // Iterate through all files in the root directory
-    struct dir_entry e;
-    while (dir_readdir(root_dir, e.name)) {
-        // Open each file
-        struct inode *inode;
-        if (!dir_lookup(root_dir, e.name, &inode))
+/* Export worker: writes filled buffers out to host files. */
+static void *export_worker(void *aux) {
+    struct dir_copy_pool *pool = aux;
+
+    pthread_mutex_lock(&pool->lock);
+    while (pool->next < pool->job_cnt) {
+        struct dir_copy_job *job = &pool->jobs[pool->next];
+        if (!job->ready) {
+            pthread_cond_wait(&pool->cond, &pool->lock);
             continue;
+        }
+        pool->next++;
+        pthread_mutex_unlock(&pool->lock);
+
+        export_job(job);
+
+        pthread_mutex_lock(&pool->lock);
+        pool->in_flight--;
+        pthread_cond_broadcast(&pool->cond);
+    }
+    pthread_mutex_unlock(&pool->lock);
+    return NULL;
+}
+
+/* Starts COPY_DIR_WORKERS threads running WORKER on POOL and returns
+   how many were started. */
+static int start_workers(struct dir_copy_pool *pool, void *(*worker)(void *),
+                         pthread_t *threads) {
+    int n = 0;
+    pthread_mutex_init(&pool->lock, NULL);
+    pthread_cond_init(&pool->cond, NULL);
+    while (n < COPY_DIR_WORKERS &&
+           pthread_create(&threads[n], NULL, worker, pool) == 0)
+        n++;
+    return n;
+}
+
+static void join_workers(struct dir_copy_pool *pool, pthread_t *threads,
+                         int n) {
+    for (int i = 0; i < n; i++)
+        pthread_join(threads[i], NULL);
+    pthread_cond_destroy(&pool->cond);
+    pthread_mutex_destroy(&pool->lock);
+}
 
-        // Check if the file is a regular file
-        if (!inode_is_directory(inode)) {
-            // Open the file
-            struct file *file = file_open(inode);
-            if (file != NULL) {
-                // Read the content of the file
-                char file_content[NUM_SECTORS*SECTOR_SIZE];
-                memset(file_content, 0, sizeof(file_content));
-                file_read_at(file, file_content, inode_length(inode), 0);
-
-                // Check if the pattern exists in the file content
-                if (strstr(file_content, pattern) != NULL) {
-                    printf("%s\n", e.name);
-                }
-
-                // Close the file
-                file_close(file);
+/* Imports every regular file below host directory PATH into the
+   current directory, at the same place relative to it as the file
+   is to PATH.
+
+   All files are created first, in one pass with the free map written
+   back once at the end, so that their space is reserved up front.  Worker threads then read the
+   host files while the shell thread writes each one, in order, as
+   soon as its content is available. */
+int copy_in_dir(char *path) {
+    struct timespec start;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+
+    struct dir_copy_pool pool = {0};
+    size_t cap = 0;
+    collect_host_files(path, "", &pool.jobs, &pool.job_cnt, &cap);
+    if (pool.jobs == NULL) {
+        printf("Error: No files found in %s\n", path);
+        return handle_error(FILE_DOES_NOT_EXIST);
+    }
+
+    // Batch the allocations
+    free_map_begin_batch();
+    for (size_t i = 0; i < pool.job_cnt; i++) {
+        struct dir_copy_job *job = &pool.jobs[i];
+        if (!filesys_create(job->name, job->size + 1, false)) {
+            printf("Error: Failed to create file %s in the shell's hard drive\n", job->name);
+            job->skipped = true;
+        }
+    }
+    free_map_end_batch();
+
+    pthread_t threads[COPY_DIR_WORKERS];
+    int nthreads = start_workers(&pool, import_worker, threads);
+
+    off_t total = 0;
+    size_t copied = 0;
+    for (size_t i = 0; i < pool.job_cnt; i++) {
+        struct dir_copy_job *job = &pool.jobs[i];
+        if (nthreads == 0) {
+            pool.next++;
+            if (!job->skipped)
+                import_job(job);
+        } else {
+            pthread_mutex_lock(&pool.lock);
+            while (!job->ready)
+                pthread_cond_wait(&pool.cond, &pool.lock);
+            pthread_mutex_unlock(&pool.lock);
+        }
+
+        if (job->skipped) {
+            // already reported
+        } else if (!job->error) {
+            struct file *file = filesys_open(job->name);
+            job->data[job->size] = '\0';
+            if (file == NULL ||
+                file_write_at(file, job->data, job->size + 1, 0) != job->size + 1) {
+                printf("Error: Failed to write content to file %s in the shell's hard drive\n", job->name);
+            } else {
+                total += job->size;
+                copied++;
             }
+            file_close(file);
+        } else {
+            printf("Error: Failed to read file %s\n", job->host_path);
+        }
+
+        free(job->data);
+        job->data = NULL;
+        if (nthreads > 0) {
+            // the worker that read it counted it in flight
+            pthread_mutex_lock(&pool.lock);
+            pool.in_flight--;
+            pthread_cond_broadcast(&pool.cond);
+            pthread_mutex_unlock(&pool.lock);
         }
     }
-    
-    
-    // Close the root directory
-    dir_close(root_dir);
-    
+    join_workers(&pool, threads, nthreads);
+    free(pool.jobs);
+
+    printf("%zu files: ", copied);
+    report_throughput("Copied in", total, &start);
+    return copied == pool.job_cnt ? 0 : -1;
 }
 
+/* Appends every regular file below DIR to POOL's jobs, exporting it
+   to the same place below host directory PATH, and its block map
+   (NULL if compressed) to *MAPS.  The host directories are created
+   on the way. */
+static void collect_fs_files(struct dir *dir, const char *path,
+                             struct dir_copy_pool *pool,
+                             block_sector_t ***maps, size_t *cap) {
+    struct dir_entry_plus ents[DIR_PLUS_BATCH];
+    size_t n;
+    while ((n = dir_readdir_plus(dir, ents, DIR_PLUS_BATCH, true)) > 0) {
+        for (size_t i = 0; i < n; i++) {
+            char child[PATH_MAX];
+            snprintf(child, sizeof child, "%s/%s", path, ents[i].name);
+            if (ents[i].is_dir) {
+                struct dir *sub = dir_open(inode_open(ents[i].inode_sector));
+                if (mkdir(child, 0755) != 0 && errno != EEXIST)
+                    printf("Error: Unable to create directory %s\n", child);
+                else if (sub != NULL)
+                    collect_fs_files(sub, child, pool, maps, cap);
+                dir_close(sub);
+                continue;
+            }
+            if (ents[i].blocks == NULL && !ents[i].compressed)
+                continue;
+            if (pool->job_cnt == *cap) {
+                size_t new_cap = *cap == 0 ? 64 : *cap * 2;
+                struct dir_copy_job *new_jobs =
+                    realloc(pool->jobs, new_cap * sizeof *pool->jobs);
+                if (new_jobs != NULL)
+                    pool->jobs = new_jobs;
+                block_sector_t **new_maps =
+                    realloc(*maps, new_cap * sizeof **maps);
+                if (new_maps != NULL)
+                    *maps = new_maps;
+                if (new_jobs == NULL || new_maps == NULL)
+                    continue;
+                *cap = new_cap;
+            }
+            struct dir_copy_job *job = &pool->jobs[pool->job_cnt];
+            memset(job, 0, sizeof *job);
+            snprintf(job->host_path, sizeof job->host_path, "%s", child);
+            strncpy(job->name, ents[i].name, NAME_MAX);
+            job->size = ents[i].length;
+            job->inode_sector = ents[i].inode_sector;
+            (*maps)[pool->job_cnt++] = ents[i].blocks;
+            ents[i].blocks = NULL; // keep it past the release below
+        }
+        dir_readdir_plus_release(ents, n);
+    }
+}
 
-void fragmentation_degree() {
-    int fragmented_files = 0;
-    int fragmentable_files = 0;
+/* Exports every regular file below the current directory into host
+   directory PATH, which is created if needed, at the same place
+   relative to PATH as the file is to the current directory, so that
+   it undoes copy_in_dir.  The shell thread reads
+   the files in directory order while worker threads write them to
+   the host. */
+int copy_out_dir(char *path) {
+    struct timespec start;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+
+    if (mkdir(path, 0755) != 0 && errno != EEXIST) {
+        printf("Error: Unable to create directory %s\n", path);
+        return -1;
+    }
 
-    // Open the root directory
+    // List the files first, with their block maps
+    struct dir_copy_pool pool = {0};
+    size_t cap = 0;
+    struct dir *dir = dir_open_path("");
+    if (dir == NULL) {
+        printf("Error: Failed to open the current directory\n");
+        return -1;
+    }
+    block_sector_t **maps = NULL;
+    collect_fs_files(dir, path, &pool, &maps, &cap);
+    dir_close(dir);
+
+    pthread_t threads[COPY_DIR_WORKERS];
+    int nthreads = start_workers(&pool, export_worker, threads);
+
+    off_t total = 0;
+    for (size_t i = 0; i < pool.job_cnt; i++) {
+        struct dir_copy_job *job = &pool.jobs[i];
+        pthread_mutex_lock(&pool.lock);
+        while (pool.in_flight >= COPY_DIR_IN_FLIGHT)
+            pthread_cond_wait(&pool.cond, &pool.lock);
+        pool.in_flight++;
+        pthread_mutex_unlock(&pool.lock);
+
+        size_t sector_cnt = bytes_to_sectors(job->size);
+        char *data = malloc(sector_cnt * BLOCK_SECTOR_SIZE + 1);
+        bool error = data == NULL;
+        if (!error && maps[i] == NULL) {
+            // a compressed file, which is read through its inode
+            struct inode *inode = inode_open(job->inode_sector);
+            error = inode == NULL ||
+                    inode_read_at(inode, data, job->size, 0) != job->size;
+            inode_close(inode);
+        }
+        for (size_t k = 0; !error && maps[i] != NULL && k < sector_cnt; k++)
+            buffer_cache_read_nofill(maps[i][k], data + k * BLOCK_SECTOR_SIZE);
+        if (!error && job->size > 0 && data[job->size - 1] == '\0')
+            job->size--; // drop the terminator
+        free(maps[i]);
+
+        total += job->size;
+        pthread_mutex_lock(&pool.lock);
+        job->data = data;
+        job->error = error;
+        job->ready = true;
+        pthread_cond_broadcast(&pool.cond);
+        pthread_mutex_unlock(&pool.lock);
+        if (nthreads == 0) {
+            pool.next++;
+            export_job(job);
+            pool.in_flight--;
+        }
+    }
+    join_workers(&pool, threads, nthreads);
+
+    size_t copied = 0;
+    for (size_t i = 0; i < pool.job_cnt; i++) {
+        if (pool.jobs[i].error)
+            printf("Error: Failed to write file %s\n", pool.jobs[i].host_path);
+        else
+            copied++;
+    }
+    free(maps);
+    free(pool.jobs);
+
+    printf("%zu files: ", copied);
+    report_throughput("Copied out", total, &start);
+    return copied == pool.job_cnt ? 0 : -1;
+}
+
+
+/* A file larger than this many sectors is split into ranges that
+   find_file threads search independently; FIND_MAX_THREADS bounds
+   the worker pool. */
+#define FIND_RANGE_SECTORS 256
+#define FIND_MAX_THREADS 16
+
+/* A range of one file searched by a find_file worker. */
+struct find_job {
+    size_t file;          // index into find_pool.files
+    offset_t start, end;  // matches starting here are this job's
+    size_t matches;
+    char *out;            // "-o" lines, in the order found
+    size_t out_len;
+};
+
+/* Files and jobs shared by the find_file workers.  Jobs are claimed
+   in order through NEXT_JOB; results stay with each job so that the
+   shell thread can print them in directory order afterwards. */
+struct find_pool {
+    const struct search *search;
+    enum find_mode mode;
+    struct dir_entry_plus *files;
+    char **paths;         // of FILES, from the root
+    size_t file_cnt, file_cap;
+    bool failed;          // memory ran out while listing FILES
+    bool *found;          // per file, set once any range matched
+    struct find_job *jobs;
+    size_t job_cnt;
+    size_t next_job;
+};
+
+/* Match state of one job. */
+struct find_state {
+    struct find_pool *pool;
+    struct find_job *job;
+    FILE *out;
+};
+
+static bool find_match(size_t pattern, offset_t ofs, void *aux) {
+    struct find_state *fs = aux;
+    struct find_pool *pool = fs->pool;
+
+    fs->job->matches++;
+    if (pool->mode == FIND_OFFSETS)
+        fprintf(fs->out, "%s:%d:%s\n", pool->paths[fs->job->file], ofs,
+                search_pattern(pool->search, pattern));
+    // a name only needs the first match
+    return pool->mode != FIND_NAMES;
+}
+
+static void find_run_job(struct find_pool *pool, struct find_job *job) {
+    struct dir_entry_plus *ent = &pool->files[job->file];
+    struct find_state fs = {pool, job, NULL};
+
+    // another range of this file already matched
+    if (pool->mode == FIND_NAMES &&
+        __atomic_load_n(&pool->found[job->file], __ATOMIC_RELAXED))
+        return;
+
+    if (pool->mode == FIND_OFFSETS) {
+        fs.out = open_memstream(&job->out, &job->out_len);
+        if (fs.out == NULL)
+            return;
+    }
+    if (ent->compressed) {
+        struct inode *inode = inode_open(ent->inode_sector);
+        if (inode != NULL)
+            search_range_inode(pool->search, inode, job->start, job->end,
+                               find_match, &fs);
+        inode_close(inode);
+    } else
+        search_range(pool->search, ent->blocks, ent->length, job->start,
+                     job->end, find_match, &fs);
+    if (fs.out != NULL)
+        fclose(fs.out);
+    if (job->matches > 0)
+        __atomic_store_n(&pool->found[job->file], true, __ATOMIC_RELAXED);
+}
+
+static void *find_worker(void *pool_) {
+    struct find_pool *pool = pool_;
+    size_t i;
+
+    while ((i = __atomic_fetch_add(&pool->next_job, 1, __ATOMIC_RELAXED)) <
+           pool->job_cnt)
+        find_run_job(pool, &pool->jobs[i]);
+    return NULL;
+}
+
+/* Runs every job of POOL on NTHREADS threads, the calling thread
+   being one of them. */
+static void find_run_pool(struct find_pool *pool, int nthreads) {
+    pthread_t threads[FIND_MAX_THREADS];
+    int n = 0;
+
+    for (size_t i = 0; i < pool->job_cnt; i++) {
+        free(pool->jobs[i].out);
+        pool->jobs[i].out = NULL;
+        pool->jobs[i].out_len = 0;
+        pool->jobs[i].matches = 0;
+    }
+    memset(pool->found, 0, pool->file_cnt * sizeof *pool->found);
+    pool->next_job = 0;
+
+    while (n < nthreads - 1 &&
+           pthread_create(&threads[n], NULL, find_worker, pool) == 0)
+        n++;
+    find_worker(pool);
+    for (int i = 0; i < n; i++)
+        pthread_join(threads[i], NULL);
+}
+
+/* Adds file ENT, at PATH, to POOL if it could be mapped and, if
+   there is a content index, that cannot rule it out. */
+static void find_add_file(const char *path, struct dir_entry_plus *ent,
+                          void *pool_) {
+    struct find_pool *pool = pool_;
+    if (ent->is_dir ||
+        (ent->blocks == NULL && ent->length > 0 && !ent->compressed) ||
+        !index_may_match(pool->search, ent->inode_sector, ent->blocks,
+                         ent->length))
+        return;
+
+    if (pool->file_cnt == pool->file_cap) {
+        size_t cap = pool->file_cap * 2 + DIR_PLUS_BATCH;
+        struct dir_entry_plus *files =
+            realloc(pool->files, cap * sizeof *files);
+        if (files != NULL)
+            pool->files = files;
+        char **paths = realloc(pool->paths, cap * sizeof *paths);
+        if (paths != NULL)
+            pool->paths = paths;
+        if (files == NULL || paths == NULL) {
+            pool->failed = true;
+            return;
+        }
+        pool->file_cap = cap;
+    }
+    char *copy = strdup(path);
+    if (copy == NULL) {
+        pool->failed = true;
+        return;
+    }
+    pool->paths[pool->file_cnt] = copy;
+    pool->files[pool->file_cnt++] = *ent;
+    ent->blocks = NULL; // now owned by the pool
+}
+
+/* Reads the regular files of the directory tree, with their block
+   maps, and splits them into jobs.  Returns false on failure. */
+static bool find_build_pool(struct find_pool *pool) {
     struct dir *root_dir = dir_open_root();
     if (root_dir == NULL) {
         printf("Error: Failed to open root directory\n");
+        return false;
+    }
+
+    size_t job_cap = 0;
+    bool ok = dir_walk(root_dir, true, find_add_file, pool) && !pool->failed;
+    dir_close(root_dir);
+    if (!ok)
+        return false;
+
+    pool->found = calloc(pool->file_cnt + 1, sizeof *pool->found);
+    if (pool->found == NULL)
+        return false;
+    for (size_t f = 0; f < pool->file_cnt; f++) {
+        offset_t length = pool->files[f].length;
+        offset_t range = FIND_RANGE_SECTORS * BLOCK_SECTOR_SIZE;
+        offset_t start = 0;
+        do {
+            if (pool->job_cnt == job_cap) {
+                struct find_job *jobs;
+                job_cap = job_cap * 2 + 64;
+                jobs = realloc(pool->jobs, job_cap * sizeof *jobs);
+                if (jobs == NULL)
+                    return false;
+                pool->jobs = jobs;
+            }
+            struct find_job *job = &pool->jobs[pool->job_cnt++];
+            memset(job, 0, sizeof *job);
+            job->file = f;
+            job->start = start;
+            job->end = length - start > range ? start + range : length;
+            start = job->end;
+        } while (start < length);
+    }
+    return true;
+}
+
+static void find_free_pool(struct find_pool *pool) {
+    for (size_t i = 0; i < pool->job_cnt; i++)
+        free(pool->jobs[i].out);
+    dir_readdir_plus_release(pool->files, pool->file_cnt);
+    for (size_t i = 0; i < pool->file_cnt; i++)
+        free(pool->paths[i]);
+    free(pool->paths);
+    free(pool->files);
+    free(pool->found);
+    free(pool->jobs);
+}
+
+/* Returns the number of find_file threads to use for a request of
+   NTHREADS, where 0 or less means one per online CPU. */
+static int find_thread_cnt(int nthreads) {
+    if (nthreads <= 0)
+        nthreads = sysconf(_SC_NPROCESSORS_ONLN);
+    if (nthreads < 1)
+        nthreads = 1;
+    return nthreads < FIND_MAX_THREADS ? nthreads : FIND_MAX_THREADS;
+}
+
+/* Prints the files in the directory tree that contain any of the
+   CNT PATTERNS: their paths from the root, their match counts, or
+   every match with its offset, depending on MODE.
+
+   Files, and ranges of large files, are searched by NTHREADS threads
+   (one per CPU if 0) straight from their block maps, each streaming
+   its data from the buffer cache a chunk at a time.  The results are
+   printed in directory order regardless of which thread found them.
+   If BENCH is positive, nothing is printed; instead the whole search
+   is timed with 1 up to BENCH threads. */
+void find_file(char *const patterns[], size_t cnt, enum find_mode mode,
+               int nthreads, int bench) {
+    struct search *search = search_compile(patterns, cnt);
+    if (search == NULL) {
+        printf("Error: Failed to compile search patterns\n");
         return;
     }
 
-    // Iterate through all files in the root directory
-    struct dir_entry e;
-    while (dir_readdir(root_dir, e.name)) {
-        // Open each file
-        struct inode *inode;
-        if (!dir_lookup(root_dir, e.name, &inode))
-            continue;
+    struct find_pool pool = {search, mode};
+    if (!find_build_pool(&pool)) {
+        find_free_pool(&pool);
+        search_destroy(search);
+        return;
+    }
 
-        // Check if the file is a regular file and has more than one data block
-        if (!inode_is_directory(inode) && inode->data.length > BLOCK_SECTOR_SIZE) {
-            fragmentable_files++;
-
-            // Check for fragmentation in the file
-            bool fragmented = false;
-            
-            for (int i = 1; i < DIRECT_BLOCKS_COUNT; i++) {
-                if (inode->data.direct_blocks[i] - inode->data.direct_blocks[i-1] > 3 && inode->data.direct_blocks[i] > 0 ) {
-                    fragmented = true;
-                    break;
-                }
-                
+    if (bench > 0) {
+        off_t total = 0;
+        for (size_t f = 0; f < pool.file_cnt; f++)
+            total += pool.files[f].length;
+        for (int t = 1; t <= find_thread_cnt(bench); t++) {
+            struct timespec start;
+            char what[32];
+            clock_gettime(CLOCK_MONOTONIC, &start);
+            find_run_pool(&pool, t);
+            snprintf(what, sizeof what, "%2d threads: searched", t);
+            report_throughput(what, total, &start);
+        }
+    } else {
+        find_run_pool(&pool, find_thread_cnt(nthreads));
+
+        size_t j = 0;
+        for (size_t f = 0; f < pool.file_cnt; f++) {
+            size_t matches = 0;
+            for (; j < pool.job_cnt && pool.jobs[j].file == f; j++) {
+                matches += pool.jobs[j].matches;
+                if (pool.jobs[j].out_len > 0)
+                    fwrite(pool.jobs[j].out, 1, pool.jobs[j].out_len, stdout);
             }
-            
-            if (fragmented)
-                fragmented_files++;
+            if (matches > 0 && mode == FIND_NAMES)
+                printf("%s\n", pool.paths[f]);
+            else if (matches > 0 && mode == FIND_COUNT)
+                printf("%s:%zu\n", pool.paths[f], matches);
         }
     }
 
-    // Close the root directory
-    dir_close(root_dir);
-		
-		printf("Num fragmentable files: %d\n",fragmentable_files);
-		printf("Num fragmented files: %d\n", fragmented_files);
-		
-    // Calculate and print the fragmentation degree
-    if (fragmentable_files > 0) {
-        double fragmentation_degree = (double)fragmented_files / fragmentable_files;
-        printf("Fragmentation pct: %.6f\n", fragmentation_degree);
+    find_free_pool(&pool);
+    search_destroy(search);
+}
+
+
+/* Turns the content index used by find_file on or off, or reports
+   how much of the image it covers. */
+int content_index(char *action) {
+    if (strcmp(action, "on") == 0) {
+        if (!index_enable()) {
+            printf("Error: This file system cannot hold a content index\n");
+            return -1;
+        }
+    } else if (strcmp(action, "off") == 0) {
+        index_disable();
+    } else if (strcmp(action, "status") != 0) {
+        printf("Error: Unknown index action %s\n", action);
+        return -1;
+    }
+
+    if (!index_enabled()) {
+        printf("Content index: off\n");
     } else {
-        printf("No fragmentable files found\n");
+        size_t indexed, stale;
+        index_stats(&indexed, &stale);
+        printf("Content index: on, %zu files indexed, %zu stale\n", indexed,
+               stale);
     }
+    return 0;
 }
 
+/* Reads all of INODE and reports how fast, labelled WHAT. */
+static void compress_read_bench(struct inode *inode, const char *what) {
+    offset_t length = inode_length(inode);
+    char *buf = malloc(length + 1);
+    struct timespec start;
 
-// Helper function to read file content into memory
-struct file_data read_file_content(struct inode *inode) {
-    struct file_data data;
-    data.size = inode_length(inode);
-    data.content = malloc(data.size);
-    if (data.content == NULL) {
-        data.size = 0;
-        return data;
-    }
+    if (buf == NULL)
+        return;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    inode_read_at(inode, buf, length, 0);
+    report_throughput(what, length, &start);
+    free(buf);
+}
 
-    struct file *file = file_open(inode);
+/* Stores file FNAME compressed, or uncompressed again if DECOMPRESS,
+   and reports the sectors it takes and how fast it reads, before and
+   after. */
+int compress(char *fname, bool decompress) {
+    struct file *file = filesys_open(fname);
     if (file == NULL) {
-        data.size = 0;
-        free(data.content);
-        return data;
+        printf("Error: Unable to open file %s from the shell's hard drive\n", fname);
+        return -1;
     }
 
-    file_read_at(file, data.content, data.size, 0);
+    struct inode *inode = file_get_inode(file);
+    size_t before = inode_data_sectors_used(inode);
+    compress_read_bench(inode, "Read before");
+    if (!inode_set_compressed(inode, !decompress)) {
+        printf("Error: Failed to %s file %s\n",
+               decompress ? "decompress" : "compress", fname);
+        file_close(file);
+        return -1;
+    }
+    size_t after = inode_data_sectors_used(inode);
+    compress_read_bench(inode, "Read after");
+    printf("%s: %zu sectors before, %zu after\n", fname, before, after);
     file_close(file);
+    return 0;
+}
 
-    return data;
+/* Controls the metadata journal: "on", "off" or "status".  SIZE,
+   if not null, is the number of sectors for "on" to give the
+   journal instead of sizing it to the disk. */
+int journal(char *action, char *size) {
+    struct journal_stats st;
+    long sectors = 0;
+
+    if (size != NULL) {
+        char *end;
+        sectors = strtol(size, &end, 10);
+        if (strcmp(action, "on") != 0 || *end != '\0' ||
+            sectors < JOURNAL_MIN_SECTORS || sectors > JOURNAL_MAX_SECTORS) {
+            printf("Error: A journal takes %d to %d sectors\n",
+                   JOURNAL_MIN_SECTORS, JOURNAL_MAX_SECTORS);
+            return -1;
+        }
+    }
+    if (strcmp(action, "on") == 0) {
+        if (!journal_enable(sectors)) {
+            printf("Error: This file system cannot hold a journal\n");
+            return -1;
+        }
+    } else if (strcmp(action, "off") == 0) {
+        journal_disable();
+    } else if (strcmp(action, "status") != 0) {
+        printf("Error: Unknown journal action %s\n", action);
+        return -1;
+    }
+
+    journal_stats(&st);
+    if (st.start == 0) {
+        printf("Journal: off\n");
+    } else {
+        printf("Journal: on, %zu sectors at sector %u, %zu per commit\n",
+               st.size, st.start, st.capacity);
+        printf("%zu commits of %zu transactions, %zu sectors logged, "
+               "%zu replayed\n", st.commits, st.txns, st.sectors,
+               st.replayed);
+        if (st.oversized > 0)
+            printf("%zu transactions larger than the journal were "
+                   "committed in parts\n", st.oversized);
+    }
+    return 0;
 }
 
+/* Controls the per-sector checksums: "on", "off" or "status". */
+int checksum(char *action) {
+    struct checksum_stats st;
 
-// Helper function to write file content from memory to disk
-bool write_file_content(struct inode *inode, struct file_data data) {
-    if (inode_length(inode) != data.size) {
-        return false; // Size mismatch, cannot write content
+    if (strcmp(action, "on") == 0) {
+        if (!checksum_enable()) {
+            printf("Error: This file system cannot hold checksums\n");
+            return -1;
+        }
+    } else if (strcmp(action, "off") == 0) {
+        checksum_disable();
+    } else if (strcmp(action, "status") != 0) {
+        printf("Error: Unknown checksum action %s\n", action);
+        return -1;
     }
 
-    struct file *file = file_open(inode);
-    if (file == NULL) {
-        return false; // Unable to open file
+    checksum_stats(&st);
+    if (st.start == 0) {
+        printf("Checksums: off\n");
+    } else {
+        printf("Checksums: on, crc32c (%s), %zu sectors at sector %u\n",
+               crc32c_impl(), st.sectors, st.start);
+        printf("%zu sectors verified, %zu updated, %zu mismatches\n",
+               st.verified, st.updated, st.mismatches);
     }
+    return 0;
+}
 
-    file_write_at(file, data.content, data.size, 0);
-    file_close(file);
+/* Verifies the checksum of every sector of the disk. */
+int scrub() {
+    struct checksum_scrub r;
+    struct timespec start;
+    size_t i;
 
-    return true;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    if (!checksum_scrub(&r)) {
+        printf("Error: Checksums are off\n");
+        return -1;
+    }
+    for (i = 0; i < r.bad && i < sizeof r.first / sizeof *r.first; i++)
+        printf("Checksum mismatch in sector %u\n", r.first[i]);
+    if (r.bad > i)
+        printf("... and %zu more\n", r.bad - i);
+    printf("Scrubbed %zu sectors (%zu read): %zu bad\n", r.scanned, r.read,
+           r.bad);
+    report_throughput("Read", (off_t)r.read * BLOCK_SECTOR_SIZE, &start);
+    return r.bad == 0 ? 0 : -1;
 }
 
-
-int defragment() {
-    // Open the root directory
-    struct dir *root_dir = dir_open_root();
-    if (root_dir == NULL) {
-        printf("Error: Failed to open root directory\n");
+/* Turns deduplication of written data on or off, or reports whether
+   it is on. */
+int dedup(char *action) {
+    if (strcmp(action, "on") == 0) {
+        if (!dedup_enable()) {
+            printf("Error: This file system cannot deduplicate\n");
+            return -1;
+        }
+    } else if (strcmp(action, "off") == 0) {
+        dedup_disable();
+    } else if (strcmp(action, "status") != 0) {
+        printf("Error: Unknown dedup action %s\n", action);
         return -1;
     }
 
-    // Iterate through all files in the root directory
-    struct dir_entry e;
-    while (dir_readdir(root_dir, e.name)) {
-        // Open each file
-        struct inode *inode;
-        if (!dir_lookup(root_dir, e.name, &inode))
-            continue;
+    printf("Dedup: %s\n", dedup_enabled() ? "on" : "off");
+    return 0;
+}
 
-        // Check if the file is a regular file and has more than one data block
-        if (!inode_is_directory(inode) && inode->data.length > BLOCK_SECTOR_SIZE) {
-            // Check for fragmentation in the file
-            bool fragmented = false;
-            for (int i = 1; i < DIRECT_BLOCKS_COUNT; i++) {
-                if (inode->data.direct_blocks[i] - inode->data.direct_blocks[i-1] > 3 && inode->data.direct_blocks[i] > 0 ) {
-                    fragmented = true;
-                    break;
-                }
-            }
+/* Reports how much space sharing data sectors saves. */
+int dedupstat() {
+    struct dedup_stats st;
+
+    dedup_stats(&st);
+    if (st.enabled)
+        printf("Dedup: on, %zu sectors indexed, %zu duplicate writes\n",
+               st.indexed, st.hits);
+    else
+        printf("Dedup: off\n");
+    printf("Shared sectors: %zu, extra references: %zu\n", st.shared,
+           st.saved);
+    printf("Space saved: %zu sectors (%zu bytes)\n", st.saved,
+           st.saved * BLOCK_SECTOR_SIZE);
+    return 0;
+}
 
-            // If fragmented, rearrange the data blocks
-            if (fragmented) {
-                // Allocate memory to hold the content of the fragmented file
-                char *file_content = malloc(inode->data.length);
-                if (file_content == NULL) {
-                    printf("Error: Memory allocation failed\n");
-                    continue;
-                }
+/* Creates the file DST as a copy of SRC that shares its data
+   sectors. */
+int clone_file(char *src, char *dst) {
+    struct timespec start;
+    struct file *file;
 
-                // Read the content of the fragmented file into memory
-                struct file *file = file_open(inode);
-                if (file == NULL) {
-                    printf("Error: Failed to open file\n");
-                    free(file_content);
-                    continue;
-                }
-                file_read_at(file, file_content, inode->data.length, 0);
-                file_close(file);
-
-                // Write the content of the file back to disk, rearranging the blocks
-                block_sector_t next_sector = inode->data.direct_blocks[0];
-                for (int i = 0; i < DIRECT_BLOCKS_COUNT; i++) {
-                    if (i < inode->data.length / BLOCK_SECTOR_SIZE) {
-                        block_write(fs_device, next_sector, file_content + i * BLOCK_SECTOR_SIZE);
-                        inode->data.direct_blocks[i] = next_sector;
-                        next_sector++;
-                    } else {
-                        break;
-                    }
-                }
-
-                // Update the file size in the inode
-                inode->data.length = inode->data.length;
-
-                // Free memory used to hold file content
-                free(file_content);
-            }
-        }
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    if (!filesys_clone(src, dst)) {
+        printf("Error: Failed to clone %s to %s\n", src, dst);
+        return -1;
     }
+    file = filesys_open(dst);
+    if (file != NULL) {
+        struct inode *inode = file_get_inode(file);
+        printf("Cloned %lld bytes, %zu sectors shared, in %.3f s\n",
+               (long long)inode_length(inode), inode_data_sectors_used(inode),
+               elapsed_seconds(&start));
+        file_close(file);
+    }
+    return 0;
+}
 
-    // Close the root directory
-    dir_close(root_dir);
+/* Creates ("create"), deletes ("-d") or restores ("-r") snapshot
+   NAME, or lists the snapshots ("-l"). */
+int snapshot(char *action, char *name) {
+    struct timespec start;
+
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    if (strcmp(action, "-l") == 0) {
+        struct snapshot_info *infos;
+        size_t cnt = snapshot_list(&infos), i;
+
+        for (i = 0; i < cnt; i++)
+            printf("%s: %zu files, %zu sectors\n", infos[i].name,
+                   infos[i].files, infos[i].sectors);
+        if (cnt == 0)
+            printf("No snapshots\n");
+        free(infos);
+        return 0;
+    }
 
-    printf("Defragmentation completed successfully\n");
+    if (strcmp(action, "create") == 0) {
+        if (!snapshot_create(name)) {
+            printf("Error: Failed to create snapshot %s\n", name);
+            return -1;
+        }
+        printf("Created snapshot %s in %.3f s\n", name,
+               elapsed_seconds(&start));
+    } else if (strcmp(action, "-d") == 0) {
+        if (!snapshot_delete(name)) {
+            printf("Error: No snapshot named %s\n", name);
+            return -1;
+        }
+    } else if (strcmp(action, "-r") == 0) {
+        if (!snapshot_restore(name)) {
+            printf("Error: Failed to restore snapshot %s\n", name);
+            return -1;
+        }
+        printf("Restored snapshot %s in %.3f s\n", name,
+               elapsed_seconds(&start));
+    } else {
+        printf("Error: Unknown snapshot action %s\n", action);
+        return -1;
+    }
     return 0;
 }
 
+/* Upper bounds of the extents-per-file histogram buckets printed
+   by fragmentation_degree; the last bucket is open ended. */
+static const size_t extent_buckets[] = {1, 2, 4, 8, 16};
+#define EXTENT_BUCKET_CNT (sizeof extent_buckets / sizeof *extent_buckets + 1)
+
+/* Counts gathered by fragmentation_degree while walking the tree. */
+struct frag_counts {
+    int fragmented_files;
+    int fragmentable_files;
+    size_t files, extents, blocks;
+    size_t histogram[EXTENT_BUCKET_CNT];
+};
 
+/* Adds the complete block map of file EP to the counts in AUX. */
+static void frag_count_file(const char *path UNUSED,
+                            struct dir_entry_plus *ep, void *aux) {
+    struct frag_counts *c = aux;
+    if (ep->is_dir || ep->blocks == NULL || ep->block_cnt == 0)
+        return;
 
+    bool fragmented = false;
+    size_t file_extents = 1;
+    for (size_t i = 1; i < ep->block_cnt; i++) {
+        block_sector_t prev = ep->blocks[i - 1], cur = ep->blocks[i];
+        if (cur > 0 && (cur < prev || cur - prev > 3))
+            fragmented = true;
+        if (cur != prev + 1)
+            file_extents++;
+    }
 
-// Helper function to check if a given sector is free
-bool is_sector_free(block_sector_t sector) {
-    // Check if the sector is within the valid range
-    if (sector >= block_size(fs_device) || sector >= bitmap_size(free_map)) {
-        return false; // Sector out of range
+    // Check if the file has more than one data block
+    if (ep->length > BLOCK_SECTOR_SIZE) {
+        c->fragmentable_files++;
+        if (fragmented)
+            c->fragmented_files++;
     }
-    
-    
-    // Check if the sector is marked as free in the free map
-    return bitmap_test(free_map, sector);
+
+    size_t b = 0;
+    while (b < EXTENT_BUCKET_CNT - 1 && file_extents > extent_buckets[b])
+        b++;
+    c->histogram[b]++;
+    c->files++;
+    c->extents += file_extents;
+    c->blocks += ep->block_cnt;
 }
 
+/* Reports how fragmented the files and the free space are.
 
+   A file of more than one sector counts as fragmented if any
+   sector of its data, anywhere in its block map, lies more than 3
+   sectors past the one before it, or before it at all: reading it
+   then takes a seek backwards.  Holes are not counted.  Beyond that, every file's block map
+   is split into extents (runs of consecutive sectors) and the free
+   map into free runs.  Every file in the directory tree is counted,
+   its block map read once, so the cost is linear in the number of
+   blocks. */
+void fragmentation_degree() {
+    struct frag_counts c = {0};
 
-// Helper function to recover deleted files (flag 0)
-void recover_deleted_files() {
     // Open the root directory
     struct dir *root_dir = dir_open_root();
     if (root_dir == NULL) {
         printf("Error: Failed to open root directory\n");
         return;
     }
-    
-    // Scan all free sectors on the drive
-    for (block_sector_t sector = 0; sector < block_size(fs_device); sector++) {
-    		    
-        if (is_sector_free(sector)) {
-            
-            // Check if the sector contains a deleted inode
-            struct inode *inode = inode_open(sector);
-            if (inode != NULL) {
-           			
-                // Recover the inode
-                char filename[50];
-                snprintf(filename, sizeof(filename), "recovered0-%d", sector);
-                // Create a new file with recovered inode
-                FILE *recovered_file = fopen(filename, "w");
-                if (recovered_file != NULL) {
-                    // Write recovered data to the file
-                    fwrite(inode, sizeof(struct inode), 1, recovered_file);
-                    fclose(recovered_file);
-                    printf("Recovered deleted file: %s\n", filename);
-                } else {
-                    printf("Error: Failed to create recovered file: %s\n", filename);
-                }
-                inode_close(inode);
-            }
+
+    // Walk the complete block map of every file, breadth first
+    dir_walk(root_dir, true, frag_count_file, &c);
+
+    // Close the root directory
+    dir_close(root_dir);
+
+    printf("Num fragmentable files: %d\n", c.fragmentable_files);
+    printf("Num fragmented files: %d\n", c.fragmented_files);
+
+    // Calculate and print the fragmentation degree
+    if (c.fragmentable_files > 0) {
+        double fragmentation_degree = (double)c.fragmented_files / c.fragmentable_files;
+        printf("Fragmentation pct: %.6f\n", fragmentation_degree);
+    } else {
+        printf("No fragmentable files found\n");
+    }
+
+    if (c.files > 0) {
+        printf("Extents: %zu in %zu files, %.2f per file, %.2f sectors each\n",
+               c.extents, c.files, (double)c.extents / c.files,
+               (double)c.blocks / c.extents);
+        printf("Extents per file:");
+        for (size_t b = 0; b < EXTENT_BUCKET_CNT; b++) {
+            size_t lo = b == 0 ? 1 : extent_buckets[b - 1] + 1;
+            if (b == EXTENT_BUCKET_CNT - 1)
+                printf(" %zu+: %zu", lo, c.histogram[b]);
+            else if (lo == extent_buckets[b])
+                printf(" %zu: %zu", lo, c.histogram[b]);
+            else
+                printf(" %zu-%zu: %zu", lo, extent_buckets[b], c.histogram[b]);
         }
+        printf("\n");
     }
-    dir_close(root_dir);
+
+    // Free runs, jumping from one run boundary to the next
+    size_t size = bitmap_size(free_map), free_cnt = 0, runs = 0, largest = 0;
+    size_t start = bitmap_scan(free_map, 0, 1, false);
+    while (start != BITMAP_ERROR) {
+        size_t end = bitmap_scan(free_map, start, 1, true);
+        if (end == BITMAP_ERROR)
+            end = size;
+        free_cnt += end - start;
+        runs++;
+        if (end - start > largest)
+            largest = end - start;
+        start = end < size ? bitmap_scan(free_map, end, 1, false) : BITMAP_ERROR;
+    }
+    printf("Free space: %zu sectors in %zu runs, largest %zu sectors\n",
+           free_cnt, runs, largest);
 }
 
-// Helper function to check if a sector contains non-zero data
-bool is_sector_nonzero(block_sector_t sector) {
-    char buffer[SECTOR_SIZE];
-    block_read(fs_device, sector, buffer);
-    for (int i = 0; i < SECTOR_SIZE; i++) {
-        if (buffer[i] != 0) {
-            return true; // Non-zero data found
+
+/* Defragments the files of the root directory and reports how many
+   extents there were before and after, and how much data moved. */
+int defragment() {
+    struct defrag_stats st;
+    struct timespec start;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+
+    if (!defrag_run(&st)) {
+        printf("Error: Failed to defragment the file system\n");
+        return -1;
+    }
+
+    printf("Moved %zu of %zu fragmented files (%zu files in total)\n",
+           st.moved, st.fragmented, st.files);
+    printf("Extents: %zu before, %zu after\n", st.extents_before,
+           st.extents_after);
+    report_throughput("Moved", st.bytes_moved, &start);
+    printf("Defragmentation completed successfully\n");
+    return 0;
+}
+
+
+
+
+/* Controls background compaction: "start [rate]", "rate N", "pause",
+   "resume", "stop", or "status". */
+int defrag_background(char *action, char *arg) {
+    unsigned rate = arg != NULL ? (unsigned)atoi(arg) : 0;
+
+    if (strcmp(action, "start") == 0) {
+        if (!defrag_bg_start(rate)) {
+            printf("Error: Failed to start background compaction\n");
+            return -1;
         }
+    } else if (strcmp(action, "rate") == 0 && rate > 0) {
+        defrag_bg_set_rate(rate);
+    } else if (strcmp(action, "pause") == 0) {
+        defrag_bg_pause();
+    } else if (strcmp(action, "resume") == 0) {
+        defrag_bg_resume();
+    } else if (strcmp(action, "stop") == 0) {
+        defrag_bg_stop();
+    } else if (strcmp(action, "status") != 0) {
+        printf("Error: Unknown defrag_bg action %s\n", action);
+        return -1;
     }
-    return false; // Sector is all zero
+
+    struct defrag_bg_status st;
+    defrag_bg_status(&st);
+    printf("Background compaction: %s, %u sectors/s, %zu files compacted, "
+           "%lld sectors moved\n",
+           !st.running ? "stopped" : st.paused ? "paused" : "running",
+           st.rate, st.files_done, st.sectors_moved);
+    if (st.current != 0)
+        printf("Moving inode %u: %zu of %zu sectors in place\n", st.current,
+               st.current_done, st.current_cnt);
+    return 0;
 }
 
 
 
 
-// Helper function to recover hidden data beyond the end of a file
+/* Recovers deleted files (flag 0).  Every free sector that holds a
+   plausible inode is turned back into host file recovered0-<sector>
+   with the data the inode points to, minus the null terminator that
+   copy_in and write store at the end of a file. */
+void recover_deleted_files() {
+    struct recover_inode *found;
+    size_t n = recover_scan_inodes(&found);
+
+    for (size_t i = 0; i < n; i++) {
+        char filename[50];
+        size_t size;
+        char *data = recover_inode_data(&found[i].disk, &size);
+        if (data == NULL) {
+            printf("Error: Memory allocation failed\n");
+            break;
+        }
+        if (size > 0 && data[size - 1] == '\0')
+            size--;
+
+        snprintf(filename, sizeof(filename), "recovered0-%u", found[i].sector);
+        FILE *recovered_file = fopen(filename, "wb");
+        if (recovered_file != NULL &&
+            fwrite(data, 1, size, recovered_file) == size) {
+            printf("Recovered deleted file: %s\n", filename);
+        } else {
+            printf("Error: Failed to create recovered file: %s\n", filename);
+        }
+        if (recovered_file != NULL)
+            fclose(recovered_file);
+        free(data);
+    }
+    free(found);
+}
+
+// Writes nonzero sector SECTOR, found by recover 1, to its own file
+static void recover_sector(block_sector_t sector, const void *data,
+                           void *aux UNUSED) {
+    char filename[50];
+    FILE *recovered_file;
+
+    sprintf(filename, "recovered1-%u.txt", sector);
+    recovered_file = fopen(filename, "w");
+    if (recovered_file == NULL) {
+        fprintf(stderr, "Error: Failed to create recovered file for sector %u\n", sector);
+        return;
+    }
+    // Write sector contents to file, up to its first NUL
+    fwrite(data, sizeof(char), strnlen(data, SECTOR_SIZE), recovered_file);
+    fclose(recovered_file);
+}
+
+// Helper function to recover hidden data beyond the end of a file.
+// Only the last data sector can hold any; it is read through the
+// buffer cache, so the journal's view of the disk is the one used.
 void recover_hidden_data(const char *filename) {
     struct inode *inode = NULL;
     struct dir *dir = dir_open_path("/");
@@ -431,55 +1532,42 @@ void recover_hidden_data(const char *filename) {
         dir_lookup(dir, filename, &inode);
         dir_close(dir);
     }
-    
-    if (inode != NULL) {
-        off_t file_size = inode_length(inode);
-        size_t sector_count = bytes_to_sectors(file_size);
-
-        char recovered_filename[1000];
-        FILE *recovered_file;
-
-        for (size_t i = 0; i < sector_count; i++) {
-            block_sector_t sector;
-            if (i < DIRECT_BLOCKS_COUNT) {
-                sector = inode->data.direct_blocks[i];
-            } else if (i < DIRECT_BLOCKS_COUNT + INDIRECT_BLOCKS_PER_SECTOR) {
-                block_sector_t indirect_block[INDIRECT_BLOCKS_PER_SECTOR];
-                block_read(fs_device, inode->data.indirect_block, indirect_block);
-                sector = indirect_block[i - DIRECT_BLOCKS_COUNT];
-            } else {
-                block_sector_t doubly_indirect_block[INDIRECT_BLOCKS_PER_SECTOR];
-                block_read(fs_device, inode->data.doubly_indirect_block, doubly_indirect_block);
-                block_sector_t indirect_block[INDIRECT_BLOCKS_PER_SECTOR];
-                block_read(fs_device, doubly_indirect_block[(i - DIRECT_BLOCKS_COUNT - INDIRECT_BLOCKS_PER_SECTOR) / INDIRECT_BLOCKS_PER_SECTOR], indirect_block);
-                sector = indirect_block[(i - DIRECT_BLOCKS_COUNT - INDIRECT_BLOCKS_PER_SECTOR) % INDIRECT_BLOCKS_PER_SECTOR];
-            }
 
-            if (i == sector_count - 1) {
-                off_t last_block_offset = file_size % SECTOR_SIZE;
-                if (last_block_offset < SECTOR_SIZE) {
-                    char buffer[SECTOR_SIZE];
-                    block_read(fs_device, sector, buffer);
-                    if (is_sector_nonzero(sector)) {
-                        sprintf(recovered_filename, "recovered2-%s.txt", filename);
-                        recovered_file = fopen(recovered_filename, "w");
-                        if (recovered_file != NULL) {
-                            // Create a new buffer to hold non-null characters
-												    char non_null_buffer[SECTOR_SIZE];
-												    int j = 0;
-												    for (int k = last_block_offset; k < SECTOR_SIZE; k++) {
-												    		if (buffer[k] != '\0')
-												        	non_null_buffer[j++] = buffer[k];
-												    }
-												    // Write non-null buffer to the file
-												    fwrite(non_null_buffer, sizeof(char), j, recovered_file);
-												    fclose(recovered_file);
-                        }
-                    }
-                }
-            }
-        }
+    // the last sector of a compressed file holds no slack of its own
+    if (inode == NULL || inode_is_compressed(inode)) {
+        inode_close(inode);
+        return;
     }
+    off_t file_size = inode_length(inode);
+    size_t sector_count = bytes_to_sectors(file_size);
+    block_sector_t *sectors =
+        sector_count > 0 ? inode_disk_data_sectors(&inode->data) : NULL;
+    block_sector_t sector = sectors != NULL ? sectors[sector_count - 1] : 0;
+    free(sectors);
+    inode_close(inode);
+    if (sector == 0)
+        return; // empty, or a hole
+
+    off_t last_block_offset = file_size % SECTOR_SIZE;
+    char buffer[SECTOR_SIZE];
+    buffer_cache_read(sector, buffer);
+    if (recover_sector_zero(buffer))
+        return;
+
+    char recovered_filename[1000];
+    sprintf(recovered_filename, "recovered2-%s.txt", filename);
+    FILE *recovered_file = fopen(recovered_filename, "w");
+    if (recovered_file == NULL)
+        return;
+    // Keep only the non-null characters past the end of the file
+    char non_null_buffer[SECTOR_SIZE];
+    int j = 0;
+    for (int k = last_block_offset; k < SECTOR_SIZE; k++) {
+        if (buffer[k] != '\0')
+            non_null_buffer[j++] = buffer[k];
+    }
+    fwrite(non_null_buffer, sizeof(char), j, recovered_file);
+    fclose(recovered_file);
 }
 
 
@@ -492,25 +1580,7 @@ void recover(int flag) {
 			recover_deleted_files();
   } 
   else if (flag == 1) { // recover all non-empty sectors
-			FILE *recovered_file;
-      char filename[50];
-      int sector;
-
-      for (sector = 4; sector < block_size(fs_device); sector++) {
-          if (is_sector_nonzero(sector)) {
-              sprintf(filename, "recovered1-%d.txt", sector);
-              recovered_file = fopen(filename, "w");
-              if (recovered_file == NULL) {
-                  fprintf(stderr, "Error: Failed to create recovered file for sector %d\n", sector);
-                  continue;
-              }
-              // Write sector contents to file
-              char buffer[SECTOR_SIZE];
-              block_read(fs_device, sector, buffer);
-              fwrite(buffer, sizeof(char), strlen(buffer), recovered_file);
-              fclose(recovered_file);
-          }
-      }
+      recover_scan_nonzero(4, recover_sector, NULL);
       printf("Recovery completed for flag 1\n");
    
   } 
@@ -526,3 +1596,15 @@ void recover(int flag) {
       printf("Recovery completed for flag 2\n");
   }
 }
+
+/* Checks the file system for consistency, repairing what it can if
+   repair is set.  Returns the status fsck_print() gives. */
+int fsck(bool repair) {
+    struct fsck_report r;
+
+    if (!fsck_run(repair, &r)) {
+        printf("Error: Failed to check the file system\n");
+        return 4;
+    }
+    return fsck_print(&r, repair);
+}
@@ -1,12 +1,35 @@
 #ifndef FILESYS_FSUTIL2_H
 #define FILESYS_FSUTIL2_H
 
+#include <stdbool.h>
+#include <stddef.h>
+
+/* What find_file prints for each file that matches. */
+enum find_mode {
+    FIND_NAMES,   /* File name. */
+    FIND_COUNT,   /* "name:count". */
+    FIND_OFFSETS  /* "name:offset:pattern" for every match. */
+};
 
 int copy_in(char *fname);
 int copy_out(char *fname);
-void find_file(char *pattern);
+int copy_in_dir(char *path);
+int copy_out_dir(char *path);
+void find_file(char *const patterns[], size_t cnt, enum find_mode mode,
+               int nthreads, int bench);
+int content_index(char *action);
+int compress(char *fname, bool decompress);
+int journal(char *action, char *size);
+int checksum(char *action);
+int scrub();
+int dedup(char *action);
+int dedupstat();
+int snapshot(char *action, char *name);
+int clone_file(char *src, char *dst);
 void fragmentation_degree();
 int defragment();
+int defrag_background(char *action, char *arg);
 void recover(int flag);
+int fsck(bool repair);
 
 #endif /* fs/fsutil2.h */
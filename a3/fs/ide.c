@@ -1,11 +1,15 @@
+#define _GNU_SOURCE
 #include "ide.h"
 #include "block.h"
 #include "debug.h"
 #include "partition.h"
+#include "round.h"
 #include <ctype.h>
+#include <errno.h>
 #include <fcntl.h>
 #include <stdbool.h>
 #include <stdio.h>
+#include <string.h>
 #include <sys/stat.h>
 #include <unistd.h>
 
@@ -77,16 +81,58 @@ static void identify_ata_device(struct ata_disk *d) {
 static void ide_read(void *d_, block_sector_t sec_no, void *buffer) {
 
   struct ata_disk *d = d_;
-  lseek(d->fd, sec_no * BLOCK_SECTOR_SIZE, SEEK_SET);
-  read(d->fd, buffer, BLOCK_SECTOR_SIZE);
+  pread(d->fd, buffer, BLOCK_SECTOR_SIZE, (off_t)sec_no * BLOCK_SECTOR_SIZE);
 }
 
 /* Write sector SEC_NO to disk D from BUFFER, which must contain
    BLOCK_SECTOR_SIZE bytes. */
 static void ide_write(void *d_, block_sector_t sec_no, const void *buffer) {
   struct ata_disk *d = d_;
-  lseek(d->fd, sec_no * BLOCK_SECTOR_SIZE, SEEK_SET);
-  write(d->fd, buffer, BLOCK_SECTOR_SIZE);
+  pwrite(d->fd, buffer, BLOCK_SECTOR_SIZE, (off_t)sec_no * BLOCK_SECTOR_SIZE);
 }
 
-static struct block_operations ide_operations = {ide_read, ide_write};
\ No newline at end of file
+/* Reads the CNT sectors starting at SEC_NO from disk D into BUFFER
+   with as few system calls as possible. */
+static void ide_read_run(void *d_, block_sector_t sec_no, size_t cnt,
+                         void *buffer) {
+  struct ata_disk *d = d_;
+  size_t done = 0, size = cnt * BLOCK_SECTOR_SIZE;
+
+  while (done < size) {
+    ssize_t n = pread(d->fd, (char *)buffer + done, size - done,
+                      (off_t)sec_no * BLOCK_SECTOR_SIZE + done);
+    if (n <= 0)
+      break;
+    done += n;
+  }
+  // past the end of the image file reads as zeros
+  memset((char *)buffer + done, 0, size - done);
+}
+
+/* Finds the next data in the image file of disk D at or after
+   sector SEC_NO with SEEK_DATA, and its end with SEEK_HOLE, so that
+   sparse images can be scanned without reading their holes.  Where
+   the host does not support this, reports everything as data. */
+static block_sector_t ide_seek_data(void *d_, block_sector_t sec_no,
+                                    block_sector_t *data_end) {
+  struct ata_disk *d = d_;
+  block_sector_t end = (block_sector_t)-1;
+#if defined(SEEK_DATA) && defined(SEEK_HOLE)
+  off_t data = lseek(d->fd, (off_t)sec_no * BLOCK_SECTOR_SIZE, SEEK_DATA);
+  if (data < 0) {
+    // ENXIO: no data past SEC_NO; anything else: not supported
+    if (errno == ENXIO)
+      sec_no = end;
+  } else {
+    off_t hole = lseek(d->fd, data, SEEK_HOLE);
+    sec_no = data / BLOCK_SECTOR_SIZE;
+    if (hole > data)
+      end = DIV_ROUND_UP(hole, BLOCK_SECTOR_SIZE);
+  }
+#endif
+  *data_end = end;
+  return sec_no;
+}
+
+static struct block_operations ide_operations = {ide_read, ide_write,
+                                                 ide_read_run, ide_seek_data};
\ No newline at end of file
@@ -0,0 +1,242 @@
+#include "index.h"
+#include "cache.h"
+#include "debug.h"
+#include "free-map.h"
+#include "inode.h"
+#include "search.h"
+#include "super.h"
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define INDEX_BLOOM_BYTES (BLOCK_SECTOR_SIZE - 2 * sizeof(uint32_t))
+#define INDEX_BLOOM_BITS (INDEX_BLOOM_BYTES * 8)
+
+/* On-disk index record, one per sector of the index file. */
+struct index_record {
+  block_sector_t inode_sector; /* File indexed, or 0 for a free record. */
+  offset_t length;             /* File length when indexed, or -1 if stale. */
+  uint8_t bloom[INDEX_BLOOM_BYTES]; /* Trigrams present in the file. */
+};
+
+/* The open index file, or NULL if there is no index, and an
+   in-memory copy of all its records. */
+static struct inode *index_inode;
+static struct index_record *records;
+static size_t record_cnt;
+
+/* Opens the index of the mounted file system, if it has one. */
+void index_init(void) {
+  struct super_block *sb = super_get();
+
+  ASSERT(sizeof(struct index_record) == BLOCK_SECTOR_SIZE);
+
+  index_done();
+  if (!super_supported() || sb->index_sector == 0)
+    return;
+
+  index_inode = inode_open(sb->index_sector);
+  if (index_inode == NULL)
+    return;
+  record_cnt = inode_length(index_inode) / sizeof *records;
+  records = malloc(record_cnt * sizeof *records + 1);
+  if (records == NULL ||
+      inode_read_at(index_inode, records, record_cnt * sizeof *records, 0) !=
+          (offset_t)(record_cnt * sizeof *records)) {
+    // unreadable: search without it
+    index_done();
+  }
+}
+
+/* Closes the index. */
+void index_done(void) {
+  inode_close(index_inode);
+  index_inode = NULL;
+  free(records);
+  records = NULL;
+  record_cnt = 0;
+}
+
+bool index_enabled(void) { return index_inode != NULL; }
+
+/* Creates an empty index.  Returns false if the image cannot hold
+   one or the disk is full. */
+bool index_enable(void) {
+  struct super_block *sb = super_get();
+  block_sector_t sector = 0;
+
+  if (index_inode != NULL)
+    return true;
+  if (!super_supported() || !free_map_allocate(1, &sector))
+    return false;
+  if (!inode_create(sector, 0, false)) {
+    free_map_release(sector, 1);
+    return false;
+  }
+  sb->index_sector = sector;
+  if (!super_write()) {
+    sb->index_sector = 0;
+    free_map_release(sector, 1);
+    return false;
+  }
+  index_init();
+  return index_inode != NULL;
+}
+
+/* Deletes the index. */
+void index_disable(void) {
+  struct super_block *sb = super_get();
+
+  if (index_inode == NULL)
+    return;
+  inode_remove(index_inode);
+  index_done();
+  sb->index_sector = 0;
+  super_write();
+}
+
+/* Counts the files with an up-to-date record and those whose record
+   is stale. */
+void index_stats(size_t *indexed, size_t *stale) {
+  size_t i;
+
+  *indexed = *stale = 0;
+  for (i = 0; i < record_cnt; i++)
+    if (records[i].inode_sector != 0) {
+      if (records[i].length >= 0)
+        ++*indexed;
+      else
+        ++*stale;
+    }
+}
+
+/* Returns the record of INODE_SECTOR, or NULL if it has none. */
+static struct index_record *index_find(block_sector_t inode_sector) {
+  size_t i;
+  for (i = 0; i < record_cnt; i++)
+    if (records[i].inode_sector == inode_sector)
+      return &records[i];
+  return NULL;
+}
+
+/* Writes the first SIZE bytes of record R back to the index file. */
+static bool index_store(const struct index_record *r, size_t size) {
+  offset_t ofs = (r - records) * sizeof *r;
+  return inode_write_at(index_inode, r, size, ofs) == (offset_t)size;
+}
+
+/* Marks the record of the file at INODE_SECTOR stale, as its content
+   is about to change. */
+void index_invalidate(block_sector_t inode_sector) {
+  struct index_record *r;
+
+  if (index_inode == NULL ||
+      inode_sector == inode_get_inumber(index_inode) ||
+      (r = index_find(inode_sector)) == NULL || r->length < 0)
+    return;
+  r->length = -1;
+  index_store(r, offsetof(struct index_record, bloom));
+}
+
+/* Frees the record of the file at INODE_SECTOR, which is being
+   removed. */
+void index_forget(block_sector_t inode_sector) {
+  struct index_record *r;
+
+  if (index_inode == NULL ||
+      inode_sector == inode_get_inumber(index_inode) ||
+      (r = index_find(inode_sector)) == NULL)
+    return;
+  r->inode_sector = 0;
+  r->length = -1;
+  index_store(r, offsetof(struct index_record, bloom));
+}
+
+/* Returns the filter bit of the trigram A B C. */
+static uint32_t index_bit(uint8_t a, uint8_t b, uint8_t c) {
+  uint32_t h = ((uint32_t)a << 16 | (uint32_t)b << 8 | c) * 2654435761u;
+  return (h ^ h >> 16) % INDEX_BLOOM_BITS;
+}
+
+/* Fills the filter of R from the LENGTH bytes stored in SECTORS. */
+static void index_build(struct index_record *r, const block_sector_t *sectors,
+                        offset_t length) {
+  uint8_t buf[BLOCK_SECTOR_SIZE];
+  uint8_t a = 0, b = 0; // the two bytes before the current one
+  offset_t pos = 0, seen = 0;
+  size_t s;
+
+  memset(r->bloom, 0, sizeof r->bloom);
+  for (s = 0; pos < length; s++, pos += BLOCK_SECTOR_SIZE) {
+    size_t n = length - pos < BLOCK_SECTOR_SIZE ? length - pos
+                                                : BLOCK_SECTOR_SIZE;
+    size_t i;
+
+    buffer_cache_read_nofill(sectors[s], buf);
+    for (i = 0; i < n; i++, seen++) {
+      if (seen >= 2) {
+        uint32_t bit = index_bit(a, b, buf[i]);
+        r->bloom[bit / 8] |= 1 << bit % 8;
+      }
+      a = b;
+      b = buf[i];
+    }
+  }
+  r->length = length;
+}
+
+/* Returns the record to use for INODE_SECTOR: its own, a free one,
+   or a new one at the end of the index.  Returns NULL if memory
+   runs out. */
+static struct index_record *index_slot(block_sector_t inode_sector) {
+  struct index_record *r = index_find(inode_sector);
+
+  if (r == NULL)
+    r = index_find(0);
+  if (r == NULL) {
+    struct index_record *grown =
+        realloc(records, (record_cnt + 1) * sizeof *records);
+    if (grown == NULL)
+      return NULL;
+    records = grown;
+    r = &records[record_cnt++];
+    r->length = -1;
+  }
+  r->inode_sector = inode_sector;
+  return r;
+}
+
+/* Returns false if no pattern of SEARCH can occur in the LENGTH bytes
+   of the file at INODE_SECTOR stored in SECTORS.  The file's record
+   is brought up to date first if need be.  Files without SECTORS
+   (compressed ones) are not indexed. */
+bool index_may_match(const struct search *search, block_sector_t inode_sector,
+                     const block_sector_t *sectors, offset_t length) {
+  struct index_record *r;
+  size_t p;
+
+  if (index_inode == NULL || sectors == NULL ||
+      (r = index_slot(inode_sector)) == NULL)
+    return true;
+  if (r->length != length) {
+    index_build(r, sectors, length);
+    if (!index_store(r, sizeof *r))
+      r->length = -1; // could not be saved: rebuild on the next search
+  }
+
+  for (p = 0; p < search_pattern_cnt(search); p++) {
+    const uint8_t *pat = (const uint8_t *)search_pattern(search, p);
+    size_t len = strlen((const char *)pat), i;
+
+    if (len < 3)
+      return true;
+    for (i = 0; i + 2 < len; i++) {
+      uint32_t bit = index_bit(pat[i], pat[i + 1], pat[i + 2]);
+      if (!(r->bloom[bit / 8] & 1 << bit % 8))
+        break;
+    }
+    if (i + 2 == len)
+      return true;
+  }
+  return false;
+}
@@ -0,0 +1,33 @@
+#ifndef FILESYS_INDEX_H
+#define FILESYS_INDEX_H
+
+#include "block.h"
+#include "off_t.h"
+#include <stdbool.h>
+#include <stddef.h>
+
+struct search;
+
+/* Optional persistent content index.
+
+   The index is a system file, found through the superblock, that
+   holds one sector-sized record per indexed file: a bloom filter
+   of the trigrams (3-byte substrings) in its content.  A pattern of
+   three or more bytes can only occur in a file whose filter has
+   every one of the pattern's trigrams, so find_file verifies just
+   those files.  Writes and removals mark a file's record stale; it
+   is rebuilt lazily the next time a search looks at the file. */
+
+void index_init(void);
+void index_done(void);
+bool index_enabled(void);
+bool index_enable(void);
+void index_disable(void);
+void index_stats(size_t *indexed, size_t *stale);
+
+void index_invalidate(block_sector_t inode_sector);
+void index_forget(block_sector_t inode_sector);
+bool index_may_match(const struct search *, block_sector_t inode_sector,
+                     const block_sector_t *sectors, offset_t length);
+
+#endif /* fs/index.h */
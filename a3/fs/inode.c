@@ -1,10 +1,15 @@
 #include "inode.h"
 #include "cache.h"
 #include "debug.h"
+#include "dedup.h"
 #include "filesys.h"
 #include "free-map.h"
+#include "index.h"
 #include "list.h"
+#include "lz.h"
 #include "round.h"
+#include "super.h"
+#include <pthread.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -14,8 +19,15 @@ struct inode_indirect_block_sector {
 };
 
 static bool inode_allocate(struct inode_disk *disk_inode);
+static bool inode_journaled(const struct inode *inode);
 static bool inode_reserve(struct inode_disk *disk_inode, offset_t length);
-static bool inode_deallocate(struct inode *inode);
+static bool inode_deallocate(const struct inode_disk *disk_inode);
+static void inode_set_slot(struct inode_disk *disk_inode, size_t index,
+                           block_sector_t sector);
+static offset_t inode_read_compressed(const struct inode_disk *, void *,
+                                      offset_t size, offset_t offset);
+static offset_t inode_write_compressed(struct inode_disk *, const void *,
+                                       offset_t size, offset_t offset);
 
 /* Returns the number of sectors to allocate for an inode SIZE
    bytes long. */
@@ -88,12 +100,58 @@ static block_sector_t byte_to_sector(const struct inode *inode, offset_t pos) {
     return -1;
 }
 
-/* List of open inodes, so that opening a single inode twice
-   returns the same `struct inode'. */
-static struct list open_inodes;
+/* Open inodes, hashed by sector, so that opening a single inode
+   twice returns the same `struct inode'.  The table also holds
+   recently closed inodes (open_cnt == 0) that are kept on
+   closed_inodes, least recently closed first, so that reopening a
+   hot file reuses its inode_disk instead of reading it again. */
+#define INODE_HASH_BUCKETS 64
+#define INODE_LRU_SIZE 32
+
+static struct list open_inodes[INODE_HASH_BUCKETS];
+static struct list closed_inodes;
+static size_t closed_inode_cnt;
+
+/* Guards the tables above and every inode's open count, so that
+   inodes can be opened, closed and read from several threads. */
+static pthread_mutex_t inode_table_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/* Returns the bucket of open_inodes that SECTOR hashes to. */
+static struct list *inode_bucket(block_sector_t sector) {
+  return &open_inodes[sector % INODE_HASH_BUCKETS];
+}
+
+/* Returns the in-memory inode for SECTOR, open or recently closed,
+   or NULL if there is none. */
+static struct inode *inode_lookup(block_sector_t sector) {
+  struct list *bucket = inode_bucket(sector);
+  struct list_elem *e;
+
+  for (e = list_begin(bucket); e != list_end(bucket); e = list_next(e)) {
+    struct inode *inode = list_entry(e, struct inode, elem);
+    if (inode->sector == sector)
+      return inode;
+  }
+  return NULL;
+}
+
+/* Frees a closed INODE that is being dropped from the LRU. */
+static void inode_evict(struct inode *inode) {
+  ASSERT(inode->open_cnt == 0);
+  list_remove(&inode->elem);
+  list_remove(&inode->lru_elem);
+  closed_inode_cnt--;
+  free(inode);
+}
 
 /* Initializes the inode module. */
-void inode_init(void) { llist_init(&open_inodes); }
+void inode_init(void) {
+  size_t i;
+  for (i = 0; i < INODE_HASH_BUCKETS; i++)
+    llist_init(&open_inodes[i]);
+  llist_init(&closed_inodes);
+  closed_inode_cnt = 0;
+}
 
 /* Initializes an inode with LENGTH bytes of data and
    writes the new inode to sector SECTOR on the file system
@@ -102,6 +160,7 @@ void inode_init(void) { llist_init(&open_inodes); }
    Returns false if memory or disk allocation fails. */
 bool inode_create(block_sector_t sector, offset_t length, bool is_dir) {
   struct inode_disk *disk_inode = NULL;
+  struct inode *cached;
   bool success = false;
 
   ASSERT(length >= 0);
@@ -110,13 +169,20 @@ bool inode_create(block_sector_t sector, offset_t length, bool is_dir) {
      one sector in size, and you should fix that. */
   ASSERT(sizeof *disk_inode == BLOCK_SECTOR_SIZE);
 
+  /* Forget a closed inode that used to live in this sector. */
+  pthread_mutex_lock(&inode_table_lock);
+  cached = inode_lookup(sector);
+  if (cached != NULL && cached->open_cnt == 0)
+    inode_evict(cached);
+  pthread_mutex_unlock(&inode_table_lock);
+
   disk_inode = calloc(1, sizeof *disk_inode);
   if (disk_inode != NULL) {
     disk_inode->length = length;
     disk_inode->magic = INODE_MAGIC;
     disk_inode->is_dir = is_dir;
     if (inode_allocate(disk_inode)) {
-      buffer_cache_write(sector, disk_inode);
+      buffer_cache_write_meta(sector, disk_inode);
       success = true;
     }
     free(disk_inode);
@@ -128,37 +194,51 @@ bool inode_create(block_sector_t sector, offset_t length, bool is_dir) {
    and returns a `struct inode' that contains it.
    Returns a null pointer if memory allocation fails. */
 struct inode *inode_open(block_sector_t sector) {
-  struct list_elem *e;
   struct inode *inode;
 
-  /* Check whether this inode is already open. */
-  for (e = list_begin(&open_inodes); e != list_end(&open_inodes);
-       e = list_next(e)) {
-    inode = list_entry(e, struct inode, elem);
-    if (inode->sector == sector) {
-      inode_reopen(inode);
-      return inode;
+  /* Check whether this inode is already open, or was closed
+     recently enough to still be cached. */
+  pthread_mutex_lock(&inode_table_lock);
+  inode = inode_lookup(sector);
+  if (inode != NULL) {
+    if (inode->open_cnt == 0) {
+      list_remove(&inode->lru_elem);
+      closed_inode_cnt--;
     }
+    inode->open_cnt++;
+    pthread_mutex_unlock(&inode_table_lock);
+    return inode;
   }
 
   /* Allocate memory. */
   inode = malloc(sizeof *inode);
-  if (inode == NULL)
+  if (inode == NULL) {
+    pthread_mutex_unlock(&inode_table_lock);
     return NULL;
+  }
 
   /* Initialize. */
-  list_push_front(&open_inodes, &inode->elem);
+  list_push_front(inode_bucket(sector), &inode->elem);
   inode->sector = sector;
   inode->open_cnt = 1;
   inode->deny_write_cnt = 0;
   inode->removed = false;
+  inode->dir_free_ofs = 0;
   buffer_cache_read(inode->sector, &inode->data);
+  pthread_mutex_unlock(&inode_table_lock);
 
   return inode;
 }
 
 /* Reopens and returns INODE. */
-struct inode *inode_reopen(struct inode *inode) { return inode; }
+struct inode *inode_reopen(struct inode *inode) {
+  if (inode != NULL) {
+    pthread_mutex_lock(&inode_table_lock);
+    inode->open_cnt++;
+    pthread_mutex_unlock(&inode_table_lock);
+  }
+  return inode;
+}
 
 /* Returns INODE's inode number. */
 block_sector_t inode_get_inumber(const struct inode *inode) {
@@ -174,18 +254,34 @@ void inode_close(struct inode *inode) {
     return;
   }
   /* Release resources if this was the last opener. */
+  pthread_mutex_lock(&inode_table_lock);
   if (--inode->open_cnt == 0) {
 
+    /* Keep a live inode around for a quick reopen.  Its inode_disk
+       is never newer than the buffer cache's copy, since every change
+       is written through, so nothing needs flushing here. */
+    if (!inode->removed && inode->data.magic == INODE_MAGIC) {
+      list_push_back(&closed_inodes, &inode->lru_elem);
+      if (++closed_inode_cnt > INODE_LRU_SIZE)
+        inode_evict(list_entry(list_front(&closed_inodes), struct inode,
+                               lru_elem));
+      pthread_mutex_unlock(&inode_table_lock);
+      return;
+    }
+
     /* Remove from inode list and release lock. */
     list_remove(&inode->elem);
+    pthread_mutex_unlock(&inode_table_lock);
 
     /* Deallocate blocks if removed. */
     if (inode->removed) {
       free_map_release(inode->sector, 1);
-      inode_deallocate(inode);
+      inode_deallocate(&inode->data);
     }
     free(inode);
+    return;
   }
+  pthread_mutex_unlock(&inode_table_lock);
 }
 
 /* Marks INODE to be deleted when it is closed by the last caller who
@@ -193,6 +289,7 @@ void inode_close(struct inode *inode) {
 void inode_remove(struct inode *inode) {
   ASSERT(inode != NULL);
   inode->removed = true;
+  index_forget(inode->sector);
 }
 
 /* Reads SIZE bytes from INODE into BUFFER, starting at position OFFSET.
@@ -204,6 +301,9 @@ offset_t inode_read_at(struct inode *inode, void *buffer_, offset_t size,
   offset_t bytes_read = 0;
   uint8_t *bounce = NULL;
 
+  if (inode->data.flags & INODE_COMPRESSED)
+    return inode_read_compressed(&inode->data, buffer_, size, offset);
+
   while (size > 0) {
     /* Disk sector to read, starting byte offset within sector. */
     block_sector_t sector_idx = byte_to_sector(inode, offset);
@@ -246,6 +346,43 @@ offset_t inode_read_at(struct inode *inode, void *buffer_, offset_t size,
   return bytes_read;
 }
 
+/* Writes DATA, a whole sector, as data sector INDEX of the regular
+   file INODE, which is SECTOR now.  With dedup on, a sector that
+   already holds DATA is shared instead; otherwise a sector shared
+   with other files is first replaced by a copy of its own.  Sets
+   *SLOTS_CHANGED if that changed a direct slot of INODE.  Returns
+   false if the disk is full. */
+static bool inode_write_data(struct inode *inode, size_t index,
+                             block_sector_t sector, const void *data,
+                             bool *slots_changed) {
+  block_sector_t other;
+
+  // metadata is written in place and must never be shared
+  ASSERT(!inode_journaled(inode));
+  other = dedup_find(data);
+
+  if (other == sector)
+    return true; // it holds DATA already
+  if (other != 0 && free_map_ref(other)) {
+    inode_set_slot(&inode->data, index, other);
+    free_map_release(sector, 1);
+    *slots_changed |= index < DIRECT_BLOCKS_COUNT;
+    return true;
+  }
+  if (free_map_refs(sector) > 1) {
+    block_sector_t copy;
+    if (!free_map_allocate(1, &copy))
+      return false;
+    inode_set_slot(&inode->data, index, copy);
+    free_map_release(sector, 1);
+    *slots_changed |= index < DIRECT_BLOCKS_COUNT;
+    sector = copy;
+  }
+  buffer_cache_write(sector, data);
+  dedup_add(sector, data);
+  return true;
+}
+
 /* Writes SIZE bytes from BUFFER into INODE, starting at OFFSET.
    Returns the number of bytes actually written, which may be
    less than SIZE if end of file is reached or an error occurs.
@@ -255,10 +392,18 @@ offset_t inode_write_at(struct inode *inode, const void *buffer_, offset_t size,
   const uint8_t *buffer = buffer_;
   offset_t bytes_written = 0;
   uint8_t *bounce = NULL;
+  bool slots_changed = false;
 
   if (inode->deny_write_cnt) {
     return 0;
   }
+  index_invalidate(inode->sector);
+
+  if (inode->data.flags & INODE_COMPRESSED) {
+    bytes_written = inode_write_compressed(&inode->data, buffer_, size, offset);
+    buffer_cache_write_meta(inode->sector, &inode->data);
+    return bytes_written;
+  }
 
   // beyond the EOF: extend the file
   if (byte_to_sector(inode, offset + size - 1) == -1u) {
@@ -270,7 +415,7 @@ offset_t inode_write_at(struct inode *inode, const void *buffer_, offset_t size,
 
     // write back the (extended) file size
     inode->data.length = offset + size;
-    buffer_cache_write(inode->sector, &inode->data);
+    buffer_cache_write_meta(inode->sector, &inode->data);
   }
 
   while (size > 0) {
@@ -289,11 +434,9 @@ offset_t inode_write_at(struct inode *inode, const void *buffer_, offset_t size,
       break;
     }
 
-    if (sector_ofs == 0 && chunk_size == BLOCK_SECTOR_SIZE) {
-      /* Write full sector directly to disk. */
-      buffer_cache_write(sector_idx, buffer + bytes_written);
-
-    } else {
+    /* A full sector is written directly from BUFFER. */
+    const uint8_t *data = buffer + bytes_written;
+    if (sector_ofs > 0 || chunk_size < BLOCK_SECTOR_SIZE) {
       /* We need a bounce buffer. */
       if (bounce == NULL) {
         bounce = malloc(BLOCK_SECTOR_SIZE);
@@ -313,8 +456,13 @@ offset_t inode_write_at(struct inode *inode, const void *buffer_, offset_t size,
         memset(bounce, 0, BLOCK_SECTOR_SIZE);
       }
       memcpy(bounce + sector_ofs, buffer + bytes_written, chunk_size);
-      buffer_cache_write(sector_idx, bounce);
+      data = bounce;
     }
+    if (inode_journaled(inode))
+      buffer_cache_write_meta(sector_idx, data);
+    else if (!inode_write_data(inode, offset / BLOCK_SECTOR_SIZE, sector_idx,
+                               data, &slots_changed))
+      break;
 
     /* Advance. */
     size -= chunk_size;
@@ -322,10 +470,325 @@ offset_t inode_write_at(struct inode *inode, const void *buffer_, offset_t size,
     bytes_written += chunk_size;
   }
   free(bounce);
+  if (slots_changed)
+    buffer_cache_write_meta(inode->sector, &inode->data);
+
+  return bytes_written;
+}
+
+/* Bytes of data in a compression cluster. */
+#define CLUSTER_SIZE (INODE_CLUSTER_SECTORS * BLOCK_SECTOR_SIZE)
+
+/* Points data slot INDEX of DISK_INODE at SECTOR.  The indirect
+   blocks covering INDEX must have been reserved; a direct slot is
+   only changed in memory, for the caller to write back. */
+static void inode_set_slot(struct inode_disk *disk_inode, size_t index,
+                           block_sector_t sector) {
+  struct inode_indirect_block_sector indirect_block;
+  block_sector_t entry;
+
+  if (index < DIRECT_BLOCKS_COUNT) {
+    disk_inode->direct_blocks[index] = sector;
+    return;
+  }
+  index -= DIRECT_BLOCKS_COUNT;
+  entry = disk_inode->indirect_block;
+  if (index >= INDIRECT_BLOCKS_PER_SECTOR) {
+    index -= INDIRECT_BLOCKS_PER_SECTOR;
+    buffer_cache_read(disk_inode->doubly_indirect_block, &indirect_block);
+    entry = indirect_block.blocks[index / INDIRECT_BLOCKS_PER_SECTOR];
+    index %= INDIRECT_BLOCKS_PER_SECTOR;
+  }
+  buffer_cache_read(entry, &indirect_block);
+  indirect_block.blocks[index] = sector;
+  buffer_cache_write_meta(entry, &indirect_block);
+}
+
+/* Returns the number of data sectors of cluster CLUSTER of
+   DISK_INODE, as it is long now. */
+static size_t inode_cluster_sectors(const struct inode_disk *disk_inode,
+                                    size_t cluster) {
+  size_t first = cluster * INODE_CLUSTER_SECTORS;
+  return min(bytes_to_sectors(disk_inode->length) - first,
+             INODE_CLUSTER_SECTORS);
+}
+
+/* Reads cluster CLUSTER of the compressed DISK_INODE into BUF, which
+   must hold CLUSTER_SIZE bytes.  Returns false if the cluster is
+   damaged. */
+static bool inode_cluster_read(const struct inode_disk *disk_inode,
+                               size_t cluster, uint8_t *buf) {
+  size_t first = cluster * INODE_CLUSTER_SECTORS;
+  size_t cnt = inode_cluster_sectors(disk_inode, cluster), used;
+  uint8_t packed[CLUSTER_SIZE];
+  uint16_t len;
+
+  memset(buf, 0, CLUSTER_SIZE);
+  for (used = 0; used < cnt; used++) {
+    block_sector_t sector = index_to_sector(disk_inode, first + used);
+    if (sector == 0)
+      break;
+    buffer_cache_read(sector, packed + used * BLOCK_SECTOR_SIZE);
+  }
+  if (used == cnt) {
+    // stored as is
+    memcpy(buf, packed, cnt * BLOCK_SECTOR_SIZE);
+    return true;
+  }
+  if (used == 0)
+    return true;
+
+  memcpy(&len, packed, sizeof len);
+  return sizeof len + len <= used * BLOCK_SECTOR_SIZE &&
+         lz_decompress(packed + sizeof len, len, buf, cnt * BLOCK_SECTOR_SIZE);
+}
+
+/* Stores BUF as cluster CLUSTER of the compressed DISK_INODE: as
+   nothing if it is all zeros, compressed if that saves a sector, or
+   else as is.  Slots the cluster no longer needs are released.
+   Returns false if the disk is full. */
+static bool inode_cluster_write(struct inode_disk *disk_inode, size_t cluster,
+                                const uint8_t *buf) {
+  size_t first = cluster * INODE_CLUSTER_SECTORS;
+  size_t cnt = inode_cluster_sectors(disk_inode, cluster), used, i;
+  size_t size = cnt * BLOCK_SECTOR_SIZE, len;
+  block_sector_t slots[INODE_CLUSTER_SECTORS];
+  uint8_t packed[CLUSTER_SIZE];
+  const uint8_t *data = buf;
+  uint16_t len16;
+
+  for (i = 0; i < size && buf[i] == 0; i++)
+    continue;
+  if (i == size) {
+    used = 0;
+  } else {
+    // worth it only if the length and the data fit in fewer sectors
+    memset(packed, 0, sizeof packed);
+    len = cnt > 1 ? lz_compress(buf, size, packed + sizeof len16,
+                                size - BLOCK_SECTOR_SIZE - sizeof len16)
+                  : 0;
+    if (len > 0) {
+      len16 = len;
+      memcpy(packed, &len16, sizeof len16);
+      used = DIV_ROUND_UP(sizeof len16 + len, BLOCK_SECTOR_SIZE);
+      data = packed;
+    } else
+      used = cnt;
+  }
+
+  for (i = 0; i < cnt; i++)
+    slots[i] = index_to_sector(disk_inode, first + i);
+  // a cluster written for the first time gets consecutive sectors
+  if (used > 0 && slots[0] == 0 && free_map_allocate(used, &slots[0])) {
+    for (i = 1; i < used; i++)
+      slots[i] = slots[0] + i;
+    for (i = 0; i < used; i++)
+      inode_set_slot(disk_inode, first + i, slots[i]);
+  }
+  for (i = 0; i < cnt; i++) {
+    if (i < used) {
+      // a sector shared with another file is replaced, not changed
+      if (slots[i] == 0 || free_map_refs(slots[i]) > 1) {
+        block_sector_t old = slots[i];
+        if (!free_map_allocate(1, &slots[i]))
+          return false;
+        inode_set_slot(disk_inode, first + i, slots[i]);
+        if (old != 0)
+          free_map_release(old, 1);
+      }
+      buffer_cache_write(slots[i], data + i * BLOCK_SECTOR_SIZE);
+    } else if (slots[i] != 0) {
+      inode_set_slot(disk_inode, first + i, 0);
+      free_map_release(slots[i], 1);
+    }
+  }
+  return true;
+}
+
+/* inode_read_at() for a compressed inode: decompresses each cluster
+   that the range touches. */
+static offset_t inode_read_compressed(const struct inode_disk *disk_inode,
+                                      void *buffer_, offset_t size,
+                                      offset_t offset) {
+  uint8_t *buffer = buffer_;
+  offset_t bytes_read = 0;
+  uint8_t *cluster;
+
+  if (offset >= disk_inode->length || size <= 0)
+    return 0;
+  if (size > disk_inode->length - offset)
+    size = disk_inode->length - offset;
+  cluster = malloc(CLUSTER_SIZE);
+  if (cluster == NULL)
+    return 0;
+
+  while (bytes_read < size) {
+    size_t ofs = offset % CLUSTER_SIZE;
+    size_t chunk_size = min(CLUSTER_SIZE - ofs, size - bytes_read);
+
+    if (!inode_cluster_read(disk_inode, offset / CLUSTER_SIZE, cluster))
+      break;
+    memcpy(buffer + bytes_read, cluster + ofs, chunk_size);
+    offset += chunk_size;
+    bytes_read += chunk_size;
+  }
+  free(cluster);
+  return bytes_read;
+}
+
+/* inode_write_at() for a compressed inode: rewrites each cluster
+   that the range touches.  The caller writes DISK_INODE back. */
+static offset_t inode_write_compressed(struct inode_disk *disk_inode,
+                                       const void *buffer_, offset_t size,
+                                       offset_t offset) {
+  const uint8_t *buffer = buffer_;
+  offset_t bytes_written = 0;
+  uint8_t *cluster;
 
+  if (size <= 0 || offset < 0)
+    return 0;
+  cluster = malloc(CLUSTER_SIZE);
+  if (cluster == NULL)
+    return 0;
+
+  // beyond the EOF: extend the file.  The last cluster grows with it,
+  // so it is stored again at its new size.
+  if (offset + size > disk_inode->length) {
+    offset_t old_length = disk_inode->length;
+    size_t last = old_length > 0 ? (old_length - 1) / CLUSTER_SIZE : 0;
+
+    if (old_length > 0 && !inode_cluster_read(disk_inode, last, cluster))
+      goto done;
+    if (!inode_reserve(disk_inode, offset + size))
+      goto done;
+    disk_inode->length = offset + size;
+    if (old_length > 0 && !inode_cluster_write(disk_inode, last, cluster))
+      goto done;
+  }
+
+  while (bytes_written < size) {
+    size_t index = offset / CLUSTER_SIZE;
+    size_t ofs = offset % CLUSTER_SIZE;
+    size_t chunk_size = min(CLUSTER_SIZE - ofs, size - bytes_written);
+
+    // a partly written cluster keeps the rest of its data
+    if ((ofs > 0 || chunk_size < CLUSTER_SIZE) &&
+        !inode_cluster_read(disk_inode, index, cluster))
+      break;
+    memcpy(cluster + ofs, buffer + bytes_written, chunk_size);
+    if (!inode_cluster_write(disk_inode, index, cluster))
+      break;
+    offset += chunk_size;
+    bytes_written += chunk_size;
+  }
+
+done:
+  free(cluster);
   return bytes_written;
 }
 
+/* Returns whether INODE's data is compressed. */
+bool inode_is_compressed(const struct inode *inode) {
+  return inode->data.flags & INODE_COMPRESSED;
+}
+
+/* Stores the data of INODE compressed, or not, as COMPRESSED says.
+   The data is written to new sectors first; the inode is switched
+   over and forced to disk, and only then are the old sectors
+   released, so a crash leaves the old or the new file.  Returns false,
+   with nothing changed, for a directory or system file, or if memory
+   or the disk runs out. */
+bool inode_set_compressed(struct inode *inode, bool compressed) {
+  offset_t length = inode->data.length, ofs;
+  struct inode_disk old = inode->data, new;
+  uint8_t *data;
+  bool ok;
+
+  if (inode_journaled(inode) || length < 0)
+    return false;
+  if (compressed == inode_is_compressed(inode))
+    return true;
+  data = calloc(1, bytes_to_sectors(length) * BLOCK_SECTOR_SIZE + 1);
+  if (data == NULL || inode_read_at(inode, data, length, 0) != length) {
+    free(data);
+    return false;
+  }
+
+  memset(&new, 0, sizeof new);
+  new.magic = INODE_MAGIC;
+  new.flags = compressed ? INODE_COMPRESSED : 0;
+  new.length = length;
+  ok = inode_reserve(&new, length);
+  for (ofs = 0; ok && ofs < length; ofs += compressed ? CLUSTER_SIZE
+                                                      : BLOCK_SECTOR_SIZE) {
+    if (compressed)
+      ok = inode_cluster_write(&new, ofs / CLUSTER_SIZE, data + ofs);
+    else
+      buffer_cache_write(index_to_sector(&new, ofs / BLOCK_SECTOR_SIZE),
+                         data + ofs);
+  }
+  free(data);
+  if (!ok) {
+    inode_deallocate(&new);
+    return false;
+  }
+
+  inode->data = new;
+  buffer_cache_write_meta(inode->sector, &inode->data);
+  buffer_cache_sync();
+  inode_deallocate(&old);
+  return true;
+}
+
+/* Creates at SECTOR a regular file with the contents of SRC that
+   shares SRC's data sectors, adding a reference to each, so that no
+   data is copied until one of the two is written.  Only the block map
+   is new.  Returns false if SRC is metadata or the disk is full. */
+bool inode_clone(struct inode *src, block_sector_t sector) {
+  size_t cnt = bytes_to_sectors(src->data.length), i;
+  block_sector_t *sectors;
+  struct inode_disk new;
+  bool ok;
+
+  if (inode_journaled(src) || src->data.length < 0)
+    return false;
+  sectors = get_inode_data_sectors(src);
+  if (sectors == NULL)
+    return false;
+
+  memset(&new, 0, sizeof new);
+  new.magic = INODE_MAGIC;
+  new.length = src->data.length;
+  // reserved as if compressed, to get indirect blocks but no data
+  new.flags = INODE_COMPRESSED;
+  ok = inode_reserve(&new, new.length);
+  new.flags = src->data.flags;
+  for (i = 0; ok && i < cnt; i++)
+    if (sectors[i] != 0 && (ok = free_map_ref(sectors[i])))
+      inode_set_slot(&new, i, sectors[i]);
+  free(sectors);
+  if (!ok) {
+    inode_deallocate(&new);
+    return false;
+  }
+  buffer_cache_write_meta(sector, &new);
+  return true;
+}
+
+/* Returns how many data sectors INODE uses, which for a compressed
+   inode may be fewer than its length needs. */
+size_t inode_data_sectors_used(struct inode *inode) {
+  size_t cnt = bytes_to_sectors(inode->data.length), used = 0, i;
+  block_sector_t *sectors = get_inode_data_sectors(inode);
+
+  if (sectors == NULL)
+    return cnt;
+  for (i = 0; i < cnt; i++)
+    used += sectors[i] != 0;
+  free(sectors);
+  return used;
+}
+
 /* Disables writes to INODE.
    May be called at most once per inode opener. */
 void inode_deny_write(struct inode *inode) {
@@ -357,8 +820,24 @@ static bool inode_allocate(struct inode_disk *disk_inode) {
   return inode_reserve(disk_inode, disk_inode->length);
 }
 
+/* Returns whether the contents of INODE are metadata, written through
+   the journal: directories, the free map, the reference counts and
+   the content index. */
+static bool inode_journaled(const struct inode *inode) {
+  return inode_disk_journaled(inode->sector, &inode->data);
+}
+
+/* Same as inode_journaled(), for the on-disk inode DISK_INODE at
+   SECTOR. */
+bool inode_disk_journaled(block_sector_t sector,
+                          const struct inode_disk *disk_inode) {
+  return disk_inode->is_dir || sector == FREE_MAP_SECTOR ||
+         sector == super_get()->refcount_sector ||
+         sector == super_get()->index_sector;
+}
+
 static bool inode_reserve_indirect(block_sector_t *p_entry, size_t num_sectors,
-                                   int level) {
+                                   int level, bool meta, bool sparse) {
   static char zeros[BLOCK_SECTOR_SIZE];
 
   // only supports 2-level indirect block scheme as of now
@@ -366,12 +845,15 @@ static bool inode_reserve_indirect(block_sector_t *p_entry, size_t num_sectors,
 
   if (level == 0) {
     // base case : allocate a single sector if necessary and put it into the
-    // block
-    if (*p_entry == 0) {
+    // block; compressed clusters allocate their own
+    if (*p_entry == 0 && !sparse) {
       if (!free_map_allocate(1, p_entry))
         return false;
 
-      buffer_cache_write(*p_entry, zeros);
+      if (meta)
+        buffer_cache_write_meta(*p_entry, zeros);
+      else
+        buffer_cache_write(*p_entry, zeros);
     }
     return true;
   }
@@ -380,7 +862,7 @@ static bool inode_reserve_indirect(block_sector_t *p_entry, size_t num_sectors,
   if (*p_entry == 0) {
     // not yet allocated: allocate it, and fill with zero
     free_map_allocate(1, p_entry);
-    buffer_cache_write(*p_entry, zeros);
+    buffer_cache_write_meta(*p_entry, zeros);
   }
   buffer_cache_read(*p_entry, &indirect_block);
 
@@ -389,22 +871,25 @@ static bool inode_reserve_indirect(block_sector_t *p_entry, size_t num_sectors,
 
   for (i = 0; i < l; ++i) {
     size_t subsize = min(num_sectors, unit);
-    if (!inode_reserve_indirect(&indirect_block.blocks[i], subsize, level - 1))
+    if (!inode_reserve_indirect(&indirect_block.blocks[i], subsize, level - 1,
+                                meta, sparse))
       return false;
     num_sectors -= subsize;
   }
 
   ASSERT(num_sectors == 0);
-  buffer_cache_write(*p_entry, &indirect_block);
+  buffer_cache_write_meta(*p_entry, &indirect_block);
   return true;
 }
 
 /**
  * Extend inode blocks, so that the file can hold at least
- * `length` bytes.
+ * `length` bytes.  Only the indirect blocks are allocated for a
+ * compressed inode.
  */
 static bool inode_reserve(struct inode_disk *disk_inode, offset_t length) {
   static char zeros[BLOCK_SECTOR_SIZE];
+  bool sparse = disk_inode->flags & INODE_COMPRESSED;
   if (length < 0)
     return false;
 
@@ -415,10 +900,13 @@ static bool inode_reserve(struct inode_disk *disk_inode, offset_t length) {
   // (1) direct blocks
   l = min(num_sectors, DIRECT_BLOCKS_COUNT * 1);
   for (i = 0; i < l; ++i) {
-    if (disk_inode->direct_blocks[i] == 0) { // unoccupied
+    if (disk_inode->direct_blocks[i] == 0 && !sparse) { // unoccupied
       if (!free_map_allocate(1, &disk_inode->direct_blocks[i]))
         return false;
-      buffer_cache_write(disk_inode->direct_blocks[i], zeros);
+      if (disk_inode->is_dir)
+        buffer_cache_write_meta(disk_inode->direct_blocks[i], zeros);
+      else
+        buffer_cache_write(disk_inode->direct_blocks[i], zeros);
     }
   }
   num_sectors -= l;
@@ -427,7 +915,8 @@ static bool inode_reserve(struct inode_disk *disk_inode, offset_t length) {
 
   // (2) a single indirect block
   l = min(num_sectors, 1 * INDIRECT_BLOCKS_PER_SECTOR);
-  if (!inode_reserve_indirect(&disk_inode->indirect_block, l, 1))
+  if (!inode_reserve_indirect(&disk_inode->indirect_block, l, 1,
+                              disk_inode->is_dir, sparse))
     return false;
   num_sectors -= l;
   if (num_sectors == 0)
@@ -436,7 +925,8 @@ static bool inode_reserve(struct inode_disk *disk_inode, offset_t length) {
   // (3) a single doubly indirect block
   l = min(num_sectors,
           1 * INDIRECT_BLOCKS_PER_SECTOR * INDIRECT_BLOCKS_PER_SECTOR);
-  if (!inode_reserve_indirect(&disk_inode->doubly_indirect_block, l, 2))
+  if (!inode_reserve_indirect(&disk_inode->doubly_indirect_block, l, 2,
+                              disk_inode->is_dir, sparse))
     return false;
   num_sectors -= l;
   if (num_sectors == 0)
@@ -452,7 +942,8 @@ static void inode_deallocate_indirect(block_sector_t entry, size_t num_sectors,
   ASSERT(level <= 2);
 
   if (level == 0) {
-    free_map_release(entry, 1);
+    if (entry != 0) // a compressed cluster's unused slot
+      free_map_release(entry, 1);
     return;
   }
 
@@ -472,8 +963,8 @@ static void inode_deallocate_indirect(block_sector_t entry, size_t num_sectors,
   free_map_release(entry, 1);
 }
 
-static bool inode_deallocate(struct inode *inode) {
-  offset_t file_length = inode->data.length; // bytes
+static bool inode_deallocate(const struct inode_disk *disk_inode) {
+  offset_t file_length = disk_inode->length; // bytes
   if (file_length < 0)
     return false;
 
@@ -484,14 +975,15 @@ static bool inode_deallocate(struct inode *inode) {
   // (1) direct blocks
   l = min(num_sectors, DIRECT_BLOCKS_COUNT * 1);
   for (i = 0; i < l; ++i) {
-    free_map_release(inode->data.direct_blocks[i], 1);
+    if (disk_inode->direct_blocks[i] != 0)
+      free_map_release(disk_inode->direct_blocks[i], 1);
   }
   num_sectors -= l;
 
   // (2) a single indirect block
   l = min(num_sectors, 1 * INDIRECT_BLOCKS_PER_SECTOR);
   if (l > 0) {
-    inode_deallocate_indirect(inode->data.indirect_block, l, 1);
+    inode_deallocate_indirect(disk_inode->indirect_block, l, 1);
     num_sectors -= l;
   }
 
@@ -499,7 +991,7 @@ static bool inode_deallocate(struct inode *inode) {
   l = min(num_sectors,
           1 * INDIRECT_BLOCKS_PER_SECTOR * INDIRECT_BLOCKS_PER_SECTOR);
   if (l > 0) {
-    inode_deallocate_indirect(inode->data.doubly_indirect_block, l, 2);
+    inode_deallocate_indirect(disk_inode->doubly_indirect_block, l, 2);
     num_sectors -= l;
   }
 
@@ -507,35 +999,133 @@ static bool inode_deallocate(struct inode *inode) {
   return true;
 }
 
+/* Points the first NUM_SECTORS data entries below the indirect block
+   ENTRY (of the given LEVEL) at SECTORS. */
+static void inode_relocate_indirect(block_sector_t entry,
+                                    const block_sector_t *sectors,
+                                    size_t num_sectors, int level) {
+  struct inode_indirect_block_sector indirect_block;
+  size_t unit = (level == 1 ? 1 : INDIRECT_BLOCKS_PER_SECTOR);
+  size_t i, l = DIV_ROUND_UP(num_sectors, unit);
+
+  ASSERT(level == 1 || level == 2);
+
+  buffer_cache_read(entry, &indirect_block);
+  for (i = 0; i < l; ++i) {
+    size_t subsize = min(num_sectors, unit);
+    if (level == 1)
+      indirect_block.blocks[i] = sectors[i];
+    else
+      inode_relocate_indirect(indirect_block.blocks[i], sectors + i * unit,
+                              subsize, level - 1);
+    num_sectors -= subsize;
+  }
+  if (level == 1) {
+    buffer_cache_write_meta(entry, &indirect_block);
+    buffer_cache_write_back(entry);
+  }
+}
+
+/* Moves data sectors FIRST to FIRST + CNT - 1 of INODE into
+   NEW_SECTORS, which must hold CNT allocated, otherwise unused
+   sectors.  Indirect blocks stay where they are.
+
+   The data is copied first, then the block pointers are switched
+   over and written back, and only then are the old sectors
+   released.  A crash at any point therefore leaves every pointer
+   at a sector with the right content, at worst leaking sectors.
+   With the journal on, the pointers and the release commit in the
+   same transaction instead.
+   Returns false, with nothing changed, if the range is not within
+   the file or memory runs out. */
+bool inode_relocate(struct inode *inode, size_t first, size_t cnt,
+                    const block_sector_t *new_sectors) {
+  size_t num_sectors = bytes_to_sectors(inode->data.length);
+  block_sector_t *sectors, *old_sectors;
+  uint8_t *buffer;
+  size_t i, l;
+
+  if (first + cnt > num_sectors)
+    return false;
+  sectors = get_inode_data_sectors(inode);
+  old_sectors = malloc(cnt * sizeof *old_sectors + 1);
+  buffer = malloc(BLOCK_SECTOR_SIZE);
+  if (sectors == NULL || old_sectors == NULL || buffer == NULL) {
+    free(sectors);
+    free(old_sectors);
+    free(buffer);
+    return false;
+  }
+
+  // (1) copy the data, straight to disk
+  for (i = 0; i < cnt; ++i) {
+    old_sectors[i] = sectors[first + i];
+    sectors[first + i] = new_sectors[i];
+    buffer_cache_read_nofill(old_sectors[i], buffer);
+    buffer_cache_write_nofill(new_sectors[i], buffer);
+  }
+
+  // (2) switch the pointers: direct, indirect, doubly indirect blocks
+  l = min(num_sectors, DIRECT_BLOCKS_COUNT * 1);
+  for (i = 0; i < l; ++i)
+    inode->data.direct_blocks[i] = sectors[i];
+  if (num_sectors > l && first + cnt > l)
+    inode_relocate_indirect(inode->data.indirect_block, sectors + l,
+                            min(num_sectors - l, INDIRECT_BLOCKS_PER_SECTOR),
+                            1);
+  l += INDIRECT_BLOCKS_PER_SECTOR;
+  if (num_sectors > l && first + cnt > l)
+    inode_relocate_indirect(inode->data.doubly_indirect_block, sectors + l,
+                            num_sectors - l, 2);
+  buffer_cache_write_meta(inode->sector, &inode->data);
+  buffer_cache_write_back(inode->sector);
+
+  // (3) release the old data sectors
+  free_map_begin_batch();
+  for (i = 0; i < cnt; ++i)
+    free_map_release(old_sectors[i], 1);
+  free_map_end_batch();
+
+  free(sectors);
+  free(old_sectors);
+  free(buffer);
+  return true;
+}
+
 block_sector_t *get_inode_data_sectors(struct inode *inode) {
-  offset_t file_length = inode->data.length; // bytes
+  return inode_disk_data_sectors(&inode->data);
+}
+
+/* Returns a malloc'd array of the data sectors of DISK_INODE, in
+   file order; the caller frees it.  Returns NULL if the length is
+   invalid or memory runs out. */
+block_sector_t *inode_disk_data_sectors(const struct inode_disk *disk_inode) {
+  offset_t file_length = disk_inode->length; // bytes
   if (file_length < 0)
-    return false;
+    return NULL;
 
   // (remaining) number of sectors, occupied by this file.
   size_t num_sectors = bytes_to_sectors(file_length);
   size_t i, l;
 
   size_t cur_i = 0;
-  block_sector_t *sectors = malloc(num_sectors * sizeof(block_sector_t));
+  block_sector_t *sectors = malloc(num_sectors * sizeof(block_sector_t) + 1);
+  if (sectors == NULL)
+    return NULL;
   // (1) direct blocks
   l = min(num_sectors, DIRECT_BLOCKS_COUNT * 1);
-  // printf("direct blocks: %d\n", l);
   for (i = 0; i < l; ++i) {
-    sectors[cur_i] = inode->data.direct_blocks[i];
+    sectors[cur_i] = disk_inode->direct_blocks[i];
     cur_i += 1;
   }
   num_sectors -= l;
 
   // (2) a single indirect block
   l = min(num_sectors, 1 * INDIRECT_BLOCKS_PER_SECTOR);
-  // printf("indirect blocks: %d\n", l);
   if (l > 0) {
     struct inode_indirect_block_sector indirect_block;
-    buffer_cache_read(inode->data.indirect_block, &indirect_block);
-    size_t unit = 1;
-    size_t i, l2 = DIV_ROUND_UP(l, unit);
-    for (i = 0; i < l2; ++i) {
+    buffer_cache_read(disk_inode->indirect_block, &indirect_block);
+    for (i = 0; i < l; ++i) {
       sectors[cur_i] = indirect_block.blocks[i];
       cur_i += 1;
     }
@@ -545,13 +1135,12 @@ block_sector_t *get_inode_data_sectors(struct inode *inode) {
   // (3) a single doubly indirect block
   l = min(num_sectors,
           1 * INDIRECT_BLOCKS_PER_SECTOR * INDIRECT_BLOCKS_PER_SECTOR);
-  // printf("doubly indirect blocks: %d\n", l);
   if (l > 0) {
     struct inode_indirect_block_sector indirect_block;
-    buffer_cache_read(inode->data.doubly_indirect_block, &indirect_block);
+    buffer_cache_read(disk_inode->doubly_indirect_block, &indirect_block);
 
     size_t unit = INDIRECT_BLOCKS_PER_SECTOR;
-    size_t i, l2 = DIV_ROUND_UP(l, unit);
+    size_t l2 = DIV_ROUND_UP(l, unit);
 
     size_t num_sectors2 = l;
     for (i = 0; i < l2; ++i) {
@@ -560,10 +1149,8 @@ block_sector_t *get_inode_data_sectors(struct inode *inode) {
       struct inode_indirect_block_sector indirect_block2;
       buffer_cache_read(indirect_block.blocks[i], &indirect_block2);
 
-      size_t unit2 = 1;
-      size_t i2, l3 = DIV_ROUND_UP(subsize, unit2);
-
-      for (i2 = 0; i2 < l3; ++i2) {
+      size_t i2;
+      for (i2 = 0; i2 < subsize; ++i2) {
         sectors[cur_i] = indirect_block2.blocks[i2];
         cur_i += 1;
       }
@@ -577,3 +1164,56 @@ block_sector_t *get_inode_data_sectors(struct inode *inode) {
   ASSERT(num_sectors == 0);
   return sectors;
 }
+
+/* Copies the on-disk inode at SECTOR into *DISK_INODE without
+   opening it.  An inode that is in memory is copied from there, so
+   the result is never staler than what inode_open() would return. */
+void inode_read_disk(block_sector_t sector, struct inode_disk *disk_inode) {
+  pthread_mutex_lock(&inode_table_lock);
+  struct inode *inode = inode_lookup(sector);
+
+  if (inode != NULL)
+    *disk_inode = inode->data;
+  else
+    buffer_cache_read(sector, disk_inode);
+  pthread_mutex_unlock(&inode_table_lock);
+}
+
+/* Stores in *SECTORS a malloc'd array of the inodes that are removed
+   but still open, and returns their number.  Their blocks stay
+   allocated until the last close, although no directory names them. */
+size_t inode_removed_open(block_sector_t **sectors) {
+  size_t cnt = 0, cap = 0, i;
+  struct list_elem *e;
+
+  *sectors = NULL;
+  pthread_mutex_lock(&inode_table_lock);
+  for (i = 0; i < INODE_HASH_BUCKETS; i++)
+    for (e = list_begin(&open_inodes[i]); e != list_end(&open_inodes[i]);
+         e = list_next(e)) {
+      struct inode *inode = list_entry(e, struct inode, elem);
+      if (!inode->removed || inode->open_cnt == 0)
+        continue;
+      if (cnt == cap) {
+        size_t new_cap = cap * 2 + 8;
+        block_sector_t *grown = realloc(*sectors, new_cap * sizeof **sectors);
+        if (grown == NULL)
+          break;
+        *sectors = grown;
+        cap = new_cap;
+      }
+      (*sectors)[cnt++] = inode->sector;
+    }
+  pthread_mutex_unlock(&inode_table_lock);
+  return cnt;
+}
+
+/* Forgets every closed inode kept for reuse, e.g. because their
+   sectors were rewritten underneath them. */
+void inode_drop_closed(void) {
+  pthread_mutex_lock(&inode_table_lock);
+  while (!list_empty(&closed_inodes))
+    inode_evict(list_entry(list_front(&closed_inodes), struct inode,
+                           lru_elem));
+  pthread_mutex_unlock(&inode_table_lock);
+}
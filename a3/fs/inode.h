@@ -5,6 +5,7 @@
 #include "list.h"
 #include "off_t.h"
 #include <stdbool.h>
+#include <stdint.h>
 
 /* Identifies an inode. */
 #define INODE_MAGIC 0x494e4f44
@@ -12,10 +13,24 @@
 #define DIRECT_BLOCKS_COUNT 123
 #define INDIRECT_BLOCKS_PER_SECTOR 128
 
+/* inode_disk flags. */
+#define INODE_COMPRESSED 0x01 /* Data is stored in compressed clusters. */
+
+/* Data sectors per compression cluster. */
+#define INODE_CLUSTER_SECTORS 8
+
 struct bitmap;
 
 /* On-disk inode.
-   Must be exactly BLOCK_SECTOR_SIZE bytes long. */
+   Must be exactly BLOCK_SECTOR_SIZE bytes long.
+
+   The data of a compressed inode is kept in clusters of
+   INODE_CLUSTER_SECTORS sectors, each at its usual place in the
+   block map, so that any cluster can be found directly.  A cluster
+   uses only the first slots it needs, and the rest are 0: all of
+   them if it is stored as is, fewer if it is compressed, and none if
+   it is all zeros.  A compressed cluster starts with the 16-bit
+   length of the compressed bytes that follow. */
 struct inode_disk {
   /** Data sectors */
   block_sector_t direct_blocks[DIRECT_BLOCKS_COUNT];
@@ -23,17 +38,20 @@ struct inode_disk {
   block_sector_t doubly_indirect_block;
 
   bool is_dir;
+  uint8_t flags;   /* INODE_* flags. */
   offset_t length; /* File size in bytes. */
   unsigned magic;  /* Magic number. */
 };
 
 /* In-memory inode. */
 struct inode {
-  struct list_elem elem;  /* Element in inode list. */
+  struct list_elem elem;  /* Element in inode hash bucket. */
+  struct list_elem lru_elem; /* Element in closed inode list. */
   block_sector_t sector;  /* Sector number of disk location. */
   int open_cnt;           /* Number of openers. */
   bool removed;           /* True if deleted, false otherwise. */
   int deny_write_cnt;     /* 0: writes ok, >0: deny writes. */
+  offset_t dir_free_ofs;  /* Linear directories: no free slot below. */
   struct inode_disk data; /* Inode content. */
 };
 
@@ -52,8 +70,19 @@ void inode_allow_write(struct inode *);
 offset_t inode_length(const struct inode *);
 bool inode_is_directory(const struct inode *);
 bool inode_is_removed(const struct inode *);
+bool inode_is_compressed(const struct inode *);
+bool inode_set_compressed(struct inode *, bool);
+bool inode_clone(struct inode *, block_sector_t);
+size_t inode_data_sectors_used(struct inode *);
 size_t bytes_to_sectors(offset_t size);
 
 block_sector_t *get_inode_data_sectors(struct inode *);
+block_sector_t *inode_disk_data_sectors(const struct inode_disk *);
+void inode_read_disk(block_sector_t, struct inode_disk *);
+bool inode_disk_journaled(block_sector_t, const struct inode_disk *);
+size_t inode_removed_open(block_sector_t **sectors);
+void inode_drop_closed(void);
+bool inode_relocate(struct inode *, size_t first, size_t cnt,
+                    const block_sector_t *new_sectors);
 
 #endif /* fs/inode.h */
@@ -0,0 +1,557 @@
+#include "journal.h"
+#include "cache.h"
+#include "checksum.h"
+#include "debug.h"
+#include "filesys.h"
+#include "free-map.h"
+#include "round.h"
+#include "super.h"
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+/* Identifies a journal header. */
+#define JOURNAL_MAGIC 0x4c4e524a
+
+/* A group is committed at the end of a transaction once it holds
+   this many transactions, half of the journal, or changes this many
+   milliseconds old.  A background thread commits a group that gets
+   that old while no transaction ends, e.g. while the shell waits for
+   input. */
+#define JOURNAL_GROUP_TXNS 16
+#define JOURNAL_GROUP_MS 50
+
+/* Sector numbers held by the header, and by each descriptor. */
+#define JOURNAL_HEADER_SECTORS 123
+#define JOURNAL_DESC_SECTORS (BLOCK_SECTOR_SIZE / sizeof(block_sector_t))
+
+/* Header of the journal region, in its first sector.  A nonzero CNT
+   means a commit reached the journal and may not have reached home:
+   the copies of the CNT sectors it names follow the descriptors.
+   The first JOURNAL_HEADER_SECTORS sector numbers are in SECTORS,
+   the rest in the descriptors right after the header. */
+struct journal_header {
+  uint32_t magic;    /* JOURNAL_MAGIC. */
+  uint32_t seq;      /* Number of this commit. */
+  uint32_t cnt;      /* Sectors to replay, or 0. */
+  uint32_t checksum; /* Of the sector numbers and the copies. */
+  block_sector_t sectors[JOURNAL_HEADER_SECTORS];
+  uint32_t size;     /* Sectors in the region, 0 for the minimum. */
+};
+
+/* Journal state.  LOCK guards it all; it may be taken with the cache
+   lock held, so nothing here calls into the cache with LOCK held. */
+static struct {
+  pthread_mutex_t lock;
+  block_sector_t start; /* First sector of the region, or 0 if off. */
+  size_t size;          /* Sectors in the region. */
+  size_t cap;           /* Sectors the running group can hold. */
+  uint32_t seq;         /* Number of the next commit. */
+
+  /* The running group: each sector changed since the last commit,
+     with its latest contents.  Slots below TXN_FIRST were first
+     changed by transactions that have ended; when the running
+     transaction changes one of them, SAVED marks it and BEFORE keeps
+     its contents as those transactions left them, so that they can
+     be committed without it. */
+  block_sector_t *sectors;
+  uint8_t (*copies)[BLOCK_SECTOR_SIZE];
+  uint8_t (*before)[BLOCK_SECTOR_SIZE];
+  bool *saved;
+  size_t cnt;
+  size_t txn_first;
+  bool txn_oversized; /* The running transaction was committed in parts. */
+  size_t group_txns;          /* Transactions ended in the group. */
+  struct timespec group_time; /* When the group's first change came. */
+
+  /* The thread committing groups that get old, and what wakes it. */
+  pthread_t flusher;
+  bool flusher_running;
+  bool flusher_stop;
+  pthread_cond_t wakeup;
+
+  struct journal_stats stats;
+} j = {.lock = PTHREAD_MUTEX_INITIALIZER};
+
+/* Returns the number of descriptors needed to name CNT sectors. */
+static size_t journal_descs(size_t cnt) {
+  return cnt <= JOURNAL_HEADER_SECTORS
+             ? 0
+             : DIV_ROUND_UP(cnt - JOURNAL_HEADER_SECTORS, JOURNAL_DESC_SECTORS);
+}
+
+/* Returns how many sectors one commit can hold in a region of SIZE
+   sectors. */
+static size_t journal_capacity(size_t size) {
+  size_t cap = size - 1;
+  while (1 + journal_descs(cap) + cap > size)
+    cap--;
+  return cap;
+}
+
+/* Returns the sector of the copy in slot I of the region. */
+static block_sector_t journal_copy_sector(size_t i) {
+  return j.start + 1 + journal_descs(j.cap) + i;
+}
+
+/* Sets up the running group for a region of SIZE sectors.  Returns
+   false if memory runs out. */
+static bool journal_alloc(size_t size) {
+  size_t cap = journal_capacity(size);
+  block_sector_t *sectors = malloc(cap * sizeof *sectors);
+  uint8_t(*copies)[BLOCK_SECTOR_SIZE] = malloc(cap * BLOCK_SECTOR_SIZE);
+  uint8_t(*before)[BLOCK_SECTOR_SIZE] = malloc(cap * BLOCK_SECTOR_SIZE);
+  bool *saved = calloc(cap, sizeof *saved);
+
+  if (sectors == NULL || copies == NULL || before == NULL || saved == NULL) {
+    free(sectors);
+    free(copies);
+    free(before);
+    free(saved);
+    return false;
+  }
+  free(j.sectors);
+  free(j.copies);
+  free(j.before);
+  free(j.saved);
+  j.sectors = sectors;
+  j.copies = copies;
+  j.before = before;
+  j.saved = saved;
+  j.size = size;
+  j.cap = cap;
+  j.cnt = 0;
+  j.txn_first = 0;
+  return true;
+}
+
+/* Returns the CRC32C of the CNT sector numbers in SECTORS and their
+   CNT copies. */
+static uint32_t journal_checksum(const block_sector_t *sectors,
+                                 uint8_t copies[][BLOCK_SECTOR_SIZE],
+                                 size_t cnt) {
+  return crc32c(crc32c(0, sectors, cnt * sizeof *sectors), copies,
+                cnt * BLOCK_SECTOR_SIZE);
+}
+
+/* Writes DATA to SECTOR, bypassing the cache. */
+static void journal_write(block_sector_t sector, const void *data) {
+  checksum_update(sector, data);
+  block_write(fs_device, sector, data);
+}
+
+/* Returns the slot of SECTOR in the running group, or -1. */
+static int journal_find(block_sector_t sector) {
+  size_t i;
+  for (i = 0; i < j.cnt; i++)
+    if (j.sectors[i] == sector)
+      return i;
+  return -1;
+}
+
+/* Writes a commit of the first CNT sectors of the running group,
+   taking the contents of a slot from BEFORE instead if USE_BEFORE
+   and it is saved. */
+static void journal_write_commit(size_t cnt, bool use_before) {
+  struct journal_header h;
+  uint32_t checksum;
+  size_t i;
+
+  // (1) the copies and descriptors, then the header that makes them count
+  checksum = crc32c(0, j.sectors, cnt * sizeof *j.sectors);
+  for (i = 0; i < cnt; i++) {
+    const uint8_t *data =
+        use_before && j.saved[i] ? j.before[i] : j.copies[i];
+    journal_write(journal_copy_sector(i), data);
+    checksum = crc32c(checksum, data, BLOCK_SECTOR_SIZE);
+  }
+  for (i = 0; i < journal_descs(cnt); i++) {
+    block_sector_t desc[JOURNAL_DESC_SECTORS] = {0};
+    size_t first = JOURNAL_HEADER_SECTORS + i * JOURNAL_DESC_SECTORS;
+    size_t n = cnt - first < JOURNAL_DESC_SECTORS ? cnt - first
+                                                  : JOURNAL_DESC_SECTORS;
+    memcpy(desc, j.sectors + first, n * sizeof *desc);
+    journal_write(j.start + 1 + i, desc);
+  }
+  memset(&h, 0, sizeof h);
+  h.magic = JOURNAL_MAGIC;
+  h.seq = j.seq;
+  h.cnt = cnt;
+  memcpy(h.sectors, j.sectors,
+         (cnt < JOURNAL_HEADER_SECTORS ? cnt : JOURNAL_HEADER_SECTORS) *
+             sizeof *j.sectors);
+  h.checksum = checksum;
+  h.size = j.size;
+  journal_write(j.start, &h);
+
+  // (2) home, then the header cleared so there is nothing to replay
+  for (i = 0; i < cnt; i++)
+    journal_write(j.sectors[i],
+                  use_before && j.saved[i] ? j.before[i] : j.copies[i]);
+  h.cnt = 0;
+  journal_write(j.start, &h);
+
+  j.stats.commits++;
+  j.stats.txns += j.group_txns;
+  j.stats.sectors += cnt;
+  j.seq++;
+  j.group_txns = 0;
+}
+
+/* Commits the running group.  Must be called with LOCK held. */
+static void journal_commit_locked(void) {
+  if (j.start == 0)
+    return;
+  if (j.cnt > 0) {
+    journal_write_commit(j.cnt, false);
+    j.cnt = 0;
+    j.txn_first = 0;
+    memset(j.saved, 0, j.cap * sizeof *j.saved);
+  }
+  // what dropped the sectors freed so far was logged before, so it is
+  // on disk now
+  free_map_committed(true);
+}
+
+/* Commits the transactions of the running group that have ended,
+   leaving only the changes of the running transaction in it.  Must
+   be called with LOCK held. */
+static void journal_commit_ended_locked(void) {
+  size_t i, kept = 0;
+
+  if (j.start == 0 || j.txn_first == 0)
+    return;
+  journal_write_commit(j.txn_first, true);
+
+  // what the running transaction changed stays, with its contents
+  for (i = 0; i < j.cnt; i++)
+    if (i >= j.txn_first || j.saved[i]) {
+      if (kept != i) {
+        j.sectors[kept] = j.sectors[i];
+        memcpy(j.copies[kept], j.copies[i], BLOCK_SECTOR_SIZE);
+      }
+      kept++;
+    }
+  j.cnt = kept;
+  j.txn_first = 0;
+  memset(j.saved, 0, j.cap * sizeof *j.saved);
+  clock_gettime(CLOCK_MONOTONIC, &j.group_time);
+  free_map_committed(false);
+}
+
+/* Commits the running group once it is JOURNAL_GROUP_MS old, as far
+   as its transactions have ended, until told to stop. */
+static void *journal_flusher(void *aux UNUSED) {
+  pthread_mutex_lock(&j.lock);
+  while (!j.flusher_stop) {
+    struct timespec due = j.group_time, now;
+
+    if (j.start == 0 || j.txn_first == 0) {
+      // nothing that has ended to commit
+      pthread_cond_wait(&j.wakeup, &j.lock);
+      continue;
+    }
+    due.tv_sec += JOURNAL_GROUP_MS / 1000;
+    due.tv_nsec += (JOURNAL_GROUP_MS % 1000) * 1000000L;
+    if (due.tv_nsec >= 1000000000L) {
+      due.tv_sec++;
+      due.tv_nsec -= 1000000000L;
+    }
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    if (now.tv_sec > due.tv_sec ||
+        (now.tv_sec == due.tv_sec && now.tv_nsec >= due.tv_nsec))
+      journal_commit_ended_locked();
+    else
+      pthread_cond_timedwait(&j.wakeup, &j.lock, &due);
+  }
+  pthread_mutex_unlock(&j.lock);
+  return NULL;
+}
+
+/* Starts the flusher, if it is not running.  Without it, a group is
+   only committed when a transaction ends. */
+static void journal_flusher_start(void) {
+  static bool cond_ready;
+
+  if (!cond_ready) {
+    pthread_condattr_t attr;
+    pthread_condattr_init(&attr);
+    pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+    pthread_cond_init(&j.wakeup, &attr);
+    pthread_condattr_destroy(&attr);
+    cond_ready = true;
+  }
+  if (j.flusher_running)
+    return;
+  j.flusher_stop = false;
+  j.flusher_running =
+      pthread_create(&j.flusher, NULL, journal_flusher, NULL) == 0;
+}
+
+/* Stops the flusher, if it is running. */
+static void journal_flusher_stop(void) {
+  if (!j.flusher_running)
+    return;
+  pthread_mutex_lock(&j.lock);
+  j.flusher_stop = true;
+  pthread_cond_signal(&j.wakeup);
+  pthread_mutex_unlock(&j.lock);
+  pthread_join(j.flusher, NULL);
+  j.flusher_running = false;
+}
+
+/* Finds the journal of the mounted file system, if it has one, and
+   replays the last commit if it did not reach home.  Returns the
+   number of sectors replayed; they are written through the cache,
+   but anything else that read them before must be reread. */
+size_t journal_init(void) {
+  struct super_block *sb = super_get();
+  struct journal_header h;
+  size_t i, size;
+
+  ASSERT(sizeof h == BLOCK_SECTOR_SIZE);
+
+  j.start = 0;
+  j.group_txns = 0;
+  j.txn_oversized = false;
+  memset(&j.stats, 0, sizeof j.stats);
+  if (super_location() == 0 || sb->journal_sector == 0)
+    return 0;
+
+  block_read(fs_device, sb->journal_sector, &h);
+  size = h.size != 0 ? h.size : JOURNAL_MIN_SECTORS;
+  if (h.magic != JOURNAL_MAGIC || size < JOURNAL_MIN_SECTORS ||
+      size > JOURNAL_MAX_SECTORS)
+    return 0;
+  if (!journal_alloc(size))
+    PANIC("journal allocation failed");
+  j.start = sb->journal_sector;
+  j.seq = h.seq + 1;
+  if (h.cnt > 0 && h.cnt <= j.cap) {
+    for (i = 0; i < h.cnt && i < JOURNAL_HEADER_SECTORS; i++)
+      j.sectors[i] = h.sectors[i];
+    for (i = 0; i < journal_descs(h.cnt); i++) {
+      block_sector_t desc[JOURNAL_DESC_SECTORS];
+      size_t first = JOURNAL_HEADER_SECTORS + i * JOURNAL_DESC_SECTORS;
+      block_read(fs_device, j.start + 1 + i, desc);
+      memcpy(j.sectors + first, desc,
+             (h.cnt - first < JOURNAL_DESC_SECTORS ? h.cnt - first
+                                                   : JOURNAL_DESC_SECTORS) *
+                 sizeof *desc);
+    }
+    for (i = 0; i < h.cnt; i++)
+      block_read(fs_device, journal_copy_sector(i), j.copies[i]);
+    // a torn commit never got to write anything home
+    if (h.checksum == journal_checksum(j.sectors, j.copies, h.cnt)) {
+      // with the journal off meanwhile, so that they go home
+      j.start = 0;
+      for (i = 0; i < h.cnt; i++)
+        buffer_cache_write(j.sectors[i], j.copies[i]);
+      buffer_cache_sync();
+      j.start = sb->journal_sector;
+      j.stats.replayed = h.cnt;
+    }
+  }
+  h.cnt = 0;
+  h.size = j.size;
+  journal_write(j.start, &h);
+  journal_flusher_start();
+  return j.stats.replayed;
+}
+
+/* Commits what is left, at unmount. */
+void journal_done(void) {
+  journal_flusher_stop();
+  journal_commit();
+}
+
+bool journal_enabled(void) { return j.start != 0; }
+
+/* Creates a journal region of SIZE sectors, or if SIZE is 0, of an
+   eighth of the disk within JOURNAL_MIN_SECTORS and
+   JOURNAL_MAX_SECTORS.  Returns false if SIZE is out of those
+   bounds, the image cannot hold a superblock, or the disk is full. */
+bool journal_enable(size_t size) {
+  struct super_block *sb = super_get();
+  struct journal_header h;
+  block_sector_t start;
+
+  if (j.start != 0)
+    return true;
+  if (size == 0) {
+    size = block_size(fs_device) / 8;
+    if (size < JOURNAL_MIN_SECTORS)
+      size = JOURNAL_MIN_SECTORS;
+    if (size > JOURNAL_MAX_SECTORS)
+      size = JOURNAL_MAX_SECTORS;
+  }
+  if (size < JOURNAL_MIN_SECTORS || size > JOURNAL_MAX_SECTORS ||
+      !super_supported() || !journal_alloc(size))
+    return false;
+  if (!free_map_allocate(size, &start))
+    return false;
+
+  memset(&h, 0, sizeof h);
+  h.magic = JOURNAL_MAGIC;
+  h.seq = j.seq;
+  h.size = size;
+  journal_write(start, &h);
+  sb->journal_sector = start;
+  if (!super_write()) {
+    sb->journal_sector = 0;
+    free_map_release(start, size);
+    return false;
+  }
+  // the journal only protects what comes after it is on disk
+  buffer_cache_sync();
+
+  pthread_mutex_lock(&j.lock);
+  j.start = start;
+  pthread_mutex_unlock(&j.lock);
+  journal_flusher_start();
+  return true;
+}
+
+/* Commits the running group and deletes the journal region. */
+void journal_disable(void) {
+  struct super_block *sb = super_get();
+  block_sector_t start = j.start;
+
+  if (start == 0)
+    return;
+  journal_flusher_stop();
+  pthread_mutex_lock(&j.lock);
+  journal_commit_locked();
+  j.start = 0;
+  pthread_mutex_unlock(&j.lock);
+
+  sb->journal_sector = 0;
+  super_write();
+  free_map_release(start, j.size);
+  buffer_cache_sync();
+}
+
+void journal_stats(struct journal_stats *st) {
+  pthread_mutex_lock(&j.lock);
+  *st = j.stats;
+  st->start = j.start;
+  st->size = j.start != 0 ? j.size : 0;
+  st->capacity = j.start != 0 ? j.cap : 0;
+  pthread_mutex_unlock(&j.lock);
+}
+
+/* Ends a transaction, committing the group if it is due. */
+void journal_end(void) {
+  struct timespec now;
+  long ms;
+
+  pthread_mutex_lock(&j.lock);
+  free_map_end_txn();
+  if (j.cnt > 0) {
+    j.group_txns++;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    ms = (now.tv_sec - j.group_time.tv_sec) * 1000 +
+         (now.tv_nsec - j.group_time.tv_nsec) / 1000000;
+    if (j.group_txns >= JOURNAL_GROUP_TXNS ||
+        j.cnt >= j.cap / 2 || ms >= JOURNAL_GROUP_MS)
+      journal_commit_locked();
+  }
+  // the next transaction starts here
+  j.txn_first = j.cnt;
+  j.txn_oversized = false;
+  if (j.saved != NULL)
+    memset(j.saved, 0, j.cap * sizeof *j.saved);
+  if (j.cnt > 0)
+    pthread_cond_signal(&j.wakeup);
+  pthread_mutex_unlock(&j.lock);
+}
+
+/* Commits the running group now, e.g. before the disk is read
+   around the cache. */
+void journal_commit(void) {
+  pthread_mutex_lock(&j.lock);
+  journal_commit_locked();
+  pthread_mutex_unlock(&j.lock);
+}
+
+/* Records DATA as the new contents of metadata sector SECTOR in the
+   running group.  Returns false, recording nothing, if the journal
+   is off; the caller then writes SECTOR home as usual.
+
+   If the group is full, the transactions that have ended are
+   committed first, so that the running one is never split.  Only a
+   transaction that changes more sectors than the journal holds is
+   committed in parts: that is reported, as it is then not atomic,
+   and journal_stats() counts it. */
+bool journal_log(block_sector_t sector, const void *data) {
+  int slot;
+
+  pthread_mutex_lock(&j.lock);
+  if (j.start == 0) {
+    pthread_mutex_unlock(&j.lock);
+    return false;
+  }
+  slot = journal_find(sector);
+  if (slot < 0 && j.cnt == j.cap) {
+    journal_commit_ended_locked();
+    if (j.cnt == j.cap) {
+      if (!j.txn_oversized) {
+        printf("Warning: a command changes more than the %zu sectors the "
+               "journal holds; it is committed in parts\n",
+               j.cap);
+        j.stats.oversized++;
+        j.txn_oversized = true;
+      }
+      journal_commit_locked();
+    }
+  }
+  if (slot < 0) {
+    if (j.cnt == 0)
+      clock_gettime(CLOCK_MONOTONIC, &j.group_time);
+    slot = j.cnt++;
+    j.sectors[slot] = sector;
+  } else if ((size_t)slot < j.txn_first && !j.saved[slot]) {
+    memcpy(j.before[slot], j.copies[slot], BLOCK_SECTOR_SIZE);
+    j.saved[slot] = true;
+  }
+  memcpy(j.copies[slot], data, BLOCK_SECTOR_SIZE);
+  pthread_mutex_unlock(&j.lock);
+  return true;
+}
+
+/* Copies the contents the running group holds for SECTOR into DATA.
+   Returns false if it holds none, so the disk is current. */
+bool journal_lookup(block_sector_t sector, void *data) {
+  int slot;
+
+  pthread_mutex_lock(&j.lock);
+  slot = journal_find(sector);
+  if (slot >= 0)
+    memcpy(data, j.copies[slot], BLOCK_SECTOR_SIZE);
+  pthread_mutex_unlock(&j.lock);
+  return slot >= 0;
+}
+
+/* Drops SECTOR from the running group because it is being written
+   as plain data, which the commit must not overwrite.  If a
+   transaction that has ended changed it, that transaction is
+   committed first, as it needs the metadata. */
+void journal_revoke(block_sector_t sector) {
+  int slot;
+
+  pthread_mutex_lock(&j.lock);
+  slot = journal_find(sector);
+  if (slot >= 0 && (size_t)slot < j.txn_first) {
+    journal_commit_ended_locked();
+    slot = journal_find(sector);
+  }
+  if (slot >= 0) {
+    j.cnt--;
+    j.sectors[slot] = j.sectors[j.cnt];
+    memcpy(j.copies[slot], j.copies[j.cnt], BLOCK_SECTOR_SIZE);
+  }
+  pthread_mutex_unlock(&j.lock);
+}
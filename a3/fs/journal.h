@@ -0,0 +1,64 @@
+#ifndef FILESYS_JOURNAL_H
+#define FILESYS_JOURNAL_H
+
+#include "block.h"
+#include <stdbool.h>
+#include <stddef.h>
+
+/* Optional write-ahead journal for metadata.
+
+   Metadata sectors (inodes, indirect blocks, and the contents of
+   directories and system files) are written through
+   buffer_cache_write_meta().  With the journal on, such a write goes
+   to the running group of transactions instead of home: the cache
+   keeps the sector clean, and the group holds its latest contents,
+   which reads see until the group commits.  Each shell command (or
+   background step) is one transaction, bracketed by the file system
+   lock.
+
+   A commit writes the group's sectors to the journal region, then a
+   header naming them (the commit point), then the sectors home, then
+   clears the header.  After a crash, filesys_init() replays a header
+   that was written but not cleared, which takes time proportional to
+   the journal, not the disk.  Transactions are grouped, and the group
+   committed once it is large or old enough, so that a script of many
+   small commands pays for a few commits.  If the group fills up in
+   the middle of a transaction, the transactions before it are
+   committed on their own.  A transaction that changes more sectors
+   than the journal holds is committed in parts, which is reported
+   when it happens: it is then not atomic. */
+
+/* Sectors in the journal region: a header, descriptors naming the
+   sectors the header has no room for, and the copies.  Unless told
+   otherwise, "journal on" sizes it to an eighth of the disk within
+   these bounds. */
+#define JOURNAL_MIN_SECTORS 64
+#define JOURNAL_MAX_SECTORS 1024
+
+/* Journal activity since the file system was mounted. */
+struct journal_stats {
+  block_sector_t start;   /* First sector of the region, or 0 if off. */
+  size_t size;            /* Sectors in the region. */
+  size_t capacity;        /* Sectors one commit can hold. */
+  size_t commits;         /* Groups committed. */
+  size_t txns;            /* Transactions in those groups. */
+  size_t sectors;         /* Sectors logged by those commits. */
+  size_t replayed;        /* Sectors replayed at mount. */
+  size_t oversized;       /* Transactions committed in parts. */
+};
+
+size_t journal_init(void);
+void journal_done(void);
+bool journal_enabled(void);
+bool journal_enable(size_t sectors);
+void journal_disable(void);
+void journal_stats(struct journal_stats *);
+
+void journal_end(void);
+void journal_commit(void);
+
+bool journal_log(block_sector_t, const void *);
+bool journal_lookup(block_sector_t, void *);
+void journal_revoke(block_sector_t);
+
+#endif /* fs/journal.h */
@@ -0,0 +1,148 @@
+#include "lz.h"
+#include "debug.h"
+#include <string.h>
+
+/* Shortest match, and how many bytes at the end of the input are
+   always left as literals. */
+#define LZ_MIN_MATCH 4
+#define LZ_LAST_LITERALS 5
+
+/* Entries in the match finder's hash table. */
+#define LZ_HASH_BITS 12
+
+static uint32_t lz_read32(const uint8_t *p) {
+  uint32_t v;
+  memcpy(&v, p, sizeof v);
+  return v;
+}
+
+static uint32_t lz_hash(uint32_t v) {
+  return (v * 2654435761u) >> (32 - LZ_HASH_BITS);
+}
+
+/* Appends the length LEN - 15, as LZ4 does for a nibble that
+   overflowed, to DST at *OP.  Returns false if CAP is reached. */
+static bool lz_put_length(uint8_t *dst, size_t *op, size_t cap, size_t len) {
+  for (; len >= 255; len -= 255) {
+    if (*op >= cap)
+      return false;
+    dst[(*op)++] = 255;
+  }
+  if (*op >= cap)
+    return false;
+  dst[(*op)++] = len;
+  return true;
+}
+
+/* Appends a sequence of LIT_LEN literals at LIT, followed by a match
+   of MATCH_LEN bytes at OFFSET (none if MATCH_LEN is 0). */
+static bool lz_put_sequence(uint8_t *dst, size_t *op, size_t cap,
+                            const uint8_t *lit, size_t lit_len,
+                            size_t offset, size_t match_len) {
+  size_t m = match_len > 0 ? match_len - LZ_MIN_MATCH : 0;
+  uint8_t token = (lit_len < 15 ? lit_len : 15) << 4 | (m < 15 ? m : 15);
+
+  if (*op >= cap)
+    return false;
+  dst[(*op)++] = token;
+  if (lit_len >= 15 && !lz_put_length(dst, op, cap, lit_len - 15))
+    return false;
+  if (*op + lit_len > cap)
+    return false;
+  memcpy(dst + *op, lit, lit_len);
+  *op += lit_len;
+  if (match_len == 0)
+    return true;
+
+  if (*op + 2 > cap)
+    return false;
+  dst[(*op)++] = offset & 0xff;
+  dst[(*op)++] = offset >> 8;
+  return m < 15 || lz_put_length(dst, op, cap, m - 15);
+}
+
+/* Compresses the LEN bytes at SRC into DST, which has room for CAP
+   bytes.  Returns the compressed size, or 0 if it would not fit. */
+size_t lz_compress(const uint8_t *src, size_t len, uint8_t *dst, size_t cap) {
+  uint16_t table[1 << LZ_HASH_BITS]; /* Position + 1, or 0. */
+  size_t anchor = 0, ip = 0, op = 0;
+
+  ASSERT(len <= UINT16_MAX);
+
+  memset(table, 0, sizeof table);
+  while (ip + LZ_MIN_MATCH + LZ_LAST_LITERALS <= len) {
+    uint32_t v = lz_read32(src + ip);
+    uint32_t h = lz_hash(v);
+    size_t cand = table[h], n;
+
+    table[h] = ip + 1;
+    if (cand == 0 || lz_read32(src + cand - 1) != v) {
+      ip++;
+      continue;
+    }
+    cand--;
+
+    n = LZ_MIN_MATCH;
+    while (ip + n < len - LZ_LAST_LITERALS && src[cand + n] == src[ip + n])
+      n++;
+    if (!lz_put_sequence(dst, &op, cap, src + anchor, ip - anchor, ip - cand,
+                         n))
+      return 0;
+    ip += n;
+    anchor = ip;
+  }
+  if (!lz_put_sequence(dst, &op, cap, src + anchor, len - anchor, 0, 0))
+    return 0;
+  return op;
+}
+
+/* Reads a length that overflowed its nibble from SRC at *IP and adds
+   it to *N.  Returns false if SRC ends first. */
+static bool lz_get_length(const uint8_t *src, size_t len, size_t *ip,
+                          size_t *n) {
+  uint8_t b;
+  do {
+    if (*ip >= len)
+      return false;
+    b = src[(*ip)++];
+    *n += b;
+  } while (b == 255);
+  return true;
+}
+
+/* Decompresses the LEN bytes at SRC into exactly DST_LEN bytes at
+   DST.  Returns false if the input is malformed or does not decode
+   to DST_LEN bytes. */
+bool lz_decompress(const uint8_t *src, size_t len, uint8_t *dst,
+                   size_t dst_len) {
+  size_t ip = 0, op = 0;
+
+  while (ip < len) {
+    uint8_t token = src[ip++];
+    size_t lit = token >> 4, n, offset;
+
+    if (lit == 15 && !lz_get_length(src, len, &ip, &lit))
+      return false;
+    if (lit > len - ip || lit > dst_len - op)
+      return false;
+    memcpy(dst + op, src + ip, lit);
+    ip += lit;
+    op += lit;
+    if (ip == len)
+      break; // the last sequence has no match
+
+    if (len - ip < 2)
+      return false;
+    offset = src[ip] | src[ip + 1] << 8;
+    ip += 2;
+    n = (token & 15) + LZ_MIN_MATCH;
+    if ((token & 15) == 15 && !lz_get_length(src, len, &ip, &n))
+      return false;
+    if (offset == 0 || offset > op || n > dst_len - op)
+      return false;
+    // the match may overlap the bytes it produces
+    for (; n > 0; n--, op++)
+      dst[op] = dst[op - offset];
+  }
+  return op == dst_len;
+}
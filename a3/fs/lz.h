@@ -0,0 +1,20 @@
+#ifndef FILESYS_LZ_H
+#define FILESYS_LZ_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+/* A small LZ77 codec for compressed files.
+
+   The format is that of an LZ4 block: a sequence of tokens, each
+   giving a run of literals and then a match of at least 4 bytes
+   within the last 64 kB.  Matches are found with a single hash
+   table, which favours speed over ratio.  Inputs are at most 64 kB,
+   which is plenty for a cluster of sectors. */
+
+size_t lz_compress(const uint8_t *src, size_t len, uint8_t *dst, size_t cap);
+bool lz_decompress(const uint8_t *src, size_t len, uint8_t *dst,
+                   size_t dst_len);
+
+#endif /* fs/lz.h */
@@ -151,5 +151,27 @@ static void partition_write(void *p_, block_sector_t sector,
   block_write(p->block, p->start + sector + 1, buffer);
 }
 
-static struct block_operations partition_operations = {partition_read,
-                                                       partition_write};
+/* Reads the CNT sectors starting at SECTOR from partition P into
+   BUFFER. */
+static void partition_read_run(void *p_, block_sector_t sector, size_t cnt,
+                               void *buffer) {
+  struct partition *p = p_;
+  block_read_run(p->block, p->start + sector + 1, cnt, buffer);
+}
+
+/* Finds the next data of partition P at or after SECTOR. */
+static block_sector_t partition_seek_data(void *p_, block_sector_t sector,
+                                          block_sector_t *data_end) {
+  struct partition *p = p_;
+  block_sector_t base = p->start + 1;
+  block_sector_t data = block_seek_data(p->block, base + sector, data_end);
+
+  // no data left; block_seek_data() clamps to the partition's size
+  if (data >= block_size(p->block))
+    return *data_end = (block_sector_t)-1;
+  *data_end -= base;
+  return data - base;
+}
+
+static struct block_operations partition_operations = {
+    partition_read, partition_write, partition_read_run, partition_seek_data};
@@ -0,0 +1,273 @@
+#include "recover.h"
+#include "bitmap.h"
+#include "cache.h"
+#include "debug.h"
+#include "filesys.h"
+#include "free-map.h"
+#include "round.h"
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+/* Sectors read per request, and the most scanning threads. */
+#define RECOVER_RUN_SECTORS 128
+#define RECOVER_MAX_THREADS 8
+
+/* Returns true if every one of the CNT sector numbers in P lies in
+   the data area [2, DEVICE_SIZE) of the device.  The loop has no
+   branches, so the compiler vectorizes it. */
+static bool recover_pointers_ok(const block_sector_t *p, size_t cnt,
+                                block_sector_t device_size) {
+  uint32_t bad = 0;
+  size_t i;
+  for (i = 0; i < cnt; i++)
+    bad |= (uint32_t)(p[i] - 2) >= device_size - 2;
+  return !bad;
+}
+
+/* Returns true if the CNT sector numbers in P are all zero. */
+static bool recover_pointers_zero(const block_sector_t *p, size_t cnt) {
+  uint32_t any = 0;
+  size_t i;
+  for (i = 0; i < cnt; i++)
+    any |= p[i];
+  return !any;
+}
+
+/* Returns true if D looks like the inode of a deleted regular file:
+   right magic, a length the device could hold, and direct pointers
+   that are in range where the length needs them and zero beyond. */
+static bool recover_plausible(const struct inode_disk *d,
+                              block_sector_t device_size) {
+  size_t sectors, direct;
+
+  if (d->magic != INODE_MAGIC || d->is_dir || d->length < 0 ||
+      (size_t)d->length > (size_t)device_size * BLOCK_SECTOR_SIZE)
+    return false;
+  sectors = bytes_to_sectors(d->length);
+  direct = sectors < DIRECT_BLOCKS_COUNT ? sectors : DIRECT_BLOCKS_COUNT;
+  if (!recover_pointers_ok(d->direct_blocks, direct, device_size) ||
+      !recover_pointers_zero(d->direct_blocks + direct,
+                             DIRECT_BLOCKS_COUNT - direct))
+    return false;
+  if (sectors > DIRECT_BLOCKS_COUNT &&
+      !recover_pointers_ok(&d->indirect_block, 1, device_size))
+    return false;
+  if (sectors > DIRECT_BLOCKS_COUNT + INDIRECT_BLOCKS_PER_SECTOR &&
+      !recover_pointers_ok(&d->doubly_indirect_block, 1, device_size))
+    return false;
+  return true;
+}
+
+/* One thread's share of a scan. */
+struct recover_stripe {
+  block_sector_t start, end;   /* Sectors to scan. */
+  struct recover_inode *found; /* Candidates, in sector order. */
+  size_t found_cnt;
+  bool error;
+};
+
+static void *recover_scan_stripe(void *stripe_) {
+  struct recover_stripe *st = stripe_;
+  block_sector_t device_size = block_size(fs_device);
+  uint8_t *run = malloc(RECOVER_RUN_SECTORS * BLOCK_SECTOR_SIZE);
+  size_t cap = 0;
+  block_sector_t s;
+
+  if (run == NULL) {
+    st->error = true;
+    return NULL;
+  }
+  for (s = st->start; s < st->end; s += RECOVER_RUN_SECTORS) {
+    size_t cnt = st->end - s < RECOVER_RUN_SECTORS ? st->end - s
+                                                    : RECOVER_RUN_SECTORS;
+    size_t i;
+
+    // skip runs without a free sector unread
+    if (bitmap_all(free_map, s, cnt))
+      continue;
+    block_read_run(fs_device, s, cnt, run);
+    for (i = 0; i < cnt; i++) {
+      const struct inode_disk *d =
+          (const struct inode_disk *)(run + i * BLOCK_SECTOR_SIZE);
+      if (bitmap_test(free_map, s + i) || !recover_plausible(d, device_size))
+        continue;
+      if (st->found_cnt == cap) {
+        struct recover_inode *grown;
+        cap = cap * 2 + 16;
+        grown = realloc(st->found, cap * sizeof *grown);
+        if (grown == NULL) {
+          st->error = true;
+          break;
+        }
+        st->found = grown;
+      }
+      st->found[st->found_cnt].sector = s + i;
+      memcpy(&st->found[st->found_cnt].disk, d, sizeof *d);
+      st->found_cnt++;
+    }
+  }
+  free(run);
+  return NULL;
+}
+
+/* Finds the inodes of deleted files: free sectors that hold a
+   plausible inode.  Stores a malloc'd array of them, in sector order,
+   in *FOUND and returns their number. */
+size_t recover_scan_inodes(struct recover_inode **found) {
+  struct recover_stripe stripes[RECOVER_MAX_THREADS];
+  pthread_t threads[RECOVER_MAX_THREADS];
+  bool started[RECOVER_MAX_THREADS];
+  block_sector_t size = bitmap_size(free_map);
+  long ncpu = sysconf(_SC_NPROCESSORS_ONLN);
+  size_t nthreads = ncpu < 1 ? 1 : ncpu > RECOVER_MAX_THREADS
+                                       ? RECOVER_MAX_THREADS
+                                       : (size_t)ncpu;
+  size_t per, total = 0, i;
+
+  // what the cache holds must be on the device before reading it raw
+  buffer_cache_sync();
+
+  // stripes are whole runs, so no run is read twice
+  per = ROUND_UP(DIV_ROUND_UP(size, nthreads), RECOVER_RUN_SECTORS);
+  memset(stripes, 0, sizeof stripes);
+  for (i = 0; i < nthreads; i++) {
+    stripes[i].start = i * per < size ? i * per : size;
+    stripes[i].end = (i + 1) * per < size ? (i + 1) * per : size;
+    started[i] = i > 0 && pthread_create(&threads[i], NULL,
+                                         recover_scan_stripe, &stripes[i]) == 0;
+  }
+  recover_scan_stripe(&stripes[0]);
+  for (i = 1; i < nthreads; i++) {
+    if (started[i])
+      pthread_join(threads[i], NULL);
+    else
+      recover_scan_stripe(&stripes[i]);
+  }
+
+  // concatenate the stripes, which are in sector order already
+  *found = NULL;
+  for (i = 0; i < nthreads; i++)
+    total += stripes[i].found_cnt;
+  if (total > 0)
+    *found = malloc(total * sizeof **found);
+  total = 0;
+  for (i = 0; i < nthreads; i++) {
+    if (*found != NULL && stripes[i].found_cnt > 0) {
+      memcpy(*found + total, stripes[i].found,
+             stripes[i].found_cnt * sizeof **found);
+      total += stripes[i].found_cnt;
+    }
+    free(stripes[i].found);
+  }
+  return total;
+}
+
+/* Returns true if the sector in DATA is all zeros.  Compares a word
+   at a time, OR-ing into one accumulator so there is no branch per
+   word and the compiler vectorizes the loop. */
+bool recover_sector_zero(const void *data) {
+  uint64_t words[BLOCK_SECTOR_SIZE / sizeof(uint64_t)];
+  uint64_t any = 0;
+  size_t i;
+
+  memcpy(words, data, sizeof words);
+  for (i = 0; i < sizeof words / sizeof *words; i++)
+    any |= words[i];
+  return any == 0;
+}
+
+/* Calls FUNC, in sector order, for every sector from START to the
+   end of the device that holds nonzero data, and returns how many
+   there were.  Holes in a sparse device image are skipped without
+   being read. */
+size_t recover_scan_nonzero(block_sector_t start, recover_sector_func *func,
+                            void *aux) {
+  block_sector_t size = block_size(fs_device);
+  uint8_t *run = malloc(RECOVER_RUN_SECTORS * BLOCK_SECTOR_SIZE);
+  size_t nonzero = 0;
+  block_sector_t s = start;
+
+  if (run == NULL)
+    return 0;
+  buffer_cache_sync();
+  while (s < size) {
+    block_sector_t end;
+
+    s = block_seek_data(fs_device, s, &end);
+    for (; s < end; s += RECOVER_RUN_SECTORS) {
+      size_t cnt = end - s < RECOVER_RUN_SECTORS ? end - s
+                                                 : RECOVER_RUN_SECTORS;
+      size_t i;
+
+      block_read_run(fs_device, s, cnt, run);
+      for (i = 0; i < cnt; i++) {
+        const uint8_t *data = run + i * BLOCK_SECTOR_SIZE;
+        if (!recover_sector_zero(data)) {
+          func(s + i, data, aux);
+          nonzero++;
+        }
+      }
+    }
+    s = end;
+  }
+  free(run);
+  return nonzero;
+}
+
+/* Reads, straight from the device, the sector numbers stored in the
+   indirect block at SECTOR into BLOCKS, if the block is in range. */
+static bool recover_read_indirect(block_sector_t sector,
+                                  block_sector_t blocks[]) {
+  block_sector_t device_size = block_size(fs_device);
+  if (!recover_pointers_ok(&sector, 1, device_size))
+    return false;
+  block_read(fs_device, sector, blocks);
+  return true;
+}
+
+/* Reassembles the data of the file whose inode is D, reading the
+   device directly.  Sectors whose pointers are out of range read as
+   zeros.  Returns a malloc'd buffer of *SIZE bytes, or NULL if memory
+   runs out. */
+char *recover_inode_data(const struct inode_disk *d, size_t *size) {
+  block_sector_t device_size = block_size(fs_device);
+  size_t sectors = bytes_to_sectors(d->length), i;
+  block_sector_t indirect[INDIRECT_BLOCKS_PER_SECTOR];
+  block_sector_t doubly[INDIRECT_BLOCKS_PER_SECTOR];
+  bool have_indirect = false, have_doubly = false;
+  size_t loaded_second = (size_t)-1;
+  char *data = calloc(1, sectors * BLOCK_SECTOR_SIZE + 1);
+
+  if (data == NULL)
+    return NULL;
+  if (sectors > DIRECT_BLOCKS_COUNT)
+    have_indirect = recover_read_indirect(d->indirect_block, indirect);
+  if (sectors > DIRECT_BLOCKS_COUNT + INDIRECT_BLOCKS_PER_SECTOR)
+    have_doubly = recover_read_indirect(d->doubly_indirect_block, doubly);
+
+  for (i = 0; i < sectors; i++) {
+    block_sector_t sector = 0;
+    if (i < DIRECT_BLOCKS_COUNT)
+      sector = d->direct_blocks[i];
+    else if (i < DIRECT_BLOCKS_COUNT + INDIRECT_BLOCKS_PER_SECTOR) {
+      if (have_indirect)
+        sector = indirect[i - DIRECT_BLOCKS_COUNT];
+    } else if (have_doubly) {
+      size_t k = i - DIRECT_BLOCKS_COUNT - INDIRECT_BLOCKS_PER_SECTOR;
+      size_t first = k / INDIRECT_BLOCKS_PER_SECTOR;
+      if (first != loaded_second &&
+          !recover_read_indirect(doubly[first], indirect))
+        continue;
+      loaded_second = first;
+      sector = indirect[k % INDIRECT_BLOCKS_PER_SECTOR];
+    }
+    if (recover_pointers_ok(&sector, 1, device_size))
+      block_read(fs_device, sector, data + i * BLOCK_SECTOR_SIZE);
+  }
+  *size = d->length;
+  return data;
+}
@@ -0,0 +1,32 @@
+#ifndef FILESYS_RECOVER_H
+#define FILESYS_RECOVER_H
+
+#include "block.h"
+#include "inode.h"
+#include <stddef.h>
+
+/* Raw scans of the file system device for recovery.
+
+   Scans read the device in large sequential runs, bypassing the
+   buffer cache (which is synced first, so the device is current),
+   and split the device among several threads. */
+
+/* An inode found in a free sector. */
+struct recover_inode {
+  block_sector_t sector;
+  struct inode_disk disk;
+};
+
+size_t recover_scan_inodes(struct recover_inode **found);
+char *recover_inode_data(const struct inode_disk *, size_t *size);
+
+/* Called for each nonzero sector found by recover_scan_nonzero(),
+   with the sector's contents in DATA. */
+typedef void recover_sector_func(block_sector_t sector, const void *data,
+                                 void *aux);
+
+bool recover_sector_zero(const void *data);
+size_t recover_scan_nonzero(block_sector_t start, recover_sector_func *,
+                            void *aux);
+
+#endif /* fs/recover.h */
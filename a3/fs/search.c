@@ -0,0 +1,265 @@
+#define _GNU_SOURCE
+#include "search.h"
+#include "cache.h"
+#include "debug.h"
+#include "inode.h"
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+/* Sectors read per chunk. */
+#define SEARCH_CHUNK_SECTORS 16
+#define SEARCH_CHUNK_SIZE (SEARCH_CHUNK_SECTORS * BLOCK_SECTOR_SIZE)
+
+/* Marks a state of the automaton without a match. */
+#define NO_PATTERN UINT32_MAX
+
+struct search {
+  char **patterns;   /* Copies of the patterns. */
+  size_t *lens;      /* Length of each pattern. */
+  size_t cnt;        /* Number of patterns. */
+  size_t max_len;    /* Length of the longest pattern. */
+
+  /* Aho-Corasick automaton, only built for more than one pattern.
+     NEXT is the complete transition table, so the scan does one
+     lookup per byte; OUT is the pattern ending at a state and DICT
+     the next state on the suffix chain that also ends a pattern. */
+  uint32_t (*next)[256];
+  uint32_t *out;
+  uint32_t *dict;
+  uint32_t state_cnt;
+};
+
+/* Builds the automaton for the patterns of S. */
+static bool search_build_automaton(struct search *s) {
+  size_t max_states = 1, i;
+  for (i = 0; i < s->cnt; i++)
+    max_states += s->lens[i];
+
+  uint32_t *fail = malloc(max_states * sizeof *fail);
+  uint32_t *queue = malloc(max_states * sizeof *queue);
+  s->next = malloc(max_states * sizeof *s->next);
+  s->out = malloc(max_states * sizeof *s->out);
+  s->dict = malloc(max_states * sizeof *s->dict);
+  if (fail == NULL || queue == NULL || s->next == NULL || s->out == NULL ||
+      s->dict == NULL) {
+    free(fail);
+    free(queue);
+    return false;
+  }
+
+  // (1) trie of the patterns; 0 stands for "no edge" while building
+  memset(s->next[0], 0, sizeof s->next[0]);
+  s->out[0] = NO_PATTERN;
+  s->state_cnt = 1;
+  for (i = 0; i < s->cnt; i++) {
+    uint32_t state = 0;
+    size_t k;
+    if (s->lens[i] == 0)
+      continue; // reported by search_range() itself
+    for (k = 0; k < s->lens[i]; k++) {
+      uint8_t c = s->patterns[i][k];
+      if (s->next[state][c] == 0) {
+        uint32_t n = s->state_cnt++;
+        memset(s->next[n], 0, sizeof s->next[n]);
+        s->out[n] = NO_PATTERN;
+        s->next[state][c] = n;
+      }
+      state = s->next[state][c];
+    }
+    if (s->out[state] == NO_PATTERN)
+      s->out[state] = i;
+  }
+
+  // (2) failure links, breadth first, completing the transitions
+  size_t head = 0, tail = 0;
+  int c;
+  fail[0] = 0;
+  s->dict[0] = NO_PATTERN;
+  for (c = 0; c < 256; c++)
+    if (s->next[0][c] != 0) {
+      uint32_t n = s->next[0][c];
+      fail[n] = 0;
+      s->dict[n] = NO_PATTERN;
+      queue[tail++] = n;
+    }
+  while (head < tail) {
+    uint32_t state = queue[head++];
+    for (c = 0; c < 256; c++) {
+      uint32_t n = s->next[state][c];
+      if (n == 0) {
+        s->next[state][c] = s->next[fail[state]][c];
+        continue;
+      }
+      fail[n] = s->next[fail[state]][c];
+      s->dict[n] = s->out[fail[n]] != NO_PATTERN ? fail[n] : s->dict[fail[n]];
+      queue[tail++] = n;
+    }
+  }
+
+  free(fail);
+  free(queue);
+  return true;
+}
+
+/* Compiles the CNT null-terminated PATTERNS.  Returns NULL if
+   memory runs out. */
+struct search *search_compile(char *const patterns[], size_t cnt) {
+  struct search *s = calloc(1, sizeof *s);
+  size_t i;
+
+  if (s == NULL)
+    return NULL;
+  s->patterns = calloc(cnt, sizeof *s->patterns);
+  s->lens = calloc(cnt, sizeof *s->lens);
+  s->cnt = cnt;
+  if (s->patterns == NULL || s->lens == NULL) {
+    search_destroy(s);
+    return NULL;
+  }
+  for (i = 0; i < cnt; i++) {
+    s->patterns[i] = strdup(patterns[i]);
+    if (s->patterns[i] == NULL) {
+      search_destroy(s);
+      return NULL;
+    }
+    s->lens[i] = strlen(patterns[i]);
+    if (s->lens[i] > s->max_len)
+      s->max_len = s->lens[i];
+  }
+  if (cnt > 1 && !search_build_automaton(s)) {
+    search_destroy(s);
+    return NULL;
+  }
+  return s;
+}
+
+void search_destroy(struct search *s) {
+  size_t i;
+
+  if (s == NULL)
+    return;
+  for (i = 0; s->patterns != NULL && i < s->cnt; i++)
+    free(s->patterns[i]);
+  free(s->patterns);
+  free(s->lens);
+  free(s->next);
+  free(s->out);
+  free(s->dict);
+  free(s);
+}
+
+size_t search_pattern_cnt(const struct search *s) { return s->cnt; }
+
+const char *search_pattern(const struct search *s, size_t pattern) {
+  return s->patterns[pattern];
+}
+
+/* Runs search_range() over the data in SECTORS, or else that read
+   through INODE. */
+static void search_scan(const struct search *s, const block_sector_t *sectors,
+                        struct inode *inode, offset_t length, offset_t start,
+                        offset_t end, search_match_func *match, void *aux) {
+  size_t i;
+
+  if (end > length)
+    end = length;
+  if (start >= end)
+    return;
+
+  // empty patterns match at every offset; report the first one
+  for (i = 0; i < s->cnt; i++)
+    if (s->lens[i] == 0 && !match(i, start, aux))
+      return;
+  if (s->max_len == 0)
+    return;
+
+  // bytes to scan: up to END plus the tail of a match starting before it
+  offset_t limit = end + (offset_t)s->max_len - 1;
+  if (limit > length)
+    limit = length;
+
+  /* The buffer holds CARRY bytes kept from the previous chunk
+     followed by the new chunk, so that a single-pattern match
+     straddling two chunks is still seen in one piece. */
+  size_t carry_max = s->max_len - 1;
+  uint8_t *buf = malloc(carry_max + SEARCH_CHUNK_SIZE);
+  if (buf == NULL)
+    return;
+
+  offset_t pos = start - start % BLOCK_SECTOR_SIZE; // file offset of chunk
+  size_t skip = start - pos; // bytes of the first chunk before START
+  size_t carry = 0;
+  uint32_t state = 0;
+
+  while (pos < limit) {
+    size_t sector = pos / BLOCK_SECTOR_SIZE, k;
+    size_t n = SEARCH_CHUNK_SIZE;
+    if ((offset_t)n > limit - pos)
+      n = limit - pos;
+    if (inode != NULL &&
+        inode_read_at(inode, buf + carry, n, pos) != (offset_t)n)
+      break;
+    for (k = 0; inode == NULL && k * BLOCK_SECTOR_SIZE < n; k++)
+      buffer_cache_read_nofill(sectors[sector + k],
+                               buf + carry + k * BLOCK_SECTOR_SIZE);
+
+    uint8_t *data = buf + carry + skip; // first byte not yet scanned
+    size_t avail = n - skip;
+    offset_t data_ofs = pos + skip;     // its file offset
+
+    if (s->cnt == 1) {
+      const char *pat = s->patterns[0];
+      size_t m = s->lens[0];
+      uint8_t *hay = data - carry, *p = hay;
+      size_t hay_len = carry + avail;
+      offset_t hay_ofs = data_ofs - carry;
+
+      while ((p = memmem(p, hay_len - (p - hay), pat, m)) != NULL) {
+        offset_t ofs = hay_ofs + (p - hay);
+        if (ofs >= end || !match(0, ofs, aux))
+          goto done;
+        p++;
+      }
+      // keep the last M-1 bytes, which may start a match
+      carry = hay_len < m - 1 ? hay_len : m - 1;
+      memmove(buf, hay + hay_len - carry, carry);
+    } else {
+      for (k = 0; k < avail; k++) {
+        state = s->next[state][data[k]];
+        uint32_t st = s->out[state] != NO_PATTERN ? state : s->dict[state];
+        for (; st != NO_PATTERN; st = s->dict[st]) {
+          uint32_t p = s->out[st];
+          offset_t ofs = data_ofs + k + 1 - s->lens[p];
+          if (ofs >= start && ofs < end && !match(p, ofs, aux))
+            goto done;
+        }
+      }
+    }
+
+    pos += n;
+    skip = 0;
+  }
+
+done:
+  free(buf);
+}
+
+/* Reports every match that starts within [START, END) of the LENGTH
+   bytes of file data stored in SECTORS, in the order in which
+   they end, until MATCH returns false.  Reads only as far past END as the longest pattern needs,
+   so callers may split a large file into ranges and scan them
+   independently. */
+void search_range(const struct search *s, const block_sector_t *sectors,
+                  offset_t length, offset_t start, offset_t end,
+                  search_match_func *match, void *aux) {
+  search_scan(s, sectors, NULL, length, start, end, match, aux);
+}
+
+/* Same as search_range(), for a file whose data must be read through
+   its INODE, such as a compressed one. */
+void search_range_inode(const struct search *s, struct inode *inode,
+                        offset_t start, offset_t end,
+                        search_match_func *match, void *aux) {
+  search_scan(s, NULL, inode, inode_length(inode), start, end, match, aux);
+}
@@ -0,0 +1,37 @@
+#ifndef FILESYS_SEARCH_H
+#define FILESYS_SEARCH_H
+
+#include "block.h"
+#include "off_t.h"
+#include <stdbool.h>
+#include <stddef.h>
+
+/* Content search over file data.
+
+   A set of patterns is compiled once and then run over the data
+   sectors of files a chunk at a time, so that files of any size
+   are searched in constant memory and a search can stop at the
+   first match.  A single pattern is located with memmem(), which
+   the C library vectorizes; several patterns are matched in one
+   pass with an Aho-Corasick automaton. */
+
+struct search;
+struct inode;
+
+/* Called for every match of pattern number PATTERN starting at byte
+   offset OFS.  Returns false to stop the search. */
+typedef bool search_match_func(size_t pattern, offset_t ofs, void *aux);
+
+struct search *search_compile(char *const patterns[], size_t cnt);
+void search_destroy(struct search *);
+size_t search_pattern_cnt(const struct search *);
+const char *search_pattern(const struct search *, size_t pattern);
+
+void search_range(const struct search *, const block_sector_t *sectors,
+                  offset_t length, offset_t start, offset_t end,
+                  search_match_func *, void *aux);
+void search_range_inode(const struct search *, struct inode *,
+                        offset_t start, offset_t end, search_match_func *,
+                        void *aux);
+
+#endif /* fs/search.h */
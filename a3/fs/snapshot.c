@@ -0,0 +1,284 @@
+#include "snapshot.h"
+#include "debug.h"
+#include "filesys.h"
+#include "free-map.h"
+#include "inode.h"
+#include "super.h"
+#include <stdlib.h>
+#include <string.h>
+
+/* Entries the directory of snapshots has room for before it
+   overflows its buckets. */
+#define SNAPSHOT_DIR_ENTRIES 16
+
+/* Opens the directory whose inode is at SECTOR. */
+static struct dir *snapshot_open_dir(block_sector_t sector) {
+  return dir_open(inode_open(sector));
+}
+
+/* Frees SECTOR, an inode that was created but never linked into a
+   directory, and everything it points at. */
+static void snapshot_discard(block_sector_t sector) {
+  struct inode *inode = inode_open(sector);
+
+  if (inode == NULL) {
+    free_map_release(sector, 1);
+    return;
+  }
+  inode_remove(inode);
+  inode_close(inode);
+}
+
+/* Opens the directory of snapshots, creating it first if CREATE.
+   Returns NULL if there is none or it cannot be created. */
+static struct dir *snapshot_open_all(bool create) {
+  struct super_block *sb = super_get();
+  block_sector_t sector;
+
+  if (sb->snapshot_sector != 0)
+    return snapshot_open_dir(sb->snapshot_sector);
+  if (!create || !super_supported() || !free_map_allocate(1, &sector))
+    return NULL;
+  if (!dir_create(sector, SNAPSHOT_DIR_ENTRIES)) {
+    free_map_release(sector, 1);
+    return NULL;
+  }
+  sb->snapshot_sector = sector;
+  if (!super_write()) {
+    sb->snapshot_sector = 0;
+    snapshot_discard(sector);
+    return NULL;
+  }
+  return snapshot_open_dir(sector);
+}
+
+/* Returns the number of entries of the directory at SECTOR. */
+static size_t snapshot_count(block_sector_t sector) {
+  struct dir *dir = snapshot_open_dir(sector);
+  struct dir_entry_plus ents[DIR_PLUS_BATCH];
+  size_t cnt = 0, n;
+
+  if (dir == NULL)
+    return 0;
+  while ((n = dir_readdir_plus(dir, ents, DIR_PLUS_BATCH, false)) > 0)
+    cnt += n;
+  dir_close(dir);
+  return cnt;
+}
+
+static bool snapshot_copy(block_sector_t src, struct dir *dst);
+
+/* Adds to DST a copy of entry E: a clone if it is a file, or a new
+   directory holding copies of its entries.  Returns false if the
+   disk is full. */
+static bool snapshot_copy_entry(const struct dir_entry_plus *e,
+                                struct dir *dst) {
+  block_sector_t sector;
+  struct inode *inode;
+  struct dir *child;
+  bool ok;
+
+  if (!free_map_allocate(1, &sector))
+    return false;
+  if (e->is_dir) {
+    if (!dir_create(sector, snapshot_count(e->inode_sector))) {
+      free_map_release(sector, 1);
+      return false;
+    }
+    if (!dir_add(dst, e->name, sector, true)) {
+      snapshot_discard(sector);
+      return false;
+    }
+    child = snapshot_open_dir(sector);
+    ok = child != NULL && snapshot_copy(e->inode_sector, child);
+    dir_close(child);
+    return ok;
+  }
+
+  inode = inode_open(e->inode_sector);
+  ok = inode != NULL && inode_clone(inode, sector);
+  inode_close(inode);
+  if (!ok) {
+    free_map_release(sector, 1);
+    return false;
+  }
+  if (!dir_add(dst, e->name, sector, false)) {
+    snapshot_discard(sector);
+    return false;
+  }
+  return true;
+}
+
+/* Fills DST with copies of the entries of the directory at SRC.
+   Returns false if the disk is full. */
+static bool snapshot_copy(block_sector_t src, struct dir *dst) {
+  struct dir *dir = snapshot_open_dir(src);
+  struct dir_entry_plus ents[DIR_PLUS_BATCH];
+  bool ok = dir != NULL;
+  size_t n, i;
+
+  while (ok && (n = dir_readdir_plus(dir, ents, DIR_PLUS_BATCH, false)) > 0)
+    for (i = 0; ok && i < n; i++)
+      ok = snapshot_copy_entry(&ents[i], dst);
+  dir_close(dir);
+  return ok;
+}
+
+/* Removes every entry under DIR, subdirectories included. */
+static void snapshot_clear(struct dir *dir) {
+  struct dir_entry_plus ents[DIR_PLUS_BATCH];
+  size_t n, i;
+
+  while ((n = dir_readdir_plus(dir, ents, DIR_PLUS_BATCH, false)) > 0)
+    for (i = 0; i < n; i++) {
+      if (ents[i].is_dir) {
+        struct dir *child = snapshot_open_dir(ents[i].inode_sector);
+        if (child != NULL)
+          snapshot_clear(child);
+        dir_close(child);
+      }
+      dir_remove(dir, ents[i].name);
+    }
+}
+
+/* Counts the files under the directory at SECTOR, and the data
+   sectors they point at, into INFO. */
+static void snapshot_measure(block_sector_t sector,
+                             struct snapshot_info *info) {
+  struct dir *dir = snapshot_open_dir(sector);
+  struct dir_entry_plus ents[DIR_PLUS_BATCH];
+  size_t n, i;
+
+  if (dir == NULL)
+    return;
+  while ((n = dir_readdir_plus(dir, ents, DIR_PLUS_BATCH, false)) > 0)
+    for (i = 0; i < n; i++) {
+      struct inode *inode;
+      if (ents[i].is_dir) {
+        snapshot_measure(ents[i].inode_sector, info);
+        continue;
+      }
+      info->files++;
+      inode = inode_open(ents[i].inode_sector);
+      if (inode != NULL)
+        info->sectors += inode_data_sectors_used(inode);
+      inode_close(inode);
+    }
+  dir_close(dir);
+}
+
+/* Takes a snapshot of the whole tree under the root, called NAME.
+   Returns false if a snapshot of that name exists, the image cannot
+   hold snapshots or the disk is full. */
+bool snapshot_create(const char *name) {
+  struct dir *all = snapshot_open_all(true), *snap;
+  block_sector_t sector;
+  bool ok;
+
+  if (all == NULL)
+    return false;
+  ok = free_map_allocate(1, &sector);
+  if (ok && !dir_create(sector, snapshot_count(ROOT_DIR_SECTOR))) {
+    free_map_release(sector, 1);
+    ok = false;
+  } else if (ok && !dir_add(all, name, sector, true)) {
+    snapshot_discard(sector);
+    ok = false;
+  }
+  if (ok) {
+    snap = snapshot_open_dir(sector);
+    ok = snap != NULL && snapshot_copy(ROOT_DIR_SECTOR, snap);
+    dir_close(snap);
+    if (!ok)
+      snapshot_delete(name);
+  }
+  dir_close(all);
+  return ok;
+}
+
+/* Deletes snapshot NAME.  The sectors it shared with the tree, or
+   with other snapshots, stay in use by them.  Returns false if there
+   is no such snapshot. */
+bool snapshot_delete(const char *name) {
+  struct dir *all = snapshot_open_all(false), *snap;
+  struct inode *inode = NULL;
+  bool ok;
+
+  if (all == NULL)
+    return false;
+  ok = dir_lookup(all, name, &inode) && inode_is_directory(inode);
+  if (ok) {
+    snap = dir_open(inode);
+    inode = NULL;
+    if (snap != NULL)
+      snapshot_clear(snap);
+    dir_close(snap);
+    ok = dir_remove(all, name);
+  }
+  inode_close(inode);
+  dir_close(all);
+  return ok;
+}
+
+/* Replaces the whole tree under the root with the contents of
+   snapshot NAME, which is kept.  Returns false if there is no such
+   snapshot or the disk is full, in which case the root may hold only
+   part of it. */
+bool snapshot_restore(const char *name) {
+  struct dir *all = snapshot_open_all(false), *root;
+  struct inode *inode = NULL;
+  block_sector_t sector;
+  bool ok;
+
+  if (all == NULL)
+    return false;
+  ok = dir_lookup(all, name, &inode) && inode_is_directory(inode);
+  sector = ok ? inode_get_inumber(inode) : 0;
+  inode_close(inode);
+  dir_close(all);
+  if (!ok)
+    return false;
+
+  root = snapshot_open_dir(ROOT_DIR_SECTOR);
+  if (root == NULL)
+    return false;
+  snapshot_clear(root);
+  ok = snapshot_copy(sector, root);
+  dir_close(root);
+  // the current directory was removed with the rest of the tree
+  filesys_chdir("/");
+  return ok;
+}
+
+/* Stores a malloc'd array describing each snapshot into *INFOS, for
+   the caller to free, and returns how many there are. */
+size_t snapshot_list(struct snapshot_info **infos) {
+  struct dir *all = snapshot_open_all(false);
+  struct dir_entry_plus ents[DIR_PLUS_BATCH];
+  size_t cnt = 0, cap = 0, n, i;
+  bool ok = true;
+
+  *infos = NULL;
+  if (all == NULL)
+    return 0;
+  while (ok && (n = dir_readdir_plus(all, ents, DIR_PLUS_BATCH, false)) > 0)
+    for (i = 0; ok && i < n; i++) {
+      struct snapshot_info *info;
+      if (cnt == cap) {
+        struct snapshot_info *grown =
+            realloc(*infos, (cap * 2 + 4) * sizeof **infos);
+        if (grown == NULL) {
+          ok = false;
+          continue;
+        }
+        *infos = grown;
+        cap = cap * 2 + 4;
+      }
+      info = &(*infos)[cnt++];
+      memset(info, 0, sizeof *info);
+      memcpy(info->name, ents[i].name, sizeof info->name);
+      snapshot_measure(ents[i].inode_sector, info);
+    }
+  dir_close(all);
+  return cnt;
+}
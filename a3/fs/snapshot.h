@@ -0,0 +1,31 @@
+#ifndef FILESYS_SNAPSHOT_H
+#define FILESYS_SNAPSHOT_H
+
+#include "directory.h"
+#include <stdbool.h>
+#include <stddef.h>
+
+/* Copy-on-write snapshots of the directory tree.
+
+   A snapshot is a directory, kept in a system directory found
+   through the superblock, holding a clone of every file under the
+   root as it was when the snapshot was taken.  A clone is a new
+   inode and block map pointing at the original's data sectors, each
+   of which gains a reference in the free map (see free-map.c), so
+   taking a snapshot copies block maps but no data.  A later write to
+   either side goes to a fresh sector, leaving the other as it was;
+   removing either side only drops references. */
+
+/* A snapshot, as listed by snapshot_list(). */
+struct snapshot_info {
+  char name[NAME_MAX + 1]; /* Its name. */
+  size_t files;            /* Files it holds. */
+  size_t sectors;          /* Data sectors those files point at. */
+};
+
+bool snapshot_create(const char *name);
+bool snapshot_delete(const char *name);
+bool snapshot_restore(const char *name);
+size_t snapshot_list(struct snapshot_info **);
+
+#endif /* fs/snapshot.h */
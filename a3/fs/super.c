@@ -0,0 +1,74 @@
+#include "super.h"
+#include "cache.h"
+#include "debug.h"
+#include "directory.h"
+#include "free-map.h"
+#include <string.h>
+
+/* In-memory copy of the superblock, and where it lives (0 if it
+   has not been allocated yet). */
+static struct super_block super;
+static block_sector_t super_sector;
+static bool supported;
+
+/* Loads the superblock of the mounted file system, if it has one. */
+void super_init(void) {
+  struct dir *root = dir_open_root();
+
+  ASSERT(sizeof super == BLOCK_SECTOR_SIZE);
+
+  memset(&super, 0, sizeof super);
+  super.magic = SUPER_MAGIC;
+  super_sector = 0;
+  supported = root != NULL && dir_get_super(root, &super_sector);
+  dir_close(root);
+
+  if (super_sector != 0) {
+    buffer_cache_read(super_sector, &super);
+    if (super.magic != SUPER_MAGIC) {
+      // not ours after all: ignore it rather than trust its fields
+      memset(&super, 0, sizeof super);
+      super.magic = SUPER_MAGIC;
+      super_sector = 0;
+    }
+  }
+}
+
+/* Returns whether the file system can hold a superblock. */
+bool super_supported(void) { return supported; }
+
+/* Returns the in-memory superblock.  Changes take effect on disk
+   with super_write(). */
+struct super_block *super_get(void) { return &super; }
+
+/* Returns the sector of the superblock, or 0 if it has none yet. */
+block_sector_t super_location(void) { return super_sector; }
+
+/* Writes the superblock back, allocating its sector first if need
+   be.  Returns false if the image does not support a superblock or
+   the disk is full. */
+bool super_write(void) {
+  if (!supported)
+    return false;
+
+  if (super_sector == 0) {
+    block_sector_t sector;
+    struct dir *root;
+    bool ok;
+
+    if (!free_map_allocate(1, &sector))
+      return false;
+    buffer_cache_write_meta(sector, &super);
+    root = dir_open_root();
+    ok = root != NULL && dir_set_super(root, sector);
+    dir_close(root);
+    if (!ok) {
+      free_map_release(sector, 1);
+      return false;
+    }
+    super_sector = sector;
+    return true;
+  }
+  buffer_cache_write_meta(super_sector, &super);
+  return true;
+}
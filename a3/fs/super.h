@@ -0,0 +1,37 @@
+#ifndef FILESYS_SUPER_H
+#define FILESYS_SUPER_H
+
+#include "block.h"
+#include <stdbool.h>
+#include <stdint.h>
+
+/* Identifies a superblock sector. */
+#define SUPER_MAGIC 0x4b4c4253
+
+/* Superblock flags. */
+#define SUPER_DEDUP 0x01 /* Deduplicate data sectors as they are written. */
+
+/* On-disk superblock.  It records where the optional system files
+   live; a sector of 0 means the file does not exist.  The superblock
+   itself is allocated the first time one of them is created, and is
+   found through the header of the root directory, so images made
+   before it existed simply have none.  Legacy (linear) root
+   directories cannot point to one at all. */
+struct super_block {
+  uint32_t magic;                 /* SUPER_MAGIC. */
+  block_sector_t index_sector;    /* Inode of the content index. */
+  block_sector_t journal_sector;  /* Start of the journal region. */
+  block_sector_t checksum_sector; /* Start of the checksum area. */
+  block_sector_t refcount_sector; /* Inode of the reference counts. */
+  uint32_t flags;                 /* SUPER_* flags. */
+  block_sector_t snapshot_sector; /* Directory of snapshots. */
+  uint8_t unused[BLOCK_SECTOR_SIZE - 7 * sizeof(uint32_t)];
+};
+
+void super_init(void);
+bool super_supported(void);
+struct super_block *super_get(void);
+block_sector_t super_location(void);
+bool super_write(void);
+
+#endif /* fs/super.h */
@@ -43,6 +43,10 @@ char *error_msgs[] = {
 };
 
 int handle_error(enum Error error_code) {
+  if ((unsigned)error_code >= sizeof error_msgs / sizeof *error_msgs) {
+    printf("Bad command: error %d\n", error_code);
+    return error_code;
+  }
   printf("Bad command: %s\n", error_msgs[error_code]);
   return error_code;
 }
@@ -187,12 +191,27 @@ int interpreter(char *command_args[], int args_size, char *cwd) {
   }
 
   // FS
-  else if (strcmp(command_args[0], "ls") == 0) { // ls
-    if (args_size > 1)
+  else if (strcmp(command_args[0], "ls") == 0) { // ls [DIR]
+    if (args_size > 2)
       return handle_error(TOO_MANY_TOKENS);
-    int status = fsutil_ls(NULL);
+    int status = fsutil_ls(args_size == 2 ? command_args[1] : NULL);
     if (status == 1)
-      return handle_error(FILESYSTEM_ERROR);
+      return handle_error(args_size == 2 ? FILE_DOES_NOT_EXIST
+                                         : FILESYSTEM_ERROR);
+    return 0;
+  } else if (strcmp(command_args[0], "mkdir") == 0) { // mkdir DIR
+    if (args_size < 2)
+      return handle_error(TOO_FEW_TOKENS);
+    if (args_size > 2)
+      return handle_error(TOO_MANY_TOKENS);
+    if (fsutil_mkdir(command_args[1]) == 0)
+      return handle_error(FILE_CREATION_ERROR);
+    return 0;
+  } else if (strcmp(command_args[0], "cd") == 0) { // cd [DIR]
+    if (args_size > 2)
+      return handle_error(TOO_MANY_TOKENS);
+    if (fsutil_cd(args_size == 2 ? command_args[1] : NULL) == 0)
+      return handle_error(FILE_DOES_NOT_EXIST);
     return 0;
   } else if (strcmp(command_args[0], "cat") == 0) { // cat
     if (args_size != 2)
@@ -245,28 +264,52 @@ int interpreter(char *command_args[], int args_size, char *cwd) {
     }
     return 0;
   } else if (strcmp(command_args[0], "find_file") == 0) { // rm
-    if (args_size < 2)
-      return handle_error(TOO_FEW_TOKENS);
-    int size = 0;
-    for (int i = 1; i < args_size; i++) {
-      size += strlen(command_args[i]);
+    // find_file [-c | -o] [-j threads] [-B max_threads] [-e pattern]...
+    //           [words...]
+    enum find_mode mode = FIND_NAMES;
+    int nthreads = 0, bench = 0;
+    char *patterns[args_size];
+    size_t pattern_cnt = 0;
+    int i = 1;
+    for (; i < args_size && command_args[i][0] == '-'; i++) {
+      if (strcmp(command_args[i], "-c") == 0)
+        mode = FIND_COUNT;
+      else if (strcmp(command_args[i], "-o") == 0)
+        mode = FIND_OFFSETS;
+      else if (strcmp(command_args[i], "-e") == 0 && i + 1 < args_size)
+        patterns[pattern_cnt++] = command_args[++i];
+      else if (strcmp(command_args[i], "-j") == 0 && i + 1 < args_size)
+        nthreads = atoi(command_args[++i]);
+      else if (strcmp(command_args[i], "-B") == 0 && i + 1 < args_size)
+        bench = atoi(command_args[++i]);
+      else
+        break;
     }
-    size += args_size;
-    char *buf = malloc(size * sizeof(char));
-    memset(buf, 0, size);
-    int current_ind = 0;
-    for (int i = 1; i < args_size; i++) {
-      strcpy(buf + current_ind, command_args[i]);
-      current_ind += strlen(command_args[i]);
-      strcpy(buf + current_ind, " ");
-      current_ind += 1;
+
+    // the remaining words form one pattern, as they always have
+    char *buf = NULL;
+    if (i < args_size) {
+      int size = 0;
+      for (int j = i; j < args_size; j++) {
+        size += strlen(command_args[j]) + 1;
+      }
+      buf = malloc(size * sizeof(char));
+      memset(buf, 0, size);
+      int current_ind = 0;
+      for (int j = i; j < args_size; j++) {
+        strcpy(buf + current_ind, command_args[j]);
+        current_ind += strlen(command_args[j]);
+        strcpy(buf + current_ind, " ");
+        current_ind += 1;
+      }
+      buf[current_ind - 1] = '\0';
+      patterns[pattern_cnt++] = buf;
     }
-    buf[current_ind - 1] = '\0';
+    if (pattern_cnt == 0)
+      return handle_error(TOO_FEW_TOKENS);
+
+    find_file(patterns, pattern_cnt, mode, nthreads, bench);
 
-		
-    find_file(buf);
-    
-    
     free(buf);
     return 0;
   } else if (strcmp(command_args[0], "read") == 0) { // rm
@@ -299,6 +342,115 @@ int interpreter(char *command_args[], int args_size, char *cwd) {
     if (status != 0)
       return handle_error(status);
     return 0;
+  } else if (strcmp(command_args[0], "copy_in_dir") == 0) {
+    if (args_size != 2)
+      return handle_error(TOO_MANY_TOKENS);
+
+    int status = copy_in_dir(command_args[1]);
+    if (status > 0)
+      return handle_error(status);
+    return 0;
+  } else if (strcmp(command_args[0], "copy_out_dir") == 0) {
+    if (args_size != 2)
+      return handle_error(TOO_MANY_TOKENS);
+
+    copy_out_dir(command_args[1]);
+    return 0;
+  } else if (strcmp(command_args[0], "defrag_bg") == 0) {
+    // defrag_bg start [rate] | rate N | pause | resume | stop | status
+    if (args_size > 3)
+      return handle_error(TOO_MANY_TOKENS);
+
+    defrag_background(args_size >= 2 ? command_args[1] : "status",
+                      args_size == 3 ? command_args[2] : NULL);
+    return 0;
+  } else if (strcmp(command_args[0], "index") == 0) {
+    // index on | off | status
+    if (args_size > 2)
+      return handle_error(TOO_MANY_TOKENS);
+
+    content_index(args_size == 2 ? command_args[1] : "status");
+    return 0;
+  } else if (strcmp(command_args[0], "compress") == 0) {
+    // compress [-d] FILE
+    if (args_size > 3)
+      return handle_error(TOO_MANY_TOKENS);
+    if (args_size < 2 || (args_size == 3 && strcmp(command_args[1], "-d") != 0))
+      return handle_error(BAD_COMMAND);
+
+    compress(command_args[args_size - 1], args_size == 3);
+    return 0;
+  } else if (strcmp(command_args[0], "journal") == 0) {
+    // journal on [SECTORS] | off | status
+    if (args_size > 3)
+      return handle_error(TOO_MANY_TOKENS);
+
+    journal(args_size >= 2 ? command_args[1] : "status",
+            args_size == 3 ? command_args[2] : NULL);
+    return 0;
+  } else if (strcmp(command_args[0], "checksum") == 0) {
+    // checksum on | off | status
+    if (args_size > 2)
+      return handle_error(TOO_MANY_TOKENS);
+
+    checksum(args_size == 2 ? command_args[1] : "status");
+    return 0;
+  } else if (strcmp(command_args[0], "scrub") == 0) {
+    if (args_size > 1)
+      return handle_error(TOO_MANY_TOKENS);
+
+    scrub();
+    return 0;
+  } else if (strcmp(command_args[0], "dedup") == 0) {
+    // dedup on | off | status
+    if (args_size > 2)
+      return handle_error(TOO_MANY_TOKENS);
+
+    dedup(args_size == 2 ? command_args[1] : "status");
+    return 0;
+  } else if (strcmp(command_args[0], "dedupstat") == 0) {
+    if (args_size > 1)
+      return handle_error(TOO_MANY_TOKENS);
+
+    dedupstat();
+    return 0;
+  } else if (strcmp(command_args[0], "clone") == 0) {
+    // clone SRC DST
+    if (args_size < 3)
+      return handle_error(TOO_FEW_TOKENS);
+    if (args_size > 3)
+      return handle_error(TOO_MANY_TOKENS);
+
+    clone_file(command_args[1], command_args[2]);
+    return 0;
+  } else if (strcmp(command_args[0], "snapshot") == 0) {
+    // snapshot NAME | -l | -d NAME | -r NAME
+    if (args_size < 2)
+      return handle_error(TOO_FEW_TOKENS);
+    if (strcmp(command_args[1], "-d") == 0 ||
+        strcmp(command_args[1], "-r") == 0) {
+      if (args_size != 3)
+        return handle_error(args_size < 3 ? TOO_FEW_TOKENS : TOO_MANY_TOKENS);
+      snapshot(command_args[1], command_args[2]);
+      return 0;
+    }
+    if (args_size > 2)
+      return handle_error(TOO_MANY_TOKENS);
+
+    if (strcmp(command_args[1], "-l") == 0)
+      snapshot("-l", NULL);
+    else
+      snapshot("create", command_args[1]);
+    return 0;
+  } else if (strcmp(command_args[0], "fsck") == 0) {
+    // fsck [-r]
+    if (args_size > 2)
+      return handle_error(TOO_MANY_TOKENS);
+    if (args_size == 2 && strcmp(command_args[1], "-r") != 0)
+      return handle_error(BAD_COMMAND);
+
+    fsck(args_size == 2);
+    return 0;
   } else if (strcmp(command_args[0], "size") == 0) { // rm
     if (args_size != 2)
       return handle_error(TOO_MANY_TOKENS);
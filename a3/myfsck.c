@@ -0,0 +1,35 @@
+#include <stdbool.h>
+#include <stdio.h>
+#include <string.h>
+
+#include "fs/filesys.h"
+#include "fs/fsck.h"
+#include "fs/ide.h"
+
+// Checks a hard drive image without starting the shell.
+// E.g., ./myfsck myhd.dsk -r
+// Exits with 0 if the image is clean, 1 if every problem was repaired,
+// 4 if problems remain, and 8 on a usage error.
+int main(int argc, char *argv[]) {
+  bool repair = argc == 3 && strcmp(argv[2], "-r") == 0;
+  struct fsck_report r;
+  int status = 4;
+
+  if (argc < 2 || (argc == 3 && !repair) || argc > 3) {
+    printf("%s\n", "Usage: myfsck myhd.dsk [-r]");
+    return 8;
+  }
+
+  ide_init(argv[1]);
+  filesys_init(false);
+
+  filesys_lock();
+  if (fsck_run(repair, &r))
+    status = fsck_print(&r, repair);
+  else
+    printf("%s\n", "Error: Failed to check the file system");
+  filesys_done();
+  filesys_unlock();
+
+  return status;
+}
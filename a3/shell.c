@@ -1,4 +1,5 @@
 
+#include <stdbool.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -134,7 +135,15 @@ int parseInput(char ui[], char *cwd) {
         break;
       }
     }
+    // one command holds the file system lock at a time; run and exec
+    // come back here for each line of their scripts
+    bool script = w > 0 && (strcmp(words[0], "run") == 0 ||
+                            strcmp(words[0], "exec") == 0);
+    if (!script)
+      filesys_lock();
     ret = interpreter(words, w, cwd); // call "interpreter" and update "ret"
+    if (!script)
+      filesys_unlock();
     tokens = strtok(NULL, ";");       // move to the next section
     for (int i = 0; i < w; i++) {
       free(words[i]);
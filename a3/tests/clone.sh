@@ -0,0 +1,31 @@
+#!/bin/sh
+# Writing a clone leaves the original alone, and removing the clone
+# gives back every sector it took.
+. "$(dirname "$0")/lib"
+
+free_sectors() {
+  sed -n 's/^Num free sectors: \([0-9]*\) (.*/\1/p' log
+}
+
+head -c 6000 /dev/urandom | od -An -tx1 > a.txt
+# The first clone creates the reference count file, which stays.
+printf 'copy_in a.txt\nclone a.txt b.txt\nrm b.txt\nfreespace\nquit\n' |
+  run_shell -f > log
+before=$(free_sectors)
+[ -n "$before" ] || fail "freespace printed nothing"
+
+# The file stays open until the shell exits: change it on its own.
+printf 'clone a.txt b.txt\nwrite b.txt changed\nquit\n' | run_shell > log
+expect "sectors shared"
+
+mkdir out && cd out || fail "no scratch directory"
+printf 'copy_out a.txt\ncopy_out b.txt\nrm b.txt\nquit\n' | run_shell > ../log
+cd ..
+cmp -s a.txt out/a.txt || fail "writing b.txt changed a.txt"
+! cmp -s a.txt out/b.txt || fail "the write did not change b.txt"
+
+printf 'freespace\nquit\n' | run_shell > log
+[ "$(free_sectors)" = "$before" ] ||
+  fail "$(free_sectors) sectors free after removing the clone, not $before"
+check_fsck
+pass
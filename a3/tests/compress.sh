@@ -0,0 +1,26 @@
+#!/bin/sh
+# A compressed file takes fewer sectors and reads back the same,
+# before and after it is decompressed again.
+. "$(dirname "$0")/lib"
+
+for i in $(seq 1 400); do echo "line $i of a very compressible file"; done > c.txt
+printf 'copy_in c.txt\ncompress c.txt\nquit\n' | run_shell -f > log
+sectors=$(sed -n 's/^c.txt: \([0-9]*\) sectors before, \([0-9]*\) after$/\1 \2/p' log)
+[ -n "$sectors" ] || fail "compress did not report its sectors"
+set -- $sectors
+[ "$2" -lt "$1" ] || fail "compress took $2 sectors for $1"
+check_fsck
+
+mkdir out && cd out || fail "no scratch directory"
+printf 'copy_out c.txt\nquit\n' | run_shell > ../log
+cd ..
+cmp -s c.txt out/c.txt || fail "compressed c.txt reads back different"
+
+rm out/c.txt
+cd out
+printf 'compress -d c.txt\ncopy_out c.txt\nquit\n' | run_shell > ../log
+cd ..
+expect "c.txt: $2 sectors before, $1 after"
+cmp -s c.txt out/c.txt || fail "decompressed c.txt reads back different"
+check_fsck
+pass
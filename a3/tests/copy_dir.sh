@@ -0,0 +1,43 @@
+#!/bin/sh
+# copy_in_dir and copy_out_dir with no worker threads, a round trip
+# of a host tree with the same name in two directories, and
+# copy_out_dir of the current directory.
+. "$(dirname "$0")/lib"
+
+mkdir -p in/sub in/a in/b
+for i in 1 2 3 4 5; do echo "file $i" > in/a$i; done
+echo deep > in/sub/b
+echo "first x" > in/a/x
+echo "second x" > in/b/x
+echo nested > q.txt
+
+# every pthread_create() fails, so the shell thread copies each file
+NO_THREADS=1 run_shell -f <<'END' > log
+copy_in_dir in
+copy_out_dir flat
+quit
+END
+expect "8 files: Copied in"
+expect "8 files: Copied out"
+diff -r in flat > /dev/null || fail "flat differs from in"
+
+# into and out of a subdirectory
+run_shell <<'END' > log
+mkdir d
+cd d
+copy_in_dir in
+copy_in q.txt
+mkdir e
+cd e
+copy_in q.txt
+cd /d
+copy_out_dir out
+quit
+END
+cmp -s q.txt out/q.txt || fail "out/q.txt differs"
+cmp -s q.txt out/e/q.txt || fail "out/e/q.txt differs"
+cmp -s in/a/x out/a/x || fail "out/a/x differs"
+cmp -s in/b/x out/b/x || fail "out/b/x differs"
+[ -e out/a1 ] && [ ! -e out/d ] || fail "out is not the tree below /d"
+check_fsck
+pass
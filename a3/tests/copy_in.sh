@@ -0,0 +1,20 @@
+#!/bin/sh
+# copy_in without a reader thread, and a copy_in that fails part way
+# leaves no file behind.
+. "$(dirname "$0")/lib"
+
+mkdir -p host/dir out
+head -c 200000 "$top/blank.dsk" | tr '\0' 'x' > host/big
+
+NO_THREADS=1 run_shell -f <<END > log
+copy_in $work/host/big
+copy_out $work/out/big
+copy_in $work/host/dir
+ls
+quit
+END
+cmp -s host/big out/big || fail "out/big differs"
+expect "Failed to read file"
+grep -q "^dir" log && fail "dir was left on the image"
+check_fsck
+pass
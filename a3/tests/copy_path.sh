@@ -0,0 +1,18 @@
+#!/bin/sh
+# copy_in and copy_out of a host path that has directories in it keep
+# the file under its last component on the image.
+. "$(dirname "$0")/lib"
+
+mkdir -p host/sub out
+echo "some text" > host/sub/x.txt
+
+run_shell -f <<END > log
+copy_in $work/host/sub/x.txt
+ls
+copy_out $work/out/x.txt
+quit
+END
+expect "^x.txt"
+cmp -s host/sub/x.txt out/x.txt || fail "out/x.txt differs"
+check_fsck
+pass
@@ -0,0 +1,28 @@
+/* Preloaded by tests that need the shell to crash in the middle of a
+   journal commit: once a journal header that names sectors to replay
+   reaches the disk, the process exits before any of them get home. */
+#define _GNU_SOURCE
+#include <dlfcn.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+
+/* Must match fs/journal.c. */
+#define JOURNAL_MAGIC 0x4c4e524a
+
+ssize_t pwrite(int fd, const void *buf, size_t count, off_t offset) {
+  static ssize_t (*real)(int, const void *, size_t, off_t);
+  uint32_t words[3];
+  ssize_t ret;
+
+  if (real == NULL)
+    real = (ssize_t (*)(int, const void *, size_t, off_t))dlsym(RTLD_NEXT,
+                                                                 "pwrite");
+  ret = real(fd, buf, count, offset);
+  if (count == 512) {
+    memcpy(words, buf, sizeof words);
+    if (words[0] == JOURNAL_MAGIC && words[2] > 0)
+      _exit(0);
+  }
+  return ret;
+}
@@ -0,0 +1,46 @@
+#!/bin/sh
+# A copy of a file in a subdirectory shares its sectors after a
+# remount, writing the copy leaves the original alone, and removing
+# the copy gives back every sector it took.
+. "$(dirname "$0")/lib"
+
+free_sectors() {
+  sed -n 's/^Num free sectors: \([0-9]*\) (.*/\1/p' log
+}
+
+head -c 6000 /dev/urandom | od -An -tx1 > a.txt
+# The first shared sector creates the reference count file, which
+# stays.
+run_shell -f <<'END' > log
+dedup on
+mkdir d
+cd d
+copy_in a.txt
+cd /
+copy_in a.txt
+rm a.txt
+freespace
+quit
+END
+before=$(free_sectors)
+[ -n "$before" ] || fail "freespace printed nothing"
+
+# the hash table is rebuilt from the files below the root
+printf 'copy_in a.txt\nfreespace\ndedupstat\nquit\n' | run_shell > log
+[ $((before - $(free_sectors))) -lt 8 ] || fail "the copy was not shared"
+expect "Space saved: [1-9]"
+
+# The file stays open until the shell exits: change it on its own.
+printf 'write a.txt changed\nquit\n' | run_shell > log
+
+mkdir out1 out2 && cd out1 || fail "no scratch directory"
+printf 'cd d\ncopy_out a.txt\nquit\n' | run_shell > ../log
+cd ../out2
+printf 'copy_out a.txt\nrm a.txt\nfreespace\nquit\n' | run_shell > ../log
+cd ..
+cmp -s a.txt out1/a.txt || fail "writing the copy changed d/a.txt"
+! cmp -s a.txt out2/a.txt || fail "the write did not change the copy"
+[ "$(free_sectors)" = "$before" ] ||
+  fail "$(free_sectors) sectors free after removing the copy, not $before"
+check_fsck
+pass
@@ -0,0 +1,21 @@
+#!/bin/sh
+# A file deduplicated against a directory's sectors would be
+# overwritten by later entries of that directory.
+. "$(dirname "$0")/lib"
+
+head -c 4096 /dev/zero > zero.bin
+{
+  echo "mkdir d"
+  echo "dedup on"
+  echo "copy_in zero.bin"
+  for i in $(seq 1 60); do echo "create d/f$i 10"; done
+  echo "quit"
+} | run_shell -f > log
+
+mkdir out && cd out || fail "no scratch directory"
+printf 'copy_out zero.bin\nquit\n' | run_shell > ../log
+cd ..
+expect "Copied out"
+cmp -s zero.bin out/zero.bin || fail "zero.bin was overwritten"
+check_fsck
+pass
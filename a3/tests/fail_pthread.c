@@ -0,0 +1,13 @@
+/* Preloaded by tests that need every pthread_create() to fail, to
+   exercise the paths that run without worker threads. */
+#include <errno.h>
+#include <pthread.h>
+
+int pthread_create(pthread_t *thread, const pthread_attr_t *attr,
+                   void *(*start)(void *), void *arg) {
+  (void)thread;
+  (void)attr;
+  (void)start;
+  (void)arg;
+  return EAGAIN;
+}
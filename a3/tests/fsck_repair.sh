@@ -0,0 +1,70 @@
+#!/bin/sh
+# myfsck finds a leaked and a doubly allocated sector made behind the
+# file system's back, and -r repairs them.
+. "$(dirname "$0")/lib"
+
+# Sector S of the file system is at byte (S + 2) * 512 of t.dsk.
+offset() {
+  echo $((($1 + 2) * 512))
+}
+
+# Prints the 32-bit word at byte $1 of t.dsk.
+peek() {
+  od -An -tu4 -N4 -j"$1" t.dsk | tr -d ' '
+}
+
+# Writes the 32-bit word $2 at byte $1 of t.dsk.
+poke() {
+  printf "$(printf '\\%03o\\%03o\\%03o\\%03o' $(($2 & 255)) \
+    $(($2 >> 8 & 255)) $(($2 >> 16 & 255)) $(($2 >> 24 & 255)))" |
+    dd of=t.dsk bs=1 seek="$1" conv=notrunc 2>/dev/null
+}
+
+# Prints the sector holding the start of file data $1.
+data_sector() {
+  echo $(($(grep -obUa "$1" t.dsk | head -n 1 | cut -d: -f1) / 512 - 2))
+}
+
+# Runs myfsck with $1, failing unless it exits with $2.
+fsck_status() {
+  "$top/myfsck" t.dsk $1 > fsck.log 2>&1
+  status=$?
+  [ "$status" = "$2" ] || fail "myfsck $1 exited with $status, not $2"
+}
+
+echo "first file" > a.txt
+echo "second file" > b.txt
+printf 'copy_in a.txt\ncopy_in b.txt\nquit\n' | run_shell -f > log
+check_fsck
+
+# Leak: mark sector 2000 used in the free map, whose inode is sector 0.
+fm=$(peek "$(offset 0)")
+poke $(($(offset "$fm") + 248)) 65536
+fsck_status "" 4
+grep -q "Leaked sectors: 1" fsck.log || fail "the leaked sector was missed"
+fsck_status -r 1
+check_fsck
+
+# Double allocation: point b.txt's first data sector at a.txt's.
+a=$(data_sector "first file")
+b=$(data_sector "second file")
+inode=
+for s in $(seq 2 100); do
+  if [ "$(peek "$(offset "$s")")" = "$b" ]; then
+    inode=$s
+    break
+  fi
+done
+[ -n "$inode" ] || fail "b.txt's inode is not on the disk"
+poke "$(offset "$inode")" "$a"
+fsck_status "" 4
+grep -q "Double-allocated sectors: 1" fsck.log ||
+  fail "the doubly allocated sector was missed"
+fsck_status -r 1
+check_fsck
+
+mkdir out && cd out || fail "no scratch directory"
+printf 'copy_out a.txt\nquit\n' | run_shell > ../log
+cd ..
+cmp -s a.txt out/a.txt || fail "the repair changed a.txt"
+pass
@@ -0,0 +1,31 @@
+#!/bin/sh
+# A shell that dies once a journal commit is written, before any of
+# its sectors get home, leaves a file system that the next mount
+# replays in full.  The journal holds metadata only: the files come
+# back with their sizes, but data still in the cache is lost.
+. "$(dirname "$0")/lib"
+
+mkdir in
+for i in $(seq 1 200); do echo "file $i" > in/f$i; done
+
+# one command, and so one commit, changing more sectors than the
+# journal header names on its own
+printf 'journal on 1024\nquit\n' | run_shell -f > log
+journal=$(sed -n 's/^Journal: on, [0-9]* sectors at sector \([0-9]*\),.*/\1/p' log)
+[ -n "$journal" ] || fail "the journal did not turn on"
+printf 'copy_in_dir in\nquit\n' |
+  LD_PRELOAD="$top/tests/crash_journal.so" "$top/myshell" t.dsk > log
+cnt=$(od -An -tu4 -N4 -j$((($journal + 2) * 512 + 8)) t.dsk | tr -d ' ')
+[ "$cnt" -gt 123 ] || fail "the crash left $cnt sectors to replay"
+
+mkdir out && cd out || fail "no scratch directory"
+printf 'journal\ncopy_out_dir in\nquit\n' | run_shell > ../log
+cd ..
+expect "Journal: replayed $cnt sectors"
+expect "$cnt replayed"
+for f in in/*; do
+  [ "$(wc -c < "$f")" = "$(wc -c < "out/$f" 2>/dev/null)" ] ||
+    fail "out/$f was not replayed"
+done
+check_fsck
+pass
@@ -0,0 +1,19 @@
+#!/bin/sh
+# Scrub and reads both catch a data sector changed behind the file
+# system's back.
+. "$(dirname "$0")/lib"
+
+for i in $(seq 1 20); do echo "scrub marker $i"; done > s.txt
+printf 'checksum on\ncopy_in s.txt\nscrub\nquit\n' | run_shell -f > log
+expect "Copied in"
+expect ": 0 bad"
+
+off=$(grep -obUa "scrub marker 1$" t.dsk | head -n 1 | cut -d: -f1)
+[ -n "$off" ] || fail "s.txt is not on the disk"
+printf 'X' | dd of=t.dsk bs=1 seek="$off" conv=notrunc 2>/dev/null
+
+printf 'scrub\ncat s.txt\nquit\n' | run_shell > log
+expect "^Checksum mismatch in sector"
+expect ": 1 bad"
+expect "Warning: checksum mismatch in sector"
+pass
@@ -0,0 +1,36 @@
+#!/bin/sh
+# A snapshot keeps a file as it was while the file changes, restores
+# it, and gives back every sector once it is deleted.
+. "$(dirname "$0")/lib"
+
+free_sectors() {
+  sed -n 's/^Num free sectors: \([0-9]*\) (.*/\1/p' log
+}
+
+head -c 6000 /dev/urandom | od -An -tx1 > a.txt
+# The first snapshot creates the snapshot table, which stays.
+printf 'copy_in a.txt\nsnapshot s0\nsnapshot -d s0\nfreespace\nquit\n' |
+  run_shell -f > log
+before=$(free_sectors)
+[ -n "$before" ] || fail "freespace printed nothing"
+
+# The file stays open until the shell exits: change it on its own.
+printf 'snapshot s1\nwrite a.txt changed\nquit\n' | run_shell > log
+expect "Created snapshot s1"
+
+mkdir out1 out2 && cd out1 || fail "no scratch directory"
+printf 'copy_out a.txt\nquit\n' | run_shell > ../log
+cd ../out2
+printf 'snapshot -r s1\nsnapshot -d s1\ncopy_out a.txt\nquit\n' |
+  run_shell > ../log
+cd ..
+expect "Restored snapshot s1"
+! cmp -s a.txt out1/a.txt || fail "the write did not change a.txt"
+cmp -s a.txt out2/a.txt || fail "the restored a.txt differs"
+
+printf 'snapshot -l\nfreespace\nquit\n' | run_shell > log
+expect "No snapshots"
+[ "$(free_sectors)" = "$before" ] ||
+  fail "$(free_sectors) sectors free after deleting the snapshot, not $before"
+check_fsck
+pass